@@ -0,0 +1,110 @@
+#include "operations.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Throughput of concurrent publishes to different boxes, with a growing
+// number of publisher threads (one box file each, created beforehand, as the
+// broker creates box files when boxes are created). Every publish opens the
+// box file, appends a message and closes it again, so it goes through the
+// root directory, the box's inode and the open file table: with one global
+// lock publishes to different boxes queue behind each other, while with
+// per-inode locks they only share the root directory's read lock.
+//
+// usage: box-scaling-bench [publishes_per_thread] [latency_ns]
+//
+// With a latency, each storage access sleeps for that long instead of
+// spinning (a disk, rather than a slow CPU), so publishes to different boxes
+// overlap even on a single core. Prints one JSON object per thread count.
+
+#define MAX_THREADS 16
+#define MESSAGE_SIZE 64
+
+static size_t publishes;
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static void *publisher(void *arg) {
+	char name[32];
+	snprintf(name, sizeof(name), "/box%zu", (size_t)arg);
+	char message[MESSAGE_SIZE];
+	memset(message, 'x', sizeof(message));
+
+	for (size_t i = 0; i < publishes; i++) {
+		int fd = tfs_open(name, TFS_O_APPEND);
+		if (fd == -1 ||
+			tfs_write(fd, message, sizeof(message)) != sizeof(message)) {
+			fprintf(stderr, "box-scaling-bench: publish %zu failed\n", i);
+			exit(EXIT_FAILURE);
+		}
+		tfs_close(fd);
+	}
+	return NULL;
+}
+
+int main(int argc, char **argv) {
+	publishes = argc > 1 ? strtoul(argv[1], NULL, 10) : 2000;
+	unsigned long latency_ns = argc > 2 ? strtoul(argv[2], NULL, 10) : 0;
+	if (publishes == 0) {
+		fprintf(stderr, "usage: box-scaling-bench [publishes_per_thread] "
+						"[latency_ns]\n");
+		return EXIT_FAILURE;
+	}
+
+	double base_rate = 0;
+	for (size_t threads = 1; threads <= MAX_THREADS; threads *= 2) {
+		tfs_params params = tfs_default_params();
+		params.max_inode_count = MAX_THREADS + 1;
+		size_t blocks = threads * publishes * MESSAGE_SIZE / params.block_size +
+						1024;
+		if (blocks > params.max_block_count) {
+			params.max_block_count = blocks;
+		}
+		if (latency_ns > 0) {
+			params.latency_model = TFS_LATENCY_SLEEP;
+			params.latency_ns = latency_ns;
+		}
+		if (tfs_init(&params) == -1) {
+			fprintf(stderr, "box-scaling-bench: failed to initialize tfs\n");
+			return EXIT_FAILURE;
+		}
+
+		for (size_t i = 0; i < threads; i++) {
+			char name[32];
+			snprintf(name, sizeof(name), "/box%zu", i);
+			if (tfs_close(tfs_open(name, TFS_O_CREAT)) == -1) {
+				fprintf(stderr, "box-scaling-bench: failed to create %s\n",
+						name);
+				return EXIT_FAILURE;
+			}
+		}
+
+		pthread_t tids[MAX_THREADS];
+		double start = now();
+		for (size_t i = 0; i < threads; i++) {
+			pthread_create(&tids[i], NULL, publisher, (void *)i);
+		}
+		for (size_t i = 0; i < threads; i++) {
+			pthread_join(tids[i], NULL);
+		}
+		double elapsed = now() - start;
+		tfs_destroy();
+
+		double rate = (double)(threads * publishes) / elapsed;
+		if (threads == 1) {
+			base_rate = rate;
+		}
+		printf("{\"bench\": \"box-scaling\", \"threads\": %zu, "
+			   "\"latency_ns\": %lu, \"publishes\": %zu, \"seconds\": %.6f, "
+			   "\"publishes_per_second\": %.0f, \"speedup\": %.2f}\n",
+			   threads, latency_ns, threads * publishes, elapsed, rate,
+			   rate / base_rate);
+	}
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,116 @@
+#include "operations.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Per-message latency of appending to a box file, either reopening the file
+// for every message (what the broker used to do) or through one append handle
+// held for the whole publisher session, under each storage latency model.
+//
+// usage: box-write-bench [messages] [message_size]
+//
+// Prints one JSON object per mode and latency model.
+
+#define BOX_PATH "/bench"
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static int reset_box(void) {
+	int fd = tfs_open(BOX_PATH, TFS_O_CREAT | TFS_O_TRUNC);
+	if (fd == -1) {
+		return -1;
+	}
+	return tfs_close(fd);
+}
+
+static double reopen_per_message(char const *message, size_t len,
+								 size_t messages) {
+	double start = now();
+	for (size_t i = 0; i < messages; i++) {
+		int fd = tfs_open(BOX_PATH, TFS_O_APPEND);
+		if (fd == -1 || tfs_write(fd, message, len) != (ssize_t)len) {
+			fprintf(stderr, "box-write-bench: write %zu failed\n", i);
+			exit(EXIT_FAILURE);
+		}
+		tfs_close(fd);
+	}
+	return now() - start;
+}
+
+static double persistent_handle(char const *message, size_t len,
+								size_t messages) {
+	double start = now();
+	int fd = tfs_open(BOX_PATH, TFS_O_APPEND);
+	for (size_t i = 0; i < messages; i++) {
+		if (fd == -1 || tfs_write(fd, message, len) != (ssize_t)len) {
+			fprintf(stderr, "box-write-bench: write %zu failed\n", i);
+			exit(EXIT_FAILURE);
+		}
+	}
+	tfs_close(fd);
+	return now() - start;
+}
+
+static struct {
+	char const *name;
+	tfs_latency_model_t model;
+	unsigned long ns;
+} const latencies[] = {
+	{"none", TFS_LATENCY_NONE, 0},
+	{"spin", TFS_LATENCY_SPIN, 0},
+	{"ns:1000", TFS_LATENCY_CALIBRATED, 1000},
+};
+
+static void report(char const *mode, char const *latency, size_t messages,
+				   size_t len, double elapsed) {
+	printf("{\"bench\": \"box-write\", \"mode\": \"%s\", "
+		   "\"latency\": \"%s\", \"messages\": %zu, "
+		   "\"message_size\": %zu, \"seconds\": %.6f, "
+		   "\"ns_per_message\": %.1f}\n",
+		   mode, latency, messages, len, elapsed,
+		   elapsed * 1e9 / (double)messages);
+}
+
+int main(int argc, char **argv) {
+	size_t messages = argc > 1 ? strtoul(argv[1], NULL, 10) : 100000;
+	size_t len = argc > 2 ? strtoul(argv[2], NULL, 10) : 64;
+	if (messages == 0 || len == 0) {
+		fprintf(stderr, "usage: box-write-bench [messages] [message_size]\n");
+		return EXIT_FAILURE;
+	}
+
+	char *message = malloc(len);
+	memset(message, 'x', len - 1);
+	message[len - 1] = '\n';
+
+	for (size_t i = 0; i < sizeof(latencies) / sizeof(latencies[0]); i++) {
+		// The box file must hold every message of a run
+		tfs_params params = tfs_default_params();
+		size_t blocks = (messages * len) / params.block_size + 64;
+		if (blocks > params.max_block_count) {
+			params.max_block_count = blocks;
+		}
+		params.latency_model = latencies[i].model;
+		params.latency_ns = latencies[i].ns;
+		if (tfs_init(&params) == -1) {
+			fprintf(stderr, "box-write-bench: failed to initialize tfs\n");
+			return EXIT_FAILURE;
+		}
+
+		reset_box();
+		report("reopen", latencies[i].name, messages, len,
+			   reopen_per_message(message, len, messages));
+		reset_box();
+		report("persistent", latencies[i].name, messages, len,
+			   persistent_handle(message, len, messages));
+		tfs_destroy();
+	}
+
+	free(message);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,484 @@
+#include "protocol.h"
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+// End-to-end broker benchmark: starts mbroker/mbroker, creates B boxes and
+// drives P publishers and S subscribers through the broker's fifos, speaking
+// the same protocol as pub and sub. Publishers and subscribers are spread
+// over the boxes round-robin. Every message starts with the time it was
+// published, from which subscribers measure publish-to-deliver latency.
+//
+// usage: broker-bench [-p publishers] [-s subscribers] [-b boxes]
+//                     [-n messages_per_publisher] [-l message_size]
+//                     [-k messages_per_batch] [-r messages_per_second]
+//                     [-- mbroker options]
+//
+// -r paces each publisher (0, the default, publishes as fast as possible).
+// Must be run from the root of the project. Prints one JSON object.
+
+#define BROKER_PATH "mbroker/mbroker"
+#define PUBLISHER_REGISTER_CODE 1
+#define SUBSCRIBER_REGISTER_CODE 2
+#define CREATE_BOX_REQUEST_CODE 3
+
+// Timestamp at the start of every message: 16 hex digits
+#define STAMP_SIZE 16
+
+// Give up once no message has been delivered for this long
+#define IDLE_TIMEOUT_S 5.0
+
+struct subscriber {
+	pthread_t thread;
+	int pipenum;
+	size_t expected;
+	_Atomic size_t received;
+	uint64_t *latencies_ns;
+	_Atomic uint64_t last_ns; // when the last message was delivered
+};
+
+struct publisher {
+	pthread_t thread;
+	int pipenum;
+};
+
+static char dir[64];
+static char server_pipe[128];
+static int server_fd = -1;
+static pid_t broker_pid = -1;
+
+static size_t messages = 10000;
+static size_t message_size = 64;
+static size_t batch_messages = 8;
+static double rate = 0;
+static pthread_barrier_t go;
+static uint64_t start_ns;
+
+static uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static void fail(char const *what) {
+	fprintf(stderr, "broker-bench: %s\n", what);
+	if (broker_pid > 0) {
+		kill(broker_pid, SIGKILL);
+	}
+	exit(EXIT_FAILURE);
+}
+
+static void pipe_path(char *path, size_t size, char const *name, size_t i) {
+	snprintf(path, size, "%s/%s%zu", dir, name, i);
+}
+
+// Sends a request through the broker's fifo, once the client's fifo exists
+static void send_request(uint8_t code, char const *path, char const *box) {
+	if (mkfifo(path, 0640) != 0) {
+		fail("failed to create client fifo");
+	}
+	char frame[FRAME_MAX_SIZE];
+	ssize_t n = request_encode(frame, sizeof(frame), code, path, box,
+							   START_EARLIEST);
+	if (n <= 0 || write(server_fd, frame, (size_t)n) != n) {
+		fail("failed to send request");
+	}
+}
+
+// Creates a box, waiting for the broker's answer
+static void create_box(size_t b) {
+	char box[32], path[128];
+	snprintf(box, sizeof(box), "bench%zu", b);
+	pipe_path(path, sizeof(path), "manager", b);
+	send_request(CREATE_BOX_REQUEST_CODE, path, box);
+
+	int pipenum = open(path, O_RDONLY);
+	struct frame_reader *reader = malloc(sizeof(struct frame_reader));
+	frame_reader_init(reader, pipenum);
+	char const *frame;
+	struct wire_answer answer;
+	ssize_t n = frame_reader_next(reader, &frame);
+	if (n <= 0 || answer_decode(frame, (size_t)n, &answer) <= 0 ||
+		answer.return_code != 0) {
+		fail("failed to create box");
+	}
+	free(reader);
+	close(pipenum);
+	unlink(path);
+}
+
+static void *subscriber_run(void *arg) {
+	struct subscriber *sub = arg;
+	struct frame_reader *reader = malloc(sizeof(struct frame_reader));
+	frame_reader_init(reader, sub->pipenum);
+
+	char const *frame;
+	ssize_t n;
+	while (sub->received < sub->expected &&
+		   (n = frame_reader_next(reader, &frame)) > 0) {
+		uint64_t now = now_ns();
+		struct wire_message msg;
+		if (message_decode(frame, (size_t)n, &msg) <= 0 ||
+			msg.message.length < STAMP_SIZE) {
+			break;
+		}
+		char stamp[STAMP_SIZE + 1];
+		memcpy(stamp, msg.message.data, STAMP_SIZE);
+		stamp[STAMP_SIZE] = '\0';
+		uint64_t sent = strtoull(stamp, NULL, 16);
+
+		sub->latencies_ns[sub->received] = now - sent;
+		sub->last_ns = now;
+		sub->received++;
+	}
+	free(reader);
+	return NULL;
+}
+
+static void *publisher_run(void *arg) {
+	struct publisher *pub = arg;
+	pthread_barrier_wait(&go);
+
+	char message[MESSAGE_MAX_LENGTH + 1];
+	memset(message, 'x', sizeof(message));
+	char batch[BATCH_MAX_SIZE];
+	size_t batch_len;
+	batch_init(batch, &batch_len);
+
+	for (size_t i = 0; i < messages; i++) {
+		if (rate > 0) {
+			uint64_t due = start_ns + (uint64_t)((double)i / rate * 1e9);
+			uint64_t now = now_ns();
+			if (due > now) {
+				struct timespec ts = {(time_t)((due - now) / 1000000000u),
+									  (long)((due - now) % 1000000000u)};
+				nanosleep(&ts, NULL);
+			}
+		}
+
+		char stamp[STAMP_SIZE + 1];
+		snprintf(stamp, sizeof(stamp), "%016llx",
+				 (unsigned long long)now_ns());
+		memcpy(message, stamp, STAMP_SIZE);
+		if (batch_append(batch, &batch_len, message, message_size) != 0) {
+			break; // cannot happen: message_size was checked
+		}
+
+		if ((i + 1) % batch_messages == 0 || i + 1 == messages) {
+			batch_finish(batch, batch_len);
+			if (write(pub->pipenum, batch, batch_len) < 0) {
+				break;
+			}
+			batch_init(batch, &batch_len);
+		}
+	}
+	close(pub->pipenum);
+	return NULL;
+}
+
+// Broker CPU time so far, in seconds
+static double broker_cpu(void) {
+	char path[64];
+	snprintf(path, sizeof(path), "/proc/%d/stat", (int)broker_pid);
+	FILE *stat = fopen(path, "r");
+	if (stat == NULL) {
+		return 0;
+	}
+
+	// utime and stime are the 14th and 15th fields, after the command name
+	// (which may contain spaces, but ends with the last ')')
+	char line[1024];
+	unsigned long utime = 0, stime = 0;
+	if (fgets(line, sizeof(line), stat) != NULL) {
+		char *rest = strrchr(line, ')');
+		if (rest == NULL ||
+			sscanf(rest + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u "
+							 "%lu %lu",
+				   &utime, &stime) != 2) {
+			utime = stime = 0;
+		}
+	}
+	fclose(stat);
+	return (double)(utime + stime) / (double)sysconf(_SC_CLK_TCK);
+}
+
+// Write syscalls the broker has made so far
+static unsigned long broker_writes(void) {
+	char path[64];
+	snprintf(path, sizeof(path), "/proc/%d/io", (int)broker_pid);
+	FILE *io = fopen(path, "r");
+	if (io == NULL) {
+		return 0;
+	}
+
+	char line[128];
+	unsigned long writes = 0;
+	while (fgets(line, sizeof(line), io) != NULL) {
+		if (sscanf(line, "syscw: %lu", &writes) == 1) {
+			break;
+		}
+	}
+	fclose(io);
+	return writes;
+}
+
+static void start_broker(char **options, int option_count, size_t sessions,
+						 size_t boxes) {
+	char sessions_arg[32], boxes_arg[32];
+	snprintf(sessions_arg, sizeof(sessions_arg), "%zu", sessions);
+	snprintf(boxes_arg, sizeof(boxes_arg), "%zu", boxes);
+
+	char *args[option_count + 5];
+	args[0] = BROKER_PATH;
+	for (int i = 0; i < option_count; i++) {
+		args[i + 1] = options[i];
+	}
+	args[option_count + 1] = server_pipe;
+	args[option_count + 2] = sessions_arg;
+	args[option_count + 3] = boxes_arg;
+	args[option_count + 4] = NULL;
+
+	broker_pid = fork();
+	if (broker_pid == -1) {
+		fail("failed to start the broker");
+	} else if (broker_pid == 0) {
+		execv(BROKER_PATH, args);
+		_exit(EXIT_FAILURE);
+	}
+
+	// The broker creates its fifo and opens it. Keep it open for the whole
+	// run, to send every request through the same handle.
+	for (int tries = 0; tries < 200; tries++) {
+		server_fd = open(server_pipe, O_WRONLY | O_NONBLOCK);
+		if (server_fd != -1) {
+			break;
+		}
+		struct timespec ts = {0, 10000000};
+		nanosleep(&ts, NULL);
+	}
+	if (server_fd == -1) {
+		fail("the broker did not start");
+	}
+	fcntl(server_fd, F_SETFL, fcntl(server_fd, F_GETFL) & ~O_NONBLOCK);
+}
+
+static int compare_u64(void const *a, void const *b) {
+	uint64_t x = *(uint64_t const *)a, y = *(uint64_t const *)b;
+	return x < y ? -1 : x > y;
+}
+
+static double percentile_us(uint64_t const *sorted, size_t count, double p) {
+	if (count == 0) {
+		return 0;
+	}
+	size_t i = (size_t)(p * (double)(count - 1) + 0.5);
+	return (double)sorted[i] / 1e3;
+}
+
+int main(int argc, char **argv) {
+	size_t publishers = 4, subscribers = 8, boxes = 4;
+	int opt;
+	while ((opt = getopt(argc, argv, "p:s:b:n:l:k:r:")) != -1) {
+		switch (opt) {
+			case 'p':
+				publishers = strtoul(optarg, NULL, 10);
+				break;
+			case 's':
+				subscribers = strtoul(optarg, NULL, 10);
+				break;
+			case 'b':
+				boxes = strtoul(optarg, NULL, 10);
+				break;
+			case 'n':
+				messages = strtoul(optarg, NULL, 10);
+				break;
+			case 'l':
+				message_size = strtoul(optarg, NULL, 10);
+				break;
+			case 'k':
+				batch_messages = strtoul(optarg, NULL, 10);
+				break;
+			case 'r':
+				rate = strtod(optarg, NULL);
+				break;
+			default:
+				fprintf(stderr, "usage: broker-bench [-p publishers] "
+								"[-s subscribers] [-b boxes] [-n messages] "
+								"[-l message_size] [-k batch] [-r rate] "
+								"[-- mbroker options]\n");
+				return EXIT_FAILURE;
+		}
+	}
+	size_t record_size = sizeof(uint16_t) + message_size;
+	if (boxes == 0 || publishers < boxes || messages == 0 ||
+		batch_messages == 0 || message_size < STAMP_SIZE ||
+		message_size > MESSAGE_MAX_LENGTH ||
+		sizeof(struct batch_header) + batch_messages * record_size >
+			BATCH_MAX_SIZE) {
+		fprintf(stderr, "broker-bench: every box needs a publisher, and a "
+						"batch must fit in PIPE_BUF\n");
+		return EXIT_FAILURE;
+	}
+
+	snprintf(dir, sizeof(dir), "/tmp/broker-bench-%d", (int)getpid());
+	snprintf(server_pipe, sizeof(server_pipe), "%s/server", dir);
+	if (mkdir(dir, 0750) != 0) {
+		fail("failed to create the fifo directory");
+	}
+	signal(SIGPIPE, SIG_IGN);
+	start_broker(argv + optind, argc - optind, publishers + subscribers,
+				 boxes);
+
+	for (size_t b = 0; b < boxes; b++) {
+		create_box(b);
+	}
+
+	// Register sessions one at a time: the broker opens a session's fifo
+	// before it takes the next request
+	char box[32];
+	struct subscriber *subs = calloc(subscribers, sizeof(struct subscriber));
+	for (size_t i = 0; i < subscribers; i++) {
+		char path[128];
+		pipe_path(path, sizeof(path), "sub", i);
+		snprintf(box, sizeof(box), "bench%zu", i % boxes);
+		send_request(SUBSCRIBER_REGISTER_CODE, path, box);
+		subs[i].pipenum = open(path, O_RDONLY);
+		if (subs[i].pipenum == -1) {
+			fail("failed to open subscriber fifo");
+		}
+		size_t box_publishers = publishers / boxes +
+								(i % boxes < publishers % boxes ? 1 : 0);
+		subs[i].expected = box_publishers * messages;
+		subs[i].latencies_ns = malloc(subs[i].expected * sizeof(uint64_t));
+		pthread_create(&subs[i].thread, NULL, subscriber_run, &subs[i]);
+	}
+
+	struct publisher *pubs = calloc(publishers, sizeof(struct publisher));
+	pthread_barrier_init(&go, NULL, (unsigned)publishers + 1);
+	for (size_t i = 0; i < publishers; i++) {
+		char path[128];
+		pipe_path(path, sizeof(path), "pub", i);
+		snprintf(box, sizeof(box), "bench%zu", i % boxes);
+		send_request(PUBLISHER_REGISTER_CODE, path, box);
+		pubs[i].pipenum = open(path, O_WRONLY);
+		if (pubs[i].pipenum == -1) {
+			fail("failed to open publisher fifo");
+		}
+		pthread_create(&pubs[i].thread, NULL, publisher_run, &pubs[i]);
+	}
+
+	double cpu_start = broker_cpu();
+	unsigned long writes_start = broker_writes();
+	start_ns = now_ns();
+	pthread_barrier_wait(&go);
+	for (size_t i = 0; i < publishers; i++) {
+		pthread_join(pubs[i].thread, NULL);
+	}
+
+	// Wait for the subscribers to get every message, or to stop getting any
+	size_t expected = 0, received = 0, last_received = 0;
+	uint64_t progress_ns = now_ns();
+	for (size_t i = 0; i < subscribers; i++) {
+		expected += subs[i].expected;
+	}
+	while (true) {
+		received = 0;
+		for (size_t i = 0; i < subscribers; i++) {
+			received += subs[i].received;
+		}
+		if (received == expected) {
+			break;
+		} else if (received != last_received) {
+			last_received = received;
+			progress_ns = now_ns();
+		} else if ((double)(now_ns() - progress_ns) / 1e9 > IDLE_TIMEOUT_S) {
+			fprintf(stderr, "broker-bench: %zu of %zu messages delivered\n",
+					received, expected);
+			break;
+		}
+		struct timespec ts = {0, 1000000};
+		nanosleep(&ts, NULL);
+	}
+	double cpu = broker_cpu() - cpu_start;
+	unsigned long writes = broker_writes() - writes_start;
+
+	uint64_t end_ns = start_ns;
+	uint64_t *latencies = malloc((received + 1) * sizeof(uint64_t));
+	size_t count = 0;
+	for (size_t i = 0; i < subscribers; i++) {
+		size_t n = subs[i].received;
+		memcpy(latencies + count, subs[i].latencies_ns, n * sizeof(uint64_t));
+		count += n;
+		if (n > 0 && subs[i].last_ns > end_ns) {
+			end_ns = subs[i].last_ns;
+		}
+	}
+	qsort(latencies, count, sizeof(uint64_t), compare_u64);
+	double seconds = (double)(end_ns - start_ns) / 1e9;
+
+	// Stop the broker, which leaves its box segments behind; the subscribers
+	// still waiting see the end of their fifo
+	kill(broker_pid, SIGINT);
+	waitpid(broker_pid, NULL, 0);
+	for (size_t b = 0; b < boxes; b++) {
+		char segment[64];
+		snprintf(segment, sizeof(segment), "/mbroker-%d-bench%zu",
+				 (int)broker_pid, b);
+		shm_unlink(segment);
+	}
+	for (size_t i = 0; i < subscribers; i++) {
+		pthread_join(subs[i].thread, NULL);
+		close(subs[i].pipenum);
+		free(subs[i].latencies_ns);
+		char path[128];
+		pipe_path(path, sizeof(path), "sub", i);
+		unlink(path);
+	}
+	for (size_t i = 0; i < publishers; i++) {
+		char path[128];
+		pipe_path(path, sizeof(path), "pub", i);
+		unlink(path);
+	}
+	close(server_fd);
+	unlink(server_pipe);
+	rmdir(dir);
+
+	char options[256] = "";
+	for (int i = optind; i < argc; i++) {
+		size_t len = strlen(options);
+		snprintf(options + len, sizeof(options) - len, "%s%s",
+				 len > 0 ? " " : "", argv[i]);
+	}
+	printf("{\"bench\": \"broker\", \"broker_options\": \"%s\", "
+		   "\"publishers\": %zu, \"subscribers\": %zu, \"boxes\": %zu, "
+		   "\"message_size\": %zu, \"batch\": %zu, \"rate\": %.0f, "
+		   "\"published\": %zu, \"delivered\": %zu, \"expected\": %zu, "
+		   "\"seconds\": %.6f, \"msgs_per_second\": %.0f, "
+		   "\"p50_us\": %.1f, \"p99_us\": %.1f, \"p999_us\": %.1f, "
+		   "\"max_us\": %.1f, \"broker_cpu_us_per_msg\": %.3f, "
+		   "\"broker_writes_per_msg\": %.3f}\n",
+		   options, publishers, subscribers, boxes, message_size,
+		   batch_messages, rate, publishers * messages, count, expected,
+		   seconds, seconds > 0 ? (double)count / seconds : 0.0,
+		   percentile_us(latencies, count, 0.50),
+		   percentile_us(latencies, count, 0.99),
+		   percentile_us(latencies, count, 0.999),
+		   count > 0 ? (double)latencies[count - 1] / 1e3 : 0.0,
+		   count > 0 ? cpu * 1e6 / (double)count : 0.0,
+		   count > 0 ? (double)writes / (double)count : 0.0);
+	free(latencies);
+	free(subs);
+	free(pubs);
+	pthread_barrier_destroy(&go);
+	return count == expected ? EXIT_SUCCESS : EXIT_FAILURE;
+}
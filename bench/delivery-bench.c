@@ -0,0 +1,115 @@
+#include "mbroker/delivery.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// Write syscalls needed to deliver a backlog of messages to a subscriber,
+// one message per write (what the broker used to do) or gathered into
+// deliveries of up to max_frames messages and PIPE_BUF bytes, in both
+// protocol versions. A reader thread drains the pipe meanwhile.
+//
+// usage: delivery-bench [messages] [message_size]
+//
+// Prints one JSON object per mode.
+
+static size_t messages;
+static size_t message_size;
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+// Reads until the end of the pipe, and returns how many bytes it got
+static void *reader(void *arg) {
+	int fd = *(int *)arg;
+	char buffer[16 * PIPE_BUF];
+	size_t *bytes = malloc(sizeof(size_t));
+	*bytes = 0;
+	ssize_t n;
+	while ((n = read(fd, buffer, sizeof(buffer))) > 0) {
+		*bytes += (size_t)n;
+	}
+	return bytes;
+}
+
+static void run(uint8_t version, size_t max_frames, char const *records,
+				size_t record_size) {
+	int fds[2];
+	if (pipe(fds) != 0) {
+		fprintf(stderr, "delivery-bench: failed to create pipe\n");
+		exit(EXIT_FAILURE);
+	}
+	pthread_t thread;
+	pthread_create(&thread, NULL, reader, &fds[0]);
+
+	struct delivery *d = malloc(sizeof(struct delivery));
+	delivery_init(d, version, max_frames);
+	size_t writes = 0;
+	size_t expected = 0;
+	char header[MESSAGE_HEADER_MAX_SIZE];
+	double start = now();
+	for (size_t i = 0; i < messages; i++) {
+		char const *message = records + i * record_size;
+		if (!delivery_add(d, message, (uint16_t)message_size, i)) {
+			if (delivery_send(d, fds[1]) < 0) {
+				fprintf(stderr, "delivery-bench: write failed\n");
+				exit(EXIT_FAILURE);
+			}
+			writes++;
+			delivery_add(d, message, (uint16_t)message_size, i);
+		}
+		expected += version == PROTOCOL_VERSION ?
+			(size_t)message_header_encode(header, sizeof(header),
+										  SUBSCRIBER_MESSAGE_CODE,
+										  message_size) + message_size :
+			sizeof(struct message);
+	}
+	if (d->frames > 0) {
+		delivery_send(d, fds[1]);
+		writes++;
+	}
+	close(fds[1]);
+
+	size_t *received;
+	pthread_join(thread, (void **)&received);
+	double seconds = now() - start;
+	close(fds[0]);
+
+	printf("{\"bench\": \"delivery\", \"version\": %u, \"max_frames\": %zu, "
+		   "\"messages\": %zu, \"message_size\": %zu, \"writes\": %zu, "
+		   "\"writes_per_msg\": %.3f, \"bytes_ok\": %s, "
+		   "\"msgs_per_second\": %.0f}\n",
+		   version == PROTOCOL_VERSION ? 2u : 1u, d->max_frames, messages,
+		   message_size, writes, (double)writes / (double)messages,
+		   *received == expected ? "true" : "false",
+		   (double)messages / seconds);
+	free(received);
+	free(d);
+}
+
+int main(int argc, char **argv) {
+	messages = argc > 1 ? strtoul(argv[1], NULL, 10) : 200000;
+	message_size = argc > 2 ? strtoul(argv[2], NULL, 10) : 64;
+	if (messages == 0 || message_size > MESSAGE_MAX_LENGTH) {
+		fprintf(stderr, "usage: delivery-bench [messages] [message_size]\n");
+		return EXIT_FAILURE;
+	}
+
+	char *records = malloc(messages * message_size + 1);
+	memset(records, 'x', messages * message_size + 1);
+
+	size_t const max_frames[] = {1, 8, DELIVERY_MAX_FRAMES};
+	for (size_t i = 0; i < sizeof(max_frames) / sizeof(*max_frames); i++) {
+		run(PROTOCOL_VERSION, max_frames[i], records, message_size);
+	}
+	run(1, 1, records, message_size);
+	run(1, DELIVERY_MAX_FRAMES, records, message_size);
+
+	free(records);
+	return EXIT_SUCCESS;
+}
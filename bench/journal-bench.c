@@ -0,0 +1,96 @@
+#include "operations.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// Throughput of durable writes through the journal, with a growing number of
+// writer threads (one file each, as with one publisher per box). Every write
+// waits for its commit, which syncs the data written to the image and then
+// writes out the journal, so with group commit the throughput grows with the
+// number of writers while the number of fdatasyncs does not.
+//
+// usage: journal-bench [writes_per_thread] [write_size]
+//
+// Prints one JSON object per thread count.
+
+#define IMAGE_PATH "/tmp/journal-bench.img"
+#define JOURNAL_PATH "/tmp/journal-bench.wal"
+#define MAX_THREADS 16
+
+static size_t writes;
+static size_t len;
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static void *writer(void *arg) {
+	char name[32];
+	snprintf(name, sizeof(name), "/w%zu", (size_t)arg);
+	int fd = tfs_open(name, TFS_O_CREAT | TFS_O_TRUNC);
+
+	char *buffer = malloc(len);
+	memset(buffer, 'x', len);
+	for (size_t i = 0; i < writes; i++) {
+		if (fd == -1 || tfs_write(fd, buffer, len) != (ssize_t)len) {
+			fprintf(stderr, "journal-bench: write %zu failed\n", i);
+			exit(EXIT_FAILURE);
+		}
+	}
+	free(buffer);
+	tfs_close(fd);
+	return NULL;
+}
+
+int main(int argc, char **argv) {
+	writes = argc > 1 ? strtoul(argv[1], NULL, 10) : 200;
+	len = argc > 2 ? strtoul(argv[2], NULL, 10) : 256;
+	if (writes == 0 || len == 0) {
+		fprintf(stderr, "usage: journal-bench [writes_per_thread] "
+						"[write_size]\n");
+		return EXIT_FAILURE;
+	}
+
+	for (size_t threads = 1; threads <= MAX_THREADS; threads *= 2) {
+		unlink(IMAGE_PATH);
+		unlink(JOURNAL_PATH);
+		tfs_params params = tfs_default_params();
+		params.image_path = IMAGE_PATH;
+		params.sync_interval_ms = 0;
+		params.journal_path = JOURNAL_PATH;
+		params.max_open_files_count = MAX_THREADS;
+		size_t blocks = threads * writes * len / params.block_size + 1024;
+		if (blocks > params.max_block_count) {
+			params.max_block_count = blocks;
+		}
+		if (tfs_init(&params) == -1) {
+			fprintf(stderr, "journal-bench: failed to initialize tfs\n");
+			return EXIT_FAILURE;
+		}
+
+		pthread_t tids[MAX_THREADS];
+		double start = now();
+		for (size_t i = 0; i < threads; i++) {
+			pthread_create(&tids[i], NULL, writer, (void *)i);
+		}
+		for (size_t i = 0; i < threads; i++) {
+			pthread_join(tids[i], NULL);
+		}
+		double elapsed = now() - start;
+		tfs_destroy();
+
+		printf("{\"bench\": \"journal\", \"threads\": %zu, "
+			   "\"writes\": %zu, \"write_size\": %zu, \"seconds\": %.6f, "
+			   "\"writes_per_second\": %.0f}\n",
+			   threads, threads * writes, len, elapsed,
+			   (double)(threads * writes) / elapsed);
+	}
+	unlink(IMAGE_PATH);
+	unlink(JOURNAL_PATH);
+	return EXIT_SUCCESS;
+}
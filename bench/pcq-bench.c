@@ -0,0 +1,89 @@
+#include "producer-consumer.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+// Microbenchmark for pc_queue_t: ops/sec for 1-16 producers and consumers.
+//
+// usage: pcq-bench [ops_per_run] [capacity]
+//
+// Prints one JSON object per configuration.
+
+#define MAX_THREADS 16
+
+static pc_queue_t queue;
+static size_t ops_per_producer;
+
+static void *producer(void *arg) {
+	(void)arg;
+	for (size_t i = 1; i <= ops_per_producer; i++) {
+		pcq_enqueue(&queue, (void *)(uintptr_t)i);
+	}
+	return NULL;
+}
+
+static void *consumer(void *arg) {
+	size_t *consumed = (size_t *)arg;
+	while (pcq_dequeue(&queue) != NULL) {
+		(*consumed)++;
+	}
+	return NULL;
+}
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static void run(size_t producers, size_t consumers, size_t ops,
+				size_t capacity) {
+	pthread_t pthreads[MAX_THREADS];
+	pthread_t cthreads[MAX_THREADS];
+	size_t consumed[MAX_THREADS] = {0};
+
+	pcq_create(&queue, capacity);
+	ops_per_producer = ops / producers;
+
+	double start = now();
+	for (size_t i = 0; i < consumers; i++) {
+		pthread_create(&cthreads[i], NULL, consumer, &consumed[i]);
+	}
+	for (size_t i = 0; i < producers; i++) {
+		pthread_create(&pthreads[i], NULL, producer, NULL);
+	}
+	for (size_t i = 0; i < producers; i++) {
+		pthread_join(pthreads[i], NULL);
+	}
+	// one NULL per consumer tells it to stop
+	for (size_t i = 0; i < consumers; i++) {
+		pcq_enqueue(&queue, NULL);
+	}
+	size_t total = 0;
+	for (size_t i = 0; i < consumers; i++) {
+		pthread_join(cthreads[i], NULL);
+		total += consumed[i];
+	}
+	double elapsed = now() - start;
+
+	pcq_destroy(&queue);
+
+	printf("{\"bench\": \"pcq\", \"producers\": %zu, \"consumers\": %zu, "
+		   "\"capacity\": %zu, \"ops\": %zu, \"seconds\": %.6f, "
+		   "\"ops_per_sec\": %.0f}\n",
+		   producers, consumers, capacity, total, elapsed,
+		   (double)total / elapsed);
+}
+
+int main(int argc, char **argv) {
+	size_t ops = argc > 1 ? strtoul(argv[1], NULL, 10) : 1000000;
+	size_t capacity = argc > 2 ? strtoul(argv[2], NULL, 10) : 1024;
+
+	for (size_t p = 1; p <= MAX_THREADS; p *= 2) {
+		for (size_t c = 1; c <= MAX_THREADS; c *= 2) {
+			run(p, c, ops, capacity);
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,274 @@
+#include "protocol.h"
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+// Registration storm: starts mbroker/mbroker and has C clients send N
+// publisher registrations between them through the broker's fifo, each one
+// with its own write, as a crowd of reconnecting clients would. The box they
+// name does not exist, so the workers drop them straight away, and what is
+// measured is how fast the broker takes requests off its fifo and hands them
+// to the workers. The broker is asked for its stats until it has taken every
+// registration.
+//
+// usage: register-bench [-c clients] [-n registrations] [-v 1|2]
+//                       [-- mbroker options]
+//
+// -v picks the protocol version of the requests (1, fixed-size structs, by
+// default). Must be run from the root of the project. Prints one JSON object.
+
+#define BROKER_PATH "mbroker/mbroker"
+#define PUBLISHER_REGISTER_CODE 1
+
+// Give up once the broker has taken no request for this long
+#define IDLE_TIMEOUT_S 5.0
+
+static char dir[64];
+static char server_pipe[128];
+static int server_fd = -1;
+static pid_t broker_pid = -1;
+
+static size_t registrations = 200000;
+static size_t clients = 8;
+static int version = 1;
+static pthread_barrier_t go;
+
+static uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static void fail(char const *what) {
+	fprintf(stderr, "register-bench: %s\n", what);
+	if (broker_pid > 0) {
+		kill(broker_pid, SIGKILL);
+	}
+	exit(EXIT_FAILURE);
+}
+
+// Sends the client's share of the registrations, one write each
+static void *client_run(void *arg) {
+	size_t client = (size_t)arg;
+	size_t count = registrations / clients +
+				   (client < registrations % clients ? 1 : 0);
+
+	char path[128];
+	snprintf(path, sizeof(path), "%s/pub%zu", dir, client);
+	char frame[FRAME_MAX_SIZE];
+	size_t len;
+	if (version == 1) {
+		struct basic_request request =
+			basic_request_init(PUBLISHER_REGISTER_CODE, path, "storm");
+		memcpy(frame, &request, sizeof(request));
+		len = sizeof(request);
+	} else {
+		ssize_t n = request_encode(frame, sizeof(frame),
+								   PUBLISHER_REGISTER_CODE, path, "storm",
+								   START_EARLIEST);
+		if (n <= 0) {
+			fail("failed to encode request");
+		}
+		len = (size_t)n;
+	}
+
+	pthread_barrier_wait(&go);
+	for (size_t i = 0; i < count; i++) {
+		if (write(server_fd, frame, len) != (ssize_t)len) {
+			fail("failed to send request");
+		}
+	}
+	return NULL;
+}
+
+// Requests the broker has taken off its fifo so far, stats requests included,
+// from the "requests" counter of its stats
+static size_t broker_requests(void) {
+	char path[128];
+	snprintf(path, sizeof(path), "%s/stats", dir);
+	if (mkfifo(path, 0640) != 0) {
+		fail("failed to create stats fifo");
+	}
+	char frame[FRAME_MAX_SIZE];
+	ssize_t n = request_encode(frame, sizeof(frame), STATS_REQUEST_CODE, path,
+							   "", START_EARLIEST);
+	if (n <= 0 || write(server_fd, frame, (size_t)n) != n) {
+		fail("failed to send stats request");
+	}
+
+	int pipenum = open(path, O_RDONLY);
+	if (pipenum == -1) {
+		fail("failed to open stats fifo");
+	}
+	struct frame_reader *reader = malloc(sizeof(struct frame_reader));
+	frame_reader_init(reader, pipenum);
+	char const *line;
+	unsigned long requests = 0;
+	while ((n = frame_reader_next(reader, &line)) > 0) {
+		struct wire_message msg;
+		char text[MESSAGE_MAX_LENGTH + 1];
+		if (message_decode(line, (size_t)n, &msg) <= 0) {
+			break;
+		}
+		memcpy(text, msg.message.data, msg.message.length);
+		text[msg.message.length] = '\0';
+		sscanf(text, "{\"counter\": \"requests\", \"value\": %lu}", &requests);
+	}
+	free(reader);
+	close(pipenum);
+	unlink(path);
+	return requests;
+}
+
+// Read syscalls the broker has made so far
+static unsigned long broker_reads(void) {
+	char path[64];
+	snprintf(path, sizeof(path), "/proc/%d/io", (int)broker_pid);
+	FILE *io = fopen(path, "r");
+	if (io == NULL) {
+		return 0;
+	}
+
+	char line[128];
+	unsigned long reads = 0;
+	while (fgets(line, sizeof(line), io) != NULL) {
+		if (sscanf(line, "syscr: %lu", &reads) == 1) {
+			break;
+		}
+	}
+	fclose(io);
+	return reads;
+}
+
+static void start_broker(char **options, int option_count) {
+	char *args[option_count + 5];
+	args[0] = BROKER_PATH;
+	for (int i = 0; i < option_count; i++) {
+		args[i + 1] = options[i];
+	}
+	args[option_count + 1] = server_pipe;
+	args[option_count + 2] = "4";
+	args[option_count + 3] = "4";
+	args[option_count + 4] = NULL;
+
+	broker_pid = fork();
+	if (broker_pid == -1) {
+		fail("failed to start the broker");
+	} else if (broker_pid == 0) {
+		execv(BROKER_PATH, args);
+		_exit(EXIT_FAILURE);
+	}
+
+	// Keep the fifo open for the whole run, to send every request through
+	// the same handle
+	for (int tries = 0; tries < 200; tries++) {
+		server_fd = open(server_pipe, O_WRONLY | O_NONBLOCK);
+		if (server_fd != -1) {
+			break;
+		}
+		struct timespec ts = {0, 10000000};
+		nanosleep(&ts, NULL);
+	}
+	if (server_fd == -1) {
+		fail("the broker did not start");
+	}
+	fcntl(server_fd, F_SETFL, fcntl(server_fd, F_GETFL) & ~O_NONBLOCK);
+}
+
+int main(int argc, char **argv) {
+	int opt;
+	while ((opt = getopt(argc, argv, "c:n:v:")) != -1) {
+		switch (opt) {
+			case 'c':
+				clients = strtoul(optarg, NULL, 10);
+				break;
+			case 'n':
+				registrations = strtoul(optarg, NULL, 10);
+				break;
+			case 'v':
+				version = atoi(optarg);
+				break;
+			default:
+				fprintf(stderr, "usage: register-bench [-c clients] "
+								"[-n registrations] [-v 1|2] "
+								"[-- mbroker options]\n");
+				return EXIT_FAILURE;
+		}
+	}
+	if (clients == 0 || registrations == 0 || (version != 1 && version != 2)) {
+		fprintf(stderr, "register-bench: needs a client, a registration, and "
+						"version 1 or 2\n");
+		return EXIT_FAILURE;
+	}
+
+	snprintf(dir, sizeof(dir), "/tmp/register-bench-%d", (int)getpid());
+	snprintf(server_pipe, sizeof(server_pipe), "%s/server", dir);
+	if (mkdir(dir, 0750) != 0) {
+		fail("failed to create the fifo directory");
+	}
+	signal(SIGPIPE, SIG_IGN);
+	start_broker(argv + optind, argc - optind);
+
+	pthread_t *threads = calloc(clients, sizeof(pthread_t));
+	pthread_barrier_init(&go, NULL, (unsigned)clients + 1);
+	for (size_t i = 0; i < clients; i++) {
+		pthread_create(&threads[i], NULL, client_run, (void *)i);
+	}
+
+	unsigned long reads_start = broker_reads();
+	uint64_t start_ns = now_ns();
+	pthread_barrier_wait(&go);
+	for (size_t i = 0; i < clients; i++) {
+		pthread_join(threads[i], NULL);
+	}
+
+	// Every stats request is counted as well, by the time it is answered
+	size_t taken = 0, last_taken = 0, polls = 0;
+	uint64_t end_ns = now_ns(), progress_ns = end_ns;
+	while (true) {
+		size_t requests = broker_requests();
+		polls++;
+		end_ns = now_ns();
+		taken = requests > polls ? requests - polls : 0;
+		if (taken >= registrations) {
+			break;
+		} else if (taken != last_taken) {
+			last_taken = taken;
+			progress_ns = end_ns;
+		} else if ((double)(end_ns - progress_ns) / 1e9 > IDLE_TIMEOUT_S) {
+			fprintf(stderr, "register-bench: %zu of %zu registrations "
+							"taken\n",
+					taken, registrations);
+			break;
+		}
+	}
+	unsigned long reads = broker_reads() - reads_start;
+	double seconds = (double)(end_ns - start_ns) / 1e9;
+
+	kill(broker_pid, SIGINT);
+	waitpid(broker_pid, NULL, 0);
+	unlink(server_pipe);
+	rmdir(dir);
+
+	printf("{\"bench\": \"register\", \"broker_options\": \"");
+	for (int i = optind; i < argc; i++) {
+		printf("%s%s", i > optind ? " " : "", argv[i]);
+	}
+	printf("\", \"clients\": %zu, \"version\": %d, \"registrations\": %zu, "
+		   "\"taken\": %zu, \"seconds\": %.6f, "
+		   "\"registrations_per_second\": %.0f, "
+		   "\"broker_reads_per_registration\": %.3f}\n",
+		   clients, version, registrations, taken, seconds,
+		   (double)taken / seconds,
+		   (double)reads / (double)(taken + polls));
+	free(threads);
+	return taken >= registrations ? EXIT_SUCCESS : EXIT_FAILURE;
+}
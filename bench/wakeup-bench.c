@@ -0,0 +1,152 @@
+#include "mbroker/box.h"
+#include "operations.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+
+// Context switches caused by waking thread-mode subscribers, with one
+// broadcast per publish (what the broker used to do) or with per-subscriber
+// wait slots (box_wait).
+//
+// usage: wakeup-bench [subscribers] [messages]
+//
+// Prints one JSON object per mode.
+
+#define MESSAGE "a benchmark message"
+
+static struct box *box;
+static size_t messages;
+static bool targeted;
+static pthread_cond_t broadcast = PTHREAD_COND_INITIALIZER;
+static _Atomic size_t wakeups;
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static long context_switches(void) {
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	return usage.ru_nvcsw + usage.ru_nivcsw;
+}
+
+// Reads records the way handle_subscriber does, until it has seen them all
+static void *subscriber(void *arg) {
+	(void)arg;
+	uint64_t offset;
+	int box_fd = box_open_cursor(box, START_EARLIEST, &offset);
+	struct box_waiter waiter;
+	if (box_fd < 0 || box_waiter_add(box, &waiter) != 0) {
+		fprintf(stderr, "wakeup-bench: failed to open box\n");
+		exit(EXIT_FAILURE);
+	}
+
+	char records[BOX_READ_SIZE];
+	size_t pending = 0;
+	size_t seen = 0;
+	while (seen < messages) {
+		ssize_t bytes_read;
+		pthread_mutex_lock(&box->box_lock);
+		while ((bytes_read = box_read(box, box_fd, &offset, records + pending,
+									  sizeof(records) - pending)) == 0) {
+			if (targeted) {
+				box_wait(box, &waiter);
+			} else {
+				pthread_cond_wait(&broadcast, &box->box_lock);
+			}
+			wakeups++;
+		}
+		pthread_mutex_unlock(&box->box_lock);
+
+		size_t len = pending + (size_t)bytes_read;
+		size_t pos = 0;
+		struct box_record record;
+		while (len - pos >= sizeof(record)) {
+			memcpy(&record, records + pos, sizeof(record));
+			if (len - pos < sizeof(record) + record.length) {
+				break;
+			}
+			pos += sizeof(record) + record.length;
+			seen++;
+		}
+		pending = len - pos;
+		memmove(records, records + pos, pending);
+	}
+
+	box_waiter_remove(box, &waiter);
+	tfs_close(box_fd);
+	return NULL;
+}
+
+static void run(char const *mode, size_t subscribers) {
+	targeted = strcmp(mode, "targeted") == 0;
+	wakeups = 0;
+
+	int fd = tfs_open("/bench", TFS_O_CREAT | TFS_O_TRUNC);
+	if (fd == -1) {
+		fprintf(stderr, "wakeup-bench: failed to create box\n");
+		exit(EXIT_FAILURE);
+	}
+	tfs_close(fd);
+	box = box_new("bench");
+	if (box == NULL || box_map_segment(box) != 0 ||
+		box_open_publisher(box) != 0) {
+		fprintf(stderr, "wakeup-bench: failed to open box\n");
+		exit(EXIT_FAILURE);
+	}
+
+	pthread_t threads[subscribers];
+	for (size_t i = 0; i < subscribers; i++) {
+		pthread_create(&threads[i], NULL, subscriber, NULL);
+	}
+
+	long switches = context_switches();
+	double start = now();
+	char record[sizeof(struct box_record) + sizeof(MESSAGE) - 1];
+	struct box_record header = {0, sizeof(MESSAGE) - 1};
+	for (size_t i = 0; i < messages; i++) {
+		memcpy(record, &header, sizeof(header));
+		memcpy(record + sizeof(header), MESSAGE, sizeof(MESSAGE) - 1);
+		box_publish(box, record, sizeof(record));
+		if (!targeted) {
+			pthread_mutex_lock(&box->box_lock);
+			pthread_cond_broadcast(&broadcast);
+			pthread_mutex_unlock(&box->box_lock);
+		}
+	}
+	for (size_t i = 0; i < subscribers; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	double elapsed = now() - start;
+	switches = context_switches() - switches;
+
+	box_close_publisher(box);
+	box_put(box);
+
+	printf("{\"bench\": \"wakeup\", \"mode\": \"%s\", \"subscribers\": %zu, "
+		   "\"messages\": %zu, \"seconds\": %.6f, \"wakeups\": %zu, "
+		   "\"context_switches\": %ld}\n",
+		   mode, subscribers, messages, elapsed, (size_t)wakeups, switches);
+}
+
+int main(int argc, char **argv) {
+	size_t subscribers = argc > 1 ? strtoul(argv[1], NULL, 10) : 100;
+	messages = argc > 2 ? strtoul(argv[2], NULL, 10) : 10000;
+
+	tfs_params params = tfs_default_params();
+	params.max_open_files_count = subscribers + 2;
+	if (tfs_init(&params) == -1) {
+		fprintf(stderr, "wakeup-bench: failed to initialize tfs\n");
+		return EXIT_FAILURE;
+	}
+
+	run("broadcast", subscribers);
+	run("targeted", subscribers);
+
+	tfs_destroy();
+	return EXIT_SUCCESS;
+}
@@ -6,6 +6,19 @@
 
 #define MAX_FILE_NAME (40)
 
+// Busy loop iterations per state access, in the default (spin) latency model
 #define DELAY (5000)
 
+// Extents kept directly in the inode (more go to an indirect block)
+#define INODE_DIRECT_EXTENTS (8)
+
+// Minimum number of blocks allocated when a file grows
+#define INODE_PREALLOC_BLOCKS (16)
+
+// Open file table entries allocated at a time, as the table grows
+#define OPEN_FILE_CHUNK (256)
+
+// Journal length at which a commit checkpoints it into the image
+#define JOURNAL_CHECKPOINT_SIZE (16 << 20)
+
 #endif // CONFIG_H
@@ -9,15 +9,19 @@
 #include <string.h>
 
 #include "betterassert.h"
-
-pthread_mutex_t g_library_mutex = PTHREAD_MUTEX_INITIALIZER;
+#include "stats.h"
 
 tfs_params tfs_default_params() {
 	tfs_params params = {
 		.max_inode_count = 64,
-		.max_block_count = 1024,
-		.max_open_files_count = 16,
+		.max_block_count = 16384,
+		.max_open_files_count = 65536,
 		.block_size = 1024,
+		.image_path = NULL,
+		.sync_interval_ms = 1000,
+		.journal_path = NULL,
+		.latency_model = TFS_LATENCY_SPIN,
+		.latency_ns = 0,
 	};
 	return params;
 }
@@ -30,13 +34,17 @@ int tfs_init(tfs_params const *params_ptr) {
 		params = tfs_default_params();
 	}
 
-	if (state_init(params) != 0) {
+	bool restored;
+	if (state_init(params, &restored) != 0) {
 		return -1;
 	}
+	if (restored) {
+		return 0; // the image already has its root directory
+	}
 
 	// create root inode
 	int root = inode_create(T_DIRECTORY);
-	if (root != ROOT_DIR_INUM) {
+	if (root != ROOT_DIR_INUM || state_commit() == -1) {
 		return -1;
 	}
 
@@ -77,37 +85,43 @@ static int tfs_lookup(char const *name, inode_t const *root_inode) {
 }
 
 int tfs_open(char const *name, tfs_file_mode_t mode) {
-	if (pthread_mutex_lock(&g_library_mutex) == -1) {
-		WARN("failed to lock mutex: %s", strerror(errno));
-		return -1;
-	}
 	// Checks if the path name is valid
 	if (!valid_pathname(name)) {
-		if (pthread_mutex_unlock(&g_library_mutex) == -1) {
-			WARN("failed to unlock mutex: %s", strerror(errno));
-			return -1;
-		}
 		return -1;
 	}
+	if ((mode & (TFS_O_CREAT | TFS_O_TRUNC)) && state_failed()) {
+		return -1; // no more changes are accepted
+	}
+
+	// Creating a file changes the root directory, so it needs a write lock
+	if (mode & TFS_O_CREAT) {
+		inode_wrlock(ROOT_DIR_INUM);
+	} else {
+		inode_rdlock(ROOT_DIR_INUM);
+	}
 
 	inode_t *root_dir_inode = inode_get(ROOT_DIR_INUM);
 	ALWAYS_ASSERT(root_dir_inode != NULL,
 				  "tfs_open: root dir inode must exist");
 	int inum = tfs_lookup(name, root_dir_inode);
 	size_t offset;
+	bool changed = false; // only a created or truncated file needs a commit
 
 	if (inum >= 0) {
 		// The file already exists
+		if (mode & TFS_O_TRUNC) {
+			inode_wrlock(inum);
+		} else {
+			inode_rdlock(inum);
+		}
 		inode_t *inode = inode_get(inum);
 		ALWAYS_ASSERT(inode != NULL,
 					  "tfs_open: directory files must have an inode");
 
 		// Truncate (if requested)
 		if (mode & TFS_O_TRUNC) {
-			if (inode->i_size > 0) {
-				data_block_free(inode->i_data_block);
-				inode->i_size = 0;
-			}
+			inode_truncate(inode);
+			changed = true;
 		}
 		// Determine initial offset
 		if (mode & TFS_O_APPEND) {
@@ -115,43 +129,38 @@ int tfs_open(char const *name, tfs_file_mode_t mode) {
 		} else {
 			offset = 0;
 		}
+		inode_unlock(inum);
 	} else if (mode & TFS_O_CREAT) {
 		// The file does not exist; the mode specified that it should be created
 		// Create inode
 		inum = inode_create(T_FILE);
 		if (inum == -1) {
-			if (pthread_mutex_unlock(&g_library_mutex) == -1) {
-				WARN("failed to unlock mutex: %s", strerror(errno));
-				return -1;
-			}
+			inode_unlock(ROOT_DIR_INUM);
 			return -1; // no space in inode table
 		}
 
 		// Add entry in the root directory
 		if (add_dir_entry(root_dir_inode, name + 1, inum) == -1) {
 			inode_delete(inum);
-			if (pthread_mutex_unlock(&g_library_mutex) == -1) {
-				WARN("failed to unlock mutex: %s", strerror(errno));
-				return -1;
-			}
+			inode_unlock(ROOT_DIR_INUM);
 			return -1; // no space in directory
 		}
 
 		offset = 0;
+		changed = true;
 	} else {
-		if (pthread_mutex_unlock(&g_library_mutex) == -1) {
-			WARN("failed to unlock mutex: %s", strerror(errno));
-			return -1;
-		}
+		inode_unlock(ROOT_DIR_INUM);
 		return -1;
 	}
 
 	// Finally, add entry to the open file table and return the corresponding
 	// handle
 	int ret = add_to_open_file_table(inum, offset);
-	if (pthread_mutex_unlock(&g_library_mutex) == -1) {
-		WARN("failed to unlock mutex: %s", strerror(errno));
-		return -1;
+	inode_unlock(ROOT_DIR_INUM);
+
+	if (changed && ret != -1 && state_commit() == -1) {
+		remove_from_open_file_table(ret);
+		return -1; // the file may not survive a crash
 	}
 	return ret;
 
@@ -160,104 +169,128 @@ int tfs_open(char const *name, tfs_file_mode_t mode) {
 	// opened but it remains created
 }
 
+struct list_call {
+	void (*fn)(char const *name, void *arg);
+	void *arg;
+};
+
+static void list_entry(char const *sub_name, int sub_inumber, void *arg) {
+	(void)sub_inumber;
+	struct list_call *call = arg;
+	call->fn(sub_name, call->arg);
+}
+
+int tfs_list(void (*fn)(char const *name, void *arg), void *arg) {
+	struct list_call call = {fn, arg};
+
+	inode_rdlock(ROOT_DIR_INUM);
+	int ret = dir_foreach(inode_get(ROOT_DIR_INUM), list_entry, &call);
+	inode_unlock(ROOT_DIR_INUM);
+	return ret;
+}
+
 int tfs_close(int fhandle) {
-	if (pthread_mutex_lock(&g_library_mutex) == -1) {
-		WARN("failed to lock mutex: %s", strerror(errno));
-		return -1;
-	}
 	open_file_entry_t *file = get_open_file_entry(fhandle);
 	if (file == NULL) {
-		if (pthread_mutex_unlock(&g_library_mutex) == -1) {
-			WARN("failed to unlock mutex: %s", strerror(errno));
-			return -1;
-		}
 		return -1; // invalid fd
 	}
 
-	remove_from_open_file_table(fhandle);
-
-	if (pthread_mutex_unlock(&g_library_mutex) == -1) {
-		WARN("failed to unlock mutex: %s", strerror(errno));
-		return -1;
+	// The file's inode goes with its last handle, if it was unlinked
+	if (remove_from_open_file_table(fhandle)) {
+		return state_commit();
 	}
 	return 0;
 }
 
-ssize_t tfs_write(int fhandle, void const *buffer, size_t to_write) {
-	if (pthread_mutex_lock(&g_library_mutex) == -1) {
-		WARN("failed to lock mutex: %s", strerror(errno));
-		return -1;
-	}
+// Writes to an open file, leaving the change to be committed by the caller
+static ssize_t file_write(int fhandle, void const *buffer, size_t to_write) {
 	open_file_entry_t *file = get_open_file_entry(fhandle);
-	if (file == NULL) {
-		if (pthread_mutex_unlock(&g_library_mutex) == -1) {
-			WARN("failed to unlock mutex: %s", strerror(errno));
-			return -1;
-		}
+	if (file == NULL || state_failed()) {
 		return -1;
 	}
 
 	//  From the open file table entry, we get the inode
-	inode_t *inode = inode_get(file->of_inumber);
+	int inum = file->of_inumber;
+	open_file_lock(file);
+	inode_wrlock(inum);
+	inode_t *inode = inode_get(inum);
 	ALWAYS_ASSERT(inode != NULL, "tfs_write: inode of open file deleted");
 
-	// Determine how many bytes to write
+	// Make sure the file has enough blocks, growing it by at least
+	// INODE_PREALLOC_BLOCKS at a time so that appends stay contiguous
 	size_t block_size = state_block_size();
-	if (to_write + file->of_offset > block_size) {
-		to_write = block_size - file->of_offset;
+	size_t blocks_needed = (file->of_offset + to_write + block_size - 1) /
+						   block_size;
+	if (blocks_needed > inode->i_block_count) {
+		size_t blocks_wanted = inode->i_block_count + INODE_PREALLOC_BLOCKS;
+		if (blocks_wanted < blocks_needed) {
+			blocks_wanted = blocks_needed;
+		}
+		inode_reserve(inode, blocks_wanted);
 	}
 
-	if (to_write > 0) {
-		if (inode->i_size == 0) {
-			// If empty file, allocate new block
-			int bnum = data_block_alloc();
-			if (bnum == -1) {
-				if (pthread_mutex_unlock(&g_library_mutex) == -1) {
-					WARN("failed to unlock mutex: %s", strerror(errno));
-					return -1;
-				}
-				return -1; // no space
-			}
-
-			inode->i_data_block = bnum;
-		}
+	// Determine how many bytes to write
+	size_t capacity = inode->i_block_count * block_size;
+	if (file->of_offset >= capacity && to_write > 0) {
+		inode_unlock(inum);
+		open_file_unlock(file);
+		return -1; // no space
+	}
+	if (to_write + file->of_offset > capacity) {
+		to_write = capacity - file->of_offset;
+	}
 
-		void *block = data_block_get(inode->i_data_block);
+	// Perform the actual write, one block at a time
+	extent_cursor_t cursor = EXTENT_CURSOR_INIT;
+	size_t written = 0;
+	while (written < to_write) {
+		size_t offset = file->of_offset + written;
+		int bnum = inode_block_seek(inode, &cursor, offset / block_size);
+		char *block = data_block_get(bnum);
 		ALWAYS_ASSERT(block != NULL, "tfs_write: data block deleted mid-write");
 
-		// Perform the actual write
-		memcpy(block + file->of_offset, buffer, to_write);
+		size_t block_offset = offset % block_size;
+		size_t chunk = block_size - block_offset;
+		if (chunk > to_write - written) {
+			chunk = to_write - written;
+		}
 
-		// The offset associated with the file handle is incremented accordingly
-		file->of_offset += to_write;
-		if (file->of_offset > inode->i_size) {
-			inode->i_size = file->of_offset;
+		memcpy(block + block_offset, (char const *)buffer + written, chunk);
+		if (state_data_written(block + block_offset, chunk) == -1) {
+			inode_unlock(inum);
+			open_file_unlock(file);
+			return -1;
 		}
+		written += chunk;
 	}
 
-	if (pthread_mutex_unlock(&g_library_mutex) == -1) {
-		WARN("failed to unlock mutex: %s", strerror(errno));
-		return -1;
+	// The offset associated with the file handle is incremented accordingly.
+	// The inode is journaled even if its size did not change: the commit of
+	// its record is what syncs the data.
+	file->of_offset += to_write;
+	if (file->of_offset > inode->i_size) {
+		inode->i_size = file->of_offset;
+	}
+	if (to_write > 0) {
+		inode_journal(inode);
 	}
+
+	inode_unlock(inum);
+	open_file_unlock(file);
 	return (ssize_t)to_write;
 }
 
-ssize_t tfs_read(int fhandle, void *buffer, size_t len) {
-	if (pthread_mutex_lock(&g_library_mutex) == -1) {
-		WARN("failed to lock mutex: %s", strerror(errno));
-		return -1;
-	}
+static ssize_t file_read(int fhandle, void *buffer, size_t len) {
 	open_file_entry_t *file = get_open_file_entry(fhandle);
 	if (file == NULL) {
-		if (pthread_mutex_unlock(&g_library_mutex) == -1) {
-			WARN("failed to unlock mutex: %s", strerror(errno));
-			return -1;
-		}
 		return -1;
 	}
 
 	// From the open file table entry, we get the inode
-	inode_t const *inode = inode_get(file->of_inumber);
+	int inum = file->of_inumber;
+	open_file_lock(file);
+	inode_rdlock(inum);
+	inode_t const *inode = inode_get(inum);
 	ALWAYS_ASSERT(inode != NULL, "tfs_read: inode of open file deleted");
 
 	// Determine how many bytes to read
@@ -266,63 +299,119 @@ ssize_t tfs_read(int fhandle, void *buffer, size_t len) {
 		to_read = len;
 	}
 
-	if (to_read > 0) {
-		void *block = data_block_get(inode->i_data_block);
+	// Perform the actual read, one block at a time
+	size_t block_size = state_block_size();
+	extent_cursor_t cursor = EXTENT_CURSOR_INIT;
+	size_t bytes_read = 0;
+	while (bytes_read < to_read) {
+		size_t offset = file->of_offset + bytes_read;
+		int bnum = inode_block_seek(inode, &cursor, offset / block_size);
+		char *block = data_block_get(bnum);
 		ALWAYS_ASSERT(block != NULL, "tfs_read: data block deleted mid-read");
 
-		// Perform the actual read
-		memcpy(buffer, block + file->of_offset, to_read);
-		// The offset associated with the file handle is incremented accordingly
-		file->of_offset += to_read;
-	}
+		size_t block_offset = offset % block_size;
+		size_t chunk = block_size - block_offset;
+		if (chunk > to_read - bytes_read) {
+			chunk = to_read - bytes_read;
+		}
 
-	if (pthread_mutex_unlock(&g_library_mutex) == -1) {
-		WARN("failed to unlock mutex: %s", strerror(errno));
-		return -1;
+		memcpy((char *)buffer + bytes_read, block + block_offset, chunk);
+		bytes_read += chunk;
 	}
+
+	// The offset associated with the file handle is incremented accordingly
+	file->of_offset += to_read;
+
+	inode_unlock(inum);
+	open_file_unlock(file);
 	return (ssize_t)to_read;
 }
 
-int tfs_unlink(char const *target) {
-	if (pthread_mutex_lock(&g_library_mutex) == -1) {
-		WARN("failed to lock mutex: %s", strerror(errno));
+ssize_t tfs_write(int fhandle, void const *buffer, size_t to_write) {
+	uint64_t start = stats_now();
+	ssize_t ret = file_write(fhandle, buffer, to_write);
+	// Wait for the journal outside the file's locks, so that writes to other
+	// files share the same commit
+	if (ret != -1 && state_commit() == -1) {
+		ret = -1;
+	}
+	stats_record(STATS_TFS_WRITE_NS, stats_now() - start);
+	return ret;
+}
+
+ssize_t tfs_write_nowait(int fhandle, void const *buffer, size_t to_write,
+						 uint64_t *lsn) {
+	uint64_t start = stats_now();
+	ssize_t ret = file_write(fhandle, buffer, to_write);
+	*lsn = state_commit_point();
+	stats_record(STATS_TFS_WRITE_NS, stats_now() - start);
+	return ret;
+}
+
+int tfs_commit(uint64_t lsn) { return state_commit_upto(lsn); }
+
+ssize_t tfs_read(int fhandle, void *buffer, size_t len) {
+	uint64_t start = stats_now();
+	ssize_t ret = file_read(fhandle, buffer, len);
+	stats_record(STATS_TFS_READ_NS, stats_now() - start);
+	return ret;
+}
+
+int tfs_seek(int fhandle, size_t offset) {
+	open_file_entry_t *file = get_open_file_entry(fhandle);
+	if (file == NULL) {
+		return -1;
+	}
+
+	int inum = file->of_inumber;
+	open_file_lock(file);
+	inode_rdlock(inum);
+	inode_t const *inode = inode_get(inum);
+	ALWAYS_ASSERT(inode != NULL, "tfs_seek: inode of open file deleted");
+
+	if (offset > inode->i_size) {
+		inode_unlock(inum);
+		open_file_unlock(file);
 		return -1;
 	}
+	file->of_offset = offset;
+
+	inode_unlock(inum);
+	open_file_unlock(file);
+	return 0;
+}
+
+int tfs_unlink(char const *target) {
 	// Checks if the path name is valid
-	if (!valid_pathname(target)) {
-		if (pthread_mutex_unlock(&g_library_mutex) == -1) {
-			WARN("failed to unlock mutex: %s", strerror(errno));
-			return -1;
-		}
+	if (!valid_pathname(target) || state_failed()) {
 		return -1;
 	}
 
+	inode_wrlock(ROOT_DIR_INUM);
 	inode_t *root_dir_inode = inode_get(ROOT_DIR_INUM);
 	ALWAYS_ASSERT(root_dir_inode != NULL,
 				  "tfs_open: root dir inode must exist");
 	int inum = tfs_lookup(target, root_dir_inode);
 
 	if (inum == -1) {
-		if (pthread_mutex_unlock(&g_library_mutex) == -1) {
-			WARN("failed to unlock mutex: %s", strerror(errno));
-			return -1;
-		}
+		inode_unlock(ROOT_DIR_INUM);
 		return -1;
 	}
 
-	inode_delete(inum);
+	// The entry goes first, so that no part of the journal names an inode
+	// that is already deleted
 	if (clear_dir_entry(root_dir_inode, target + 1) == -1) {
-		if (pthread_mutex_unlock(&g_library_mutex) == -1) {
-			WARN("failed to unlock mutex: %s", strerror(errno));
-			return -1;
-		}
+		inode_unlock(ROOT_DIR_INUM);
 		return -1;
 	}
 
-	if (pthread_mutex_unlock(&g_library_mutex) == -1) {
-		WARN("failed to unlock mutex: %s", strerror(errno));
-		return -1;
-	}
+	// Wait for ongoing reads and writes of the file to finish; if the file
+	// is still open, its inode lives on until it is closed
+	inode_wrlock(inum);
+	inode_unlink(inum);
+	inode_unlock(inum);
 
-	return 0;
+	inode_unlock(ROOT_DIR_INUM);
+
+	return state_commit();
 }
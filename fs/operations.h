@@ -2,17 +2,50 @@
 #define OPERATIONS_H
 
 #include "config.h"
+#include <stdint.h>
 #include <sys/types.h>
 
+/**
+ * Storage latency models: how accesses to the file system state are delayed,
+ * to emulate it being kept in secondary memory.
+ */
+typedef enum {
+	TFS_LATENCY_NONE,		// no delay
+	TFS_LATENCY_SPIN,		// busy loop of DELAY iterations
+	TFS_LATENCY_SLEEP,		// sleep for latency_ns
+	TFS_LATENCY_CALIBRATED, // busy loop calibrated to take latency_ns
+} tfs_latency_model_t;
+
 /**
  * TécnicoFS parameters.
  */
 typedef struct {
 	size_t max_inode_count;
 	size_t max_block_count;
+	// The open file table grows as files are opened, up to this many entries
 	size_t max_open_files_count;
 
 	size_t block_size;
+
+	// Image file holding the file system, or NULL to keep it in memory only.
+	// An existing image is reopened with the geometry it was created with.
+	char const *image_path;
+	// How often the image is synced to disk, in milliseconds (0 syncs only
+	// in tfs_destroy)
+	unsigned int sync_interval_ms;
+	// Write-ahead journal of metadata changes, or NULL for none; it needs an
+	// image, where file contents are written and synced before the metadata
+	// referring to them is journaled. With a journal, changes are durable
+	// when the call that made them returns. Metadata only reaches the image
+	// from the journal, which is applied to it and emptied every time the
+	// image is synced, and once it reaches JOURNAL_CHECKPOINT_SIZE. If the
+	// journal or the image cannot be written, the error is logged and every
+	// call that would change the file system fails from then on.
+	char const *journal_path;
+
+	// Delay of every inode, block and bitmap access
+	tfs_latency_model_t latency_model;
+	unsigned long latency_ns;
 } tfs_params;
 
 /**
@@ -41,6 +74,18 @@ typedef enum {
 	TFS_O_APPEND = 0b100,
 } tfs_file_mode_t;
 
+/**
+ * Call a function on every file of the file system.
+ *
+ * Input:
+ *   - fn: called with the name of each file (without the leading '/'); it
+ *     must not call back into tecnicofs
+ *   - arg: passed on to fn
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+int tfs_list(void (*fn)(char const *name, void *arg), void *arg);
+
 /**
  * Open a file.
  *
@@ -100,6 +145,34 @@ int tfs_close(int fhandle);
  */
 ssize_t tfs_write(int fhandle, void const *buffer, size_t len);
 
+/**
+ * Write to an open file like tfs_write, but without waiting for the write to
+ * be durable, so that the caller can wait for it after dropping its own
+ * locks.
+ *
+ * Input:
+ *   - fhandle: file handle (obtained from a previous call to tfs_open)
+ *   - buffer: buffer containing the contents to write
+ *   - len: length of the buffer contents (in bytes)
+ *   - lsn: set to the commit point to pass to tfs_commit
+ *
+ * Returns the number of bytes that were written (can be lower than 'len' if the
+ * maximum file size is exceeded), or -1 in case of error.
+ */
+ssize_t tfs_write_nowait(int fhandle, void const *buffer, size_t len,
+						 uint64_t *lsn);
+
+/**
+ * Wait for the writes up to a commit point to be durable. Returns at once if
+ * there is no journal.
+ *
+ * Input:
+ *   - lsn: commit point set by tfs_write_nowait
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+int tfs_commit(uint64_t lsn);
+
 /**
  * Read from an open file, starting at the current offset.
  *
@@ -113,10 +186,25 @@ ssize_t tfs_write(int fhandle, void const *buffer, size_t len);
  */
 ssize_t tfs_read(int fhandle, void *buffer, size_t len);
 
+/**
+ * Move the current offset of an open file.
+ *
+ * Input:
+ *   - fhandle: file handle (obtained from a previous call to tfs_open)
+ *   - offset: new offset, from the start of the file
+ *
+ * Returns 0 if successful, -1 if the handle is invalid or the offset is past
+ * the end of the file.
+ */
+int tfs_seek(int fhandle, size_t offset);
+
 /**
  * Delete a link, or a file if the number of hard links reaches 0, that
  * exists in TécnicoFS.
  *
+ * A file that is still open loses its name at once, but its handles keep
+ * working and its data stays until the last of them is closed.
+ *
  * Input:
  *   - target: path name of the target (in TécnicoFS)
  *
@@ -1,32 +1,167 @@
 #include "state.h"
 #include "betterassert.h"
+#include "wal.h"
 
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 
 /*
  * Persistent FS state
- * (in reality, it should be maintained in secondary memory;
- * for simplicity, this project maintains it in primary memory).
+ * (kept in primary memory, unless an image file is given in the parameters:
+ * then it lives in the image, which is mapped into memory. With a journal,
+ * the mapping is private, so that changes only reach the image through the
+ * journal, and file contents are also written to the image as they change).
  */
 static tfs_params fs_params;
 
 // Inode table
 static inode_t *inode_table;
-static allocation_state_t *freeinode_ts;
+static uint64_t *freeinode_ts; // bitmap, 1 = taken
+static size_t inode_cursor;	   // next-fit: where the next search starts
 
 // Data blocks
 static char *fs_data; // # blocks * block size
-static allocation_state_t *free_blocks;
+static uint64_t *free_blocks; // bitmap, 1 = taken
+static size_t block_cursor;	  // next-fit: where the next search starts
+
+// What the block allocator searches: free_blocks, except that with a journal
+// a freed block stays taken until its free is durable. Were it handed out and
+// written to before that, a crash would leave it to its previous file, with
+// the new file's contents.
+static uint64_t *block_alloc_map;
+
+typedef struct {
+	int pf_block;
+	uint64_t pf_lsn; // where its free was journaled
+} pending_free_t;
+
+// Blocks whose free is not durable yet, oldest first. Protected by
+// free_blocks_lock, like the bitmaps.
+static pending_free_t *pending_frees;
+static size_t pending_free_count;
+static size_t pending_free_capacity;
+
+/*
+ * Image file
+ *
+ * An image starts with a superblock describing its layout, followed by the
+ * inode bitmap, the data block bitmap, the inode table and the data blocks,
+ * each one starting on an IMAGE_ALIGN boundary. Nothing in it refers to
+ * memory addresses, so it can be mapped anywhere.
+ */
+#define IMAGE_MAGIC "TFSIMG01"
+#define IMAGE_ALIGN ((size_t)4096)
+
+typedef struct {
+	char sb_magic[8];
+	size_t sb_inode_count;
+	size_t sb_block_count;
+	size_t sb_block_size;
+	size_t sb_inode_size; // sizeof(inode_t) when the image was formatted
+
+	// offsets of each region, from the start of the image
+	size_t sb_inode_bitmap;
+	size_t sb_block_bitmap;
+	size_t sb_inode_table;
+	size_t sb_data;
+	size_t sb_image_size;
+} superblock_t;
+
+static int image_fd = -1;
+static char *image; // whole image mapping, or NULL if there is no image
+static size_t image_size;
+
+// Background msync, every fs_params.sync_interval_ms
+static pthread_t image_sync_thread;
+static bool image_sync_running;
+static bool image_sync_stop;
+static pthread_mutex_t image_sync_lock;
+static pthread_cond_t image_sync_cond;
+
+/*
+ * Journal
+ *
+ * Records name the region of the persistent state they change and an offset
+ * within it, so they can be replayed wherever the regions are.
+ */
+enum {
+	REGION_INODE_BITMAP,
+	REGION_BLOCK_BITMAP,
+	REGION_INODE_TABLE,
+	REGION_DATA,
+	REGION_COUNT,
+};
+
+static bool journaled; // whether there is a journal
+
+// File contents are not journaled, only the metadata that refers to them: set
+// once file data is written into the image, until the next commit syncs it
+static _Atomic bool data_unsynced;
 
 /*
  * Volatile FS state
+ *
+ * The open file table grows OPEN_FILE_CHUNK entries at a time, up to
+ * MAX_OPEN_FILES. Chunks stay where they are until state_destroy, so entries
+ * are used without holding any table lock. Free entries are kept in a
+ * lock-free stack, whose head packs a generation count (upper 32 bits) with
+ * the index of the top entry plus one (0 when empty): the count changes on
+ * every push and pop, so a pop that raced with others fails its
+ * compare-and-swap even if the same entry is back on top.
+ */
+static open_file_entry_t **open_file_chunks;
+static _Atomic size_t open_file_count; // entries in the allocated chunks
+static _Atomic uint64_t open_file_free_head;
+
+/*
+ * Open count of each inode: the open file entries referring to it. An inode
+ * unlinked while open is deleted when its last entry is removed, so handles
+ * keep working on a file that no longer has a name.
+ */
+static _Atomic size_t *inode_opens;
+static bool *inode_unlinked; // protected by the inode's lock
+
+/*
+ * Locks
+ *
+ * Each inode has its own rwlock; the root directory's lock also protects the
+ * directory entries. Each open file entry has its own mutex, for its offset.
+ * Lock order: open file entry, root directory, other inodes, then the
+ * allocation mutexes and the open file table mutex (taken only to grow it).
+ */
+static pthread_rwlock_t *inode_locks;
+static pthread_mutex_t free_inodes_lock;
+static pthread_mutex_t free_blocks_lock;
+static pthread_mutex_t open_file_table_lock;
+
+/*
+ * Root directory index: a hash table over the directory's entries, mapping
+ * names to entry slots. Slots in the same bucket are chained through
+ * dir_index_next; unused slots are kept in the dir_free_slots stack. It is
+ * protected by the root directory's lock, like the entries themselves.
  */
-static open_file_entry_t *open_file_table;
-static allocation_state_t *free_open_file_entries;
+static int *dir_index_buckets; // first slot in each bucket, or -1
+static size_t dir_index_bucket_count;
+static int *dir_index_next;		 // next slot in the same bucket, or -1
+static uint32_t *dir_index_hashes; // name hash of each slot in use
+static int *dir_free_slots;
+static size_t dir_free_count;
+static size_t dir_slot_count;
+
+static int dir_index_build(inode_t const *inode);
+static void inode_reclaim_orphans(void);
+static void data_blocks_release(void);
+static int journal_checkpoint(void);
 
 // Convenience macros
 #define INODE_TABLE_SIZE (fs_params.max_inode_count)
@@ -34,6 +169,8 @@ static allocation_state_t *free_open_file_entries;
 #define MAX_OPEN_FILES (fs_params.max_open_files_count)
 #define BLOCK_SIZE (fs_params.block_size)
 #define MAX_DIR_ENTRIES (BLOCK_SIZE / sizeof(dir_entry_t))
+#define MAX_INDIRECT_EXTENTS (BLOCK_SIZE / sizeof(extent_t))
+#define BITMAP_WORDS(bits) (((bits) + 63) / 64)
 
 static inline bool valid_inumber(int inumber) {
 	return inumber >= 0 && inumber < INODE_TABLE_SIZE;
@@ -43,242 +180,1476 @@ static inline bool valid_block_number(int block_number) {
 	return block_number >= 0 && block_number < DATA_BLOCKS;
 }
 
-static inline bool valid_file_handle(int file_handle) {
-	return file_handle >= 0 && file_handle < MAX_OPEN_FILES;
+static inline bool valid_file_handle(int file_handle) {
+	return file_handle >= 0 && (size_t)file_handle < open_file_count;
+}
+
+static inline open_file_entry_t *open_file_entry(int fhandle) {
+	return &open_file_chunks[fhandle / OPEN_FILE_CHUNK]
+							[fhandle % OPEN_FILE_CHUNK];
+}
+
+size_t state_block_size(void) { return BLOCK_SIZE; }
+
+/**
+ * Do nothing, while preventing the compiler from performing any optimizations.
+ *
+ * We need to defeat the optimizer for the insert_delay() function.
+ * Under optimization, the empty loop would be completely optimized away.
+ * This function tells the compiler that the assembly code being run (which is
+ * none) might potentially change *all memory in the process*.
+ *
+ * This prevents the optimizer from optimizing this code away, because it does
+ * not know what it does and it may have side effects.
+ *
+ * Reference with more information: https://youtu.be/nXaxk27zwlk?t=2775
+ *
+ * Exercise: try removing this function and look at the assembly generated to
+ * compare.
+ */
+static void touch_all_memory(void) { __asm volatile("" : : : "memory"); }
+
+// Iterations of the busy loop, for the calibrated latency model
+static size_t delay_spins;
+// Sleep time, for the sleep latency model
+static struct timespec delay_sleep;
+
+/**
+ * Artifically delay execution, according to the storage latency model.
+ *
+ * Auxiliary function to insert a delay.
+ * Used in accesses to persistent FS state as a way of emulating access
+ * latencies as if such data structures were really stored in secondary memory.
+ */
+static void insert_delay(void) {
+	switch (fs_params.latency_model) {
+	case TFS_LATENCY_NONE:
+		break;
+	case TFS_LATENCY_SPIN:
+		for (int i = 0; i < DELAY; i++) {
+			touch_all_memory();
+		}
+		break;
+	case TFS_LATENCY_CALIBRATED: {
+		size_t spins = delay_spins; // not reloaded after each memory barrier
+		for (size_t i = 0; i < spins; i++) {
+			touch_all_memory();
+		}
+	} break;
+	case TFS_LATENCY_SLEEP:
+		nanosleep(&delay_sleep, NULL);
+		break;
+	default:
+		break;
+	}
+}
+
+static double delay_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+/**
+ * Set up the delay of the storage latency model in fs_params.
+ *
+ * The calibrated model times the busy loop, and keeps the fastest of a few
+ * runs, so that preemption during calibration does not shorten the delay.
+ */
+static void delay_init(void) {
+	delay_spins = 0;
+	delay_sleep.tv_sec = (time_t)(fs_params.latency_ns / 1000000000);
+	delay_sleep.tv_nsec = (long)(fs_params.latency_ns % 1000000000);
+
+	switch (fs_params.latency_model) {
+	case TFS_LATENCY_CALIBRATED: {
+		size_t const spins = 1 << 20;
+		double best = 0;
+		for (int run = 0; run < 5; run++) {
+			double start = delay_now();
+			for (size_t i = 0; i < spins; i++) {
+				touch_all_memory();
+			}
+			double elapsed = delay_now() - start;
+			if (run == 0 || elapsed < best) {
+				best = elapsed;
+			}
+		}
+		if (best > 0) {
+			delay_spins =
+				(size_t)((double)fs_params.latency_ns * (double)spins / best);
+		}
+	} break;
+	case TFS_LATENCY_NONE:
+	case TFS_LATENCY_SPIN:
+	case TFS_LATENCY_SLEEP:
+	default:
+		break;
+	}
+}
+
+/**
+ * Clear all the bits of a bitmap.
+ *
+ * The unused bits of the last word are set, so they are never handed out.
+ *
+ * Input:
+ *   - map: the bitmap
+ *   - bits: number of bits in the bitmap
+ */
+static void bitmap_init(uint64_t *map, size_t bits) {
+	size_t words = BITMAP_WORDS(bits);
+	memset(map, 0, words * sizeof(uint64_t));
+	if (bits % 64 != 0) {
+		map[words - 1] = ~0ULL << (bits % 64);
+	}
+}
+
+/**
+ * Allocate a bitmap with all bits clear.
+ *
+ * Input:
+ *   - bits: number of bits in the bitmap
+ *
+ * Returns pointer to the bitmap, or NULL if malloc fails.
+ */
+static uint64_t *bitmap_create(size_t bits) {
+	uint64_t *map = malloc(BITMAP_WORDS(bits) * sizeof(uint64_t));
+	if (map != NULL) {
+		bitmap_init(map, bits);
+	}
+	return map;
+}
+
+static inline bool bitmap_test(uint64_t const *map, size_t bit) {
+	return (map[bit / 64] >> (bit % 64)) & 1;
+}
+
+static inline void bitmap_set(uint64_t *map, size_t bit) {
+	map[bit / 64] |= 1ULL << (bit % 64);
+}
+
+static inline void bitmap_clear(uint64_t *map, size_t bit) {
+	map[bit / 64] &= ~(1ULL << (bit % 64));
+}
+
+/**
+ * Find the first clear bit in [from, to).
+ *
+ * Input:
+ *   - map: the bitmap
+ *   - from, to: range to search
+ *
+ * Returns the bit, or to if all bits in the range are set.
+ */
+static size_t bitmap_next_free(uint64_t const *map, size_t from, size_t to) {
+	if (from >= to) {
+		return to;
+	}
+
+	size_t word = from / 64;
+	// treat the bits below from as set
+	uint64_t free_bits = ~map[word] & (~0ULL << (from % 64));
+	while (true) {
+		if (word * sizeof(uint64_t) % BLOCK_SIZE == 0) {
+			insert_delay(); // simulate storage access delay to the bitmap
+		}
+		if (free_bits != 0) {
+			size_t bit = word * 64 + (size_t)__builtin_ctzll(free_bits);
+			return bit < to ? bit : to;
+		}
+		if (++word >= BITMAP_WORDS(to)) {
+			return to;
+		}
+		free_bits = ~map[word];
+	}
+}
+
+/**
+ * Count the clear bits starting at a given bit.
+ *
+ * Input:
+ *   - map: the bitmap
+ *   - from: first bit (must be clear)
+ *   - max: stop counting after this many bits
+ *
+ * Returns the length of the run of clear bits (at most max).
+ */
+static size_t bitmap_free_run(uint64_t const *map, size_t from, size_t max) {
+	size_t length = 0;
+	while (length < max) {
+		size_t bit = from + length;
+		uint64_t taken = map[bit / 64] >> (bit % 64);
+		if (taken & 1) {
+			break;
+		}
+		// the run goes on up to the next set bit (or the end of the word)
+		size_t in_word =
+			taken == 0 ? 64 - bit % 64 : (size_t)__builtin_ctzll(taken);
+		length += in_word;
+	}
+	return length < max ? length : max;
+}
+
+/**
+ * Find a run of clear bits in [from, to), stopping at the first one of (at
+ * least) count bits. Updates best_start/best_length with the longest run seen.
+ *
+ * Returns true if a run of count bits was found.
+ */
+static bool bitmap_find_run(uint64_t const *map, size_t from, size_t to,
+							size_t count, size_t *best_start,
+							size_t *best_length) {
+	size_t bit = bitmap_next_free(map, from, to);
+	while (bit < to) {
+		size_t max = to - bit < count ? to - bit : count;
+		size_t length = bitmap_free_run(map, bit, max);
+		if (length > *best_length) {
+			*best_start = bit;
+			*best_length = length;
+			if (length >= count) {
+				return true;
+			}
+		}
+		bit = bitmap_next_free(map, bit + length, to);
+	}
+	return false;
+}
+
+static size_t image_align(size_t offset) {
+	return (offset + IMAGE_ALIGN - 1) / IMAGE_ALIGN * IMAGE_ALIGN;
+}
+
+/**
+ * Compute the layout of an image for the current parameters.
+ *
+ * Input:
+ *   - sb: superblock to fill in
+ */
+static void image_layout(superblock_t *sb) {
+	memset(sb, 0, sizeof(*sb));
+	memcpy(sb->sb_magic, IMAGE_MAGIC, sizeof(sb->sb_magic));
+	sb->sb_inode_count = INODE_TABLE_SIZE;
+	sb->sb_block_count = DATA_BLOCKS;
+	sb->sb_block_size = BLOCK_SIZE;
+	sb->sb_inode_size = sizeof(inode_t);
+
+	size_t inode_bitmap_size =
+		BITMAP_WORDS(INODE_TABLE_SIZE) * sizeof(uint64_t);
+	size_t block_bitmap_size = BITMAP_WORDS(DATA_BLOCKS) * sizeof(uint64_t);
+
+	sb->sb_inode_bitmap = image_align(sizeof(superblock_t));
+	sb->sb_block_bitmap = image_align(sb->sb_inode_bitmap + inode_bitmap_size);
+	sb->sb_inode_table = image_align(sb->sb_block_bitmap + block_bitmap_size);
+	sb->sb_data =
+		image_align(sb->sb_inode_table + INODE_TABLE_SIZE * sizeof(inode_t));
+	sb->sb_image_size = sb->sb_data + DATA_BLOCKS * BLOCK_SIZE;
+}
+
+/**
+ * Write a range of the image mapping to the image file.
+ *
+ * Input:
+ *   - ptr: start of the range, inside the mapping
+ *   - data: what to write there
+ *   - len: length of the range
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int image_write(void const *ptr, void const *data, size_t len) {
+	off_t offset = (off_t)((char const *)ptr - image);
+	size_t done = 0;
+	while (done < len) {
+		ssize_t n = pwrite(image_fd, (char const *)data + done, len - done,
+						   offset + (off_t)done);
+		if (n == -1) {
+			return -1;
+		}
+		done += (size_t)n;
+	}
+	return 0;
+}
+
+/**
+ * Open (or create) the image file and map it.
+ *
+ * An existing image keeps the geometry it was formatted with, which replaces
+ * the one in fs_params. With a journal, the mapping is private, and a new
+ * image is formatted by writing to the file.
+ *
+ * Input:
+ *   - restored: set to whether the image already held a file system
+ *
+ * Returns 0 if successful, -1 otherwise.
+ *
+ * Possible errors:
+ *   - The image cannot be opened, resized or mapped.
+ *   - The image is not a TécnicoFS image, or was formatted by an incompatible
+ *     build.
+ */
+static int image_open(bool *restored) {
+	image_fd = open(fs_params.image_path, O_RDWR | O_CREAT, 0640);
+	if (image_fd == -1) {
+		return -1;
+	}
+
+	struct stat st;
+	if (fstat(image_fd, &st) == -1) {
+		return -1;
+	}
+
+	superblock_t sb;
+	*restored = st.st_size > 0;
+	if (*restored) {
+		if (pread(image_fd, &sb, sizeof(sb), 0) != sizeof(sb) ||
+			memcmp(sb.sb_magic, IMAGE_MAGIC, sizeof(sb.sb_magic)) != 0 ||
+			sb.sb_inode_size != sizeof(inode_t) ||
+			sb.sb_image_size != (size_t)st.st_size) {
+			return -1; // not an image, or not one we can use
+		}
+		fs_params.max_inode_count = sb.sb_inode_count;
+		fs_params.max_block_count = sb.sb_block_count;
+		fs_params.block_size = sb.sb_block_size;
+	} else {
+		image_layout(&sb);
+		if (ftruncate(image_fd, (off_t)sb.sb_image_size) == -1) {
+			return -1;
+		}
+	}
+
+	image_size = sb.sb_image_size;
+	bool private = fs_params.journal_path != NULL;
+	void *map = mmap(NULL, image_size, PROT_READ | PROT_WRITE,
+					 private ? MAP_PRIVATE : MAP_SHARED, image_fd, 0);
+	if (map == MAP_FAILED) {
+		return -1;
+	}
+	image = map;
+
+	freeinode_ts = (uint64_t *)(image + sb.sb_inode_bitmap);
+	free_blocks = (uint64_t *)(image + sb.sb_block_bitmap);
+	inode_table = (inode_t *)(image + sb.sb_inode_table);
+	fs_data = image + sb.sb_data;
+
+	if (!*restored) {
+		bitmap_init(freeinode_ts, INODE_TABLE_SIZE);
+		bitmap_init(free_blocks, DATA_BLOCKS);
+		// the superblock goes last: until then, this is not an image
+		memcpy(image, &sb, sizeof(sb));
+		char *bitmaps = image + sb.sb_inode_bitmap;
+		if (private &&
+			(image_write(bitmaps, bitmaps,
+						 sb.sb_inode_table - sb.sb_inode_bitmap) == -1 ||
+			 image_write(image, image, sizeof(sb)) == -1)) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static int image_msync(void) { return msync(image, image_size, MS_SYNC); }
+
+static int image_fdatasync(void) { return fdatasync(image_fd); }
+
+/**
+ * Sync the file data written into the image since the last commit, before
+ * the journal records referring to it are written out.
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int image_sync_data(void) {
+	if (!atomic_exchange(&data_unsynced, false)) {
+		return 0;
+	}
+	return fdatasync(image_fd);
+}
+
+static void *image_sync_run(void *arg) {
+	(void)arg;
+	pthread_mutex_lock(&image_sync_lock);
+	while (!image_sync_stop) {
+		struct timespec deadline;
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += fs_params.sync_interval_ms / 1000;
+		deadline.tv_nsec += (long)(fs_params.sync_interval_ms % 1000) * 1000000;
+		if (deadline.tv_nsec >= 1000000000) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000;
+		}
+
+		int ret = pthread_cond_timedwait(&image_sync_cond, &image_sync_lock,
+										 &deadline);
+		if (ret == ETIMEDOUT && journaled) {
+			journal_checkpoint();
+		} else if (ret == ETIMEDOUT) {
+			image_msync();
+		}
+	}
+	pthread_mutex_unlock(&image_sync_lock);
+	return NULL;
+}
+
+/**
+ * Locate a region of the persistent state.
+ *
+ * Input:
+ *   - region: the region
+ *   - size: set to the size of the region
+ *
+ * Returns pointer to the start of the region.
+ */
+static char *region_get(uint32_t region, size_t *size) {
+	switch (region) {
+	case REGION_INODE_BITMAP:
+		*size = BITMAP_WORDS(INODE_TABLE_SIZE) * sizeof(uint64_t);
+		return (char *)freeinode_ts;
+	case REGION_BLOCK_BITMAP:
+		*size = BITMAP_WORDS(DATA_BLOCKS) * sizeof(uint64_t);
+		return (char *)free_blocks;
+	case REGION_INODE_TABLE:
+		*size = INODE_TABLE_SIZE * sizeof(inode_t);
+		return (char *)inode_table;
+	case REGION_DATA:
+		*size = DATA_BLOCKS * BLOCK_SIZE;
+		return fs_data;
+	default:
+		*size = 0;
+		return NULL;
+	}
+}
+
+static int journal_apply(uint32_t region, uint64_t offset, void const *data,
+						 size_t len) {
+	size_t size;
+	char *base = region_get(region, &size);
+	if (base != NULL && offset <= size && len <= size - offset) {
+		memcpy(base + offset, data, len);
+	}
+	return 0;
+}
+
+/**
+ * Write a journal record to the image file, at a checkpoint.
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int journal_checkpoint_apply(uint32_t region, uint64_t offset,
+									void const *data, size_t len) {
+	size_t size;
+	char *base = region_get(region, &size);
+	if (base == NULL || offset > size || len > size - offset) {
+		return 0; // not replayed either
+	}
+	return image_write(base + offset, data, len);
+}
+
+/**
+ * Apply the journal to the image file and empty it.
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int journal_checkpoint(void) {
+	return wal_checkpoint(journal_checkpoint_apply, image_fdatasync);
+}
+
+/**
+ * Open the journal and replay it into the image.
+ *
+ * The journal only holds metadata, and file contents are written straight
+ * into the image, so there is no journal without an image.
+ *
+ * Input:
+ *   - restored: set if the journal held any record
+ *
+ * Returns 0 if successful, -1 otherwise.
+ *
+ * Possible errors:
+ *   - There is no image.
+ *   - The journal cannot be opened, or was created for another geometry.
+ */
+static int journal_open(bool *restored) {
+	if (image == NULL) {
+		return -1; // nowhere to keep file contents
+	}
+
+	wal_geometry_t geometry = {
+		.g_inode_count = INODE_TABLE_SIZE,
+		.g_block_count = DATA_BLOCKS,
+		.g_block_size = BLOCK_SIZE,
+	};
+	bool existing;
+	if (wal_open(fs_params.journal_path, &geometry, &existing,
+				 image_sync_data) == -1) {
+		return -1;
+	}
+	journaled = true;
+
+	if (geometry.g_inode_count != INODE_TABLE_SIZE ||
+		geometry.g_block_count != DATA_BLOCKS ||
+		geometry.g_block_size != BLOCK_SIZE) {
+		return -1; // journal of another file system
+	}
+
+	int replayed = wal_replay(journal_apply);
+	if (replayed == -1) {
+		return -1;
+	}
+	if (replayed > 0) {
+		*restored = true;
+	}
+
+	// The replayed state is written out and the journal starts over
+	if (journal_checkpoint() == -1) {
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * Record a change to the persistent state in the journal.
+ *
+ * Must be called while holding the lock that protects the changed state,
+ * after changing it. Does nothing if there is no journal.
+ *
+ * Input:
+ *   - ptr: start of the changed range, inside one region
+ *   - len: length of the range
+ */
+void state_journal(void const *ptr, size_t len) {
+	if (!journaled) {
+		return;
+	}
+
+	uintptr_t start = (uintptr_t)ptr;
+	for (uint32_t region = 0; region < REGION_COUNT; region++) {
+		size_t size;
+		uintptr_t base = (uintptr_t)region_get(region, &size);
+		if (start >= base && start + len <= base + size) {
+			wal_append(region, start - base, ptr, len);
+			return;
+		}
+	}
+	PANIC("state_journal: range outside the persistent state");
+}
+
+/**
+ * Note that file data was written into the image. It is not journaled, but
+ * written to the image file right away: the next commit syncs it before
+ * writing out any record, so it is durable once the records referring to it
+ * are. Does nothing if there is no journal.
+ *
+ * Input:
+ *   - ptr: start of the data written, inside a data block
+ *   - len: length of the data
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+int state_data_written(void const *ptr, size_t len) {
+	if (!journaled) {
+		return 0;
+	}
+	atomic_store(&data_unsynced, true);
+	return image_write(ptr, ptr, len);
+}
+
+/**
+ * Return the commit point of the calling thread's changes so far, for
+ * state_commit_upto, or 0 if there is no journal.
+ */
+uint64_t state_commit_point(void) { return journaled ? wal_last_lsn() : 0; }
+
+/**
+ * Make the journal records of the calling thread durable.
+ *
+ * Returns 0 if successful (or if there is no journal), -1 otherwise.
+ */
+int state_commit(void) { return state_commit_upto(state_commit_point()); }
+
+/**
+ * Make the journal records up to a commit point durable, whichever thread
+ * made them. The journal is checkpointed once it holds
+ * JOURNAL_CHECKPOINT_SIZE bytes, however often the image is synced.
+ *
+ * Input:
+ *   - lsn: commit point returned by state_commit_point
+ *
+ * Returns 0 if successful (or if there is nothing to commit), -1 otherwise.
+ */
+int state_commit_upto(uint64_t lsn) {
+	if (!journaled || lsn == 0) {
+		return 0;
+	}
+	if (wal_commit_upto(lsn) == -1 ||
+		(wal_length() >= JOURNAL_CHECKPOINT_SIZE &&
+		 journal_checkpoint() == -1)) {
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * Return whether a write to the journal failed, after which the file system
+ * accepts no more changes: one that could not be made durable would be lost
+ * at the next crash, along with everything that depends on it.
+ */
+bool state_failed(void) { return journaled && wal_failed(); }
+
+/**
+ * Initialize FS state.
+ *
+ * Input:
+ *   - params: TécnicoFS parameters
+ *   - restored: set to whether the state was restored from an image or a
+ *     journal, in which case the file system already has its root directory
+ *
+ * Returns 0 if successful, -1 otherwise.
+ *
+ * Possible errors:
+ *   - TFS already initialized.
+ *   - malloc failure when allocating TFS structures.
+ *   - The image file or the journal cannot be used.
+ */
+int state_init(tfs_params params, bool *restored) {
+	if (inode_table != NULL) {
+		return -1; // already initialized
+	}
+
+	fs_params = params;
+	delay_init();
+	*restored = false;
+	if (fs_params.image_path != NULL && image_open(restored) == -1) {
+		state_destroy();
+		return -1;
+	}
+	if (fs_params.journal_path != NULL && journal_open(restored) == -1) {
+		state_destroy();
+		return -1;
+	}
+	if (inode_table == NULL) {
+		inode_table = malloc(INODE_TABLE_SIZE * sizeof(inode_t));
+		freeinode_ts = bitmap_create(INODE_TABLE_SIZE);
+		fs_data = malloc(DATA_BLOCKS * BLOCK_SIZE);
+		free_blocks = bitmap_create(DATA_BLOCKS);
+	}
+	block_alloc_map = free_blocks;
+	if (journaled) {
+		size_t bitmap_size = BITMAP_WORDS(DATA_BLOCKS) * sizeof(uint64_t);
+		block_alloc_map = malloc(bitmap_size);
+		if (block_alloc_map != NULL) {
+			memcpy(block_alloc_map, free_blocks, bitmap_size);
+		}
+	}
+	open_file_chunks =
+		calloc((MAX_OPEN_FILES + OPEN_FILE_CHUNK - 1) / OPEN_FILE_CHUNK,
+			   sizeof(open_file_entry_t *));
+	inode_locks = malloc(INODE_TABLE_SIZE * sizeof(pthread_rwlock_t));
+	inode_opens = calloc(INODE_TABLE_SIZE, sizeof(*inode_opens));
+	inode_unlinked = calloc(INODE_TABLE_SIZE, sizeof(bool));
+	dir_index_bucket_count = 64;
+	while (dir_index_bucket_count < INODE_TABLE_SIZE) {
+		dir_index_bucket_count <<= 1;
+	}
+	dir_index_buckets = malloc(dir_index_bucket_count * sizeof(int));
+
+	if (!inode_table || !freeinode_ts || !fs_data || !free_blocks ||
+		!block_alloc_map || !open_file_chunks || !inode_locks || !inode_opens ||
+		!inode_unlinked || !dir_index_buckets) {
+		return -1; // allocation failed
+	}
+
+	for (size_t i = 0; i < dir_index_bucket_count; i++) {
+		dir_index_buckets[i] = -1;
+	}
+
+	for (size_t i = 0; i < INODE_TABLE_SIZE; i++) {
+		pthread_rwlock_init(&inode_locks[i], NULL);
+	}
+	inode_cursor = 0;
+	block_cursor = 0;
+
+	open_file_count = 0;
+	open_file_free_head = 0;
+
+	pthread_mutex_init(&free_inodes_lock, NULL);
+	pthread_mutex_init(&free_blocks_lock, NULL);
+	pthread_mutex_init(&open_file_table_lock, NULL);
+
+	if (*restored) {
+		if (dir_index_build(&inode_table[ROOT_DIR_INUM]) == -1) {
+			return -1;
+		}
+		inode_reclaim_orphans();
+	}
+
+	if (image != NULL && fs_params.sync_interval_ms > 0) {
+		pthread_mutex_init(&image_sync_lock, NULL);
+		pthread_cond_init(&image_sync_cond, NULL);
+		image_sync_stop = false;
+		if (pthread_create(&image_sync_thread, NULL, image_sync_run, NULL) !=
+			0) {
+			return -1;
+		}
+		image_sync_running = true;
+	}
+
+	return 0;
+}
+
+/**
+ * Destroy FS state.
+ *
+ * If there is an image, it is synced to disk before being unmapped, and the
+ * journal emptied.
+ *
+ * Returns 0 if succesful, -1 otherwise.
+ */
+int state_destroy(void) {
+	if (image_sync_running) {
+		pthread_mutex_lock(&image_sync_lock);
+		image_sync_stop = true;
+		pthread_cond_signal(&image_sync_cond);
+		pthread_mutex_unlock(&image_sync_lock);
+		pthread_join(image_sync_thread, NULL);
+		pthread_mutex_destroy(&image_sync_lock);
+		pthread_cond_destroy(&image_sync_cond);
+		image_sync_running = false;
+	}
+
+	if (inode_locks != NULL) {
+		for (size_t i = 0; i < INODE_TABLE_SIZE; i++) {
+			pthread_rwlock_destroy(&inode_locks[i]);
+		}
+		pthread_mutex_destroy(&free_inodes_lock);
+		pthread_mutex_destroy(&free_blocks_lock);
+		pthread_mutex_destroy(&open_file_table_lock);
+	}
+
+	int ret = 0;
+	if (journaled) {
+		if (journal_checkpoint() == -1 || wal_close() == -1) {
+			ret = -1;
+		}
+	} else if (image != NULL && image_msync() == -1) {
+		ret = -1;
+	}
+	if (block_alloc_map != free_blocks) {
+		free(block_alloc_map);
+	}
+	journaled = false;
+	free(pending_frees);
+	if (image != NULL) {
+		munmap(image, image_size);
+	} else {
+		free(inode_table);
+		free(freeinode_ts);
+		free(fs_data);
+		free(free_blocks);
+	}
+	if (image_fd != -1) {
+		close(image_fd);
+	}
+	if (open_file_chunks != NULL) {
+		for (size_t i = 0; i < open_file_count; i++) {
+			pthread_mutex_destroy(&open_file_entry((int)i)->of_lock);
+		}
+		for (size_t i = 0; i * OPEN_FILE_CHUNK < open_file_count; i++) {
+			free(open_file_chunks[i]);
+		}
+	}
+	free(open_file_chunks);
+	free(inode_locks);
+	free(inode_opens);
+	free(inode_unlinked);
+	free(dir_index_buckets);
+	free(dir_index_next);
+	free(dir_index_hashes);
+	free(dir_free_slots);
+
+	image = NULL;
+	image_fd = -1;
+	inode_table = NULL;
+	freeinode_ts = NULL;
+	fs_data = NULL;
+	free_blocks = NULL;
+	block_alloc_map = NULL;
+	pending_frees = NULL;
+	pending_free_count = 0;
+	pending_free_capacity = 0;
+	open_file_chunks = NULL;
+	open_file_count = 0;
+	inode_locks = NULL;
+	inode_opens = NULL;
+	inode_unlinked = NULL;
+	dir_index_buckets = NULL;
+	dir_index_next = NULL;
+	dir_index_hashes = NULL;
+	dir_free_slots = NULL;
+	dir_slot_count = 0;
+	dir_free_count = 0;
+
+	return ret;
+}
+
+/**
+ * (Try to) Allocate a new inode in the inode table, without initializing its
+ * data.
+ *
+ * The search starts where the previous one left off (next-fit), wrapping
+ * around at the end of the table.
+ *
+ * Returns the inumber of the newly allocated inode, or -1 in the case of error.
+ *
+ * Possible errors:
+ *   - No free slots in inode table.
+ */
+static int inode_alloc(void) {
+	ALWAYS_ASSERT(pthread_mutex_lock(&free_inodes_lock) == 0,
+				  "inode_alloc: failed to lock free inode table");
+	size_t inumber =
+		bitmap_next_free(freeinode_ts, inode_cursor, INODE_TABLE_SIZE);
+	if (inumber == INODE_TABLE_SIZE) {
+		inumber = bitmap_next_free(freeinode_ts, 0, inode_cursor);
+		if (inumber == inode_cursor) {
+			pthread_mutex_unlock(&free_inodes_lock);
+			return -1; // no free inodes
+		}
+	}
+
+	//  Found a free entry, so takes it for the new inode
+	bitmap_set(freeinode_ts, inumber);
+	state_journal(&freeinode_ts[inumber / 64], sizeof(uint64_t));
+	inode_cursor = (inumber + 1) % INODE_TABLE_SIZE;
+	pthread_mutex_unlock(&free_inodes_lock);
+
+	return (int)inumber;
+}
+
+/**
+ * (Try to) Take a specific data block.
+ *
+ * Input:
+ *   - block_number: the block number/index
+ *
+ * Returns true if the block was free and is now taken, false otherwise.
+ */
+static bool data_block_take(int block_number) {
+	if (!valid_block_number(block_number)) {
+		return false;
+	}
+
+	insert_delay(); // simulate storage access delay to free_blocks
+
+	ALWAYS_ASSERT(pthread_mutex_lock(&free_blocks_lock) == 0,
+				  "data_block_take: failed to lock free block table");
+	data_blocks_release();
+	bool taken = !bitmap_test(block_alloc_map, (size_t)block_number);
+	if (taken) {
+		bitmap_set(block_alloc_map, (size_t)block_number);
+		bitmap_set(free_blocks, (size_t)block_number);
+		state_journal(&free_blocks[block_number / 64], sizeof(uint64_t));
+	}
+	pthread_mutex_unlock(&free_blocks_lock);
+
+	return taken;
+}
+
+/**
+ * Create a new inode in the inode table.
+ *
+ * Allocates and initializes a new inode.
+ * Directories will have their data block allocated and initialized, with i_size
+ * set to BLOCK_SIZE. Regular files will not have any data blocks allocated
+ * (i_size will be set to 0, with no extents).
+ *
+ * Input:
+ *   - i_type: the type of the node (file or directory)
+ *
+ * Returns inumber of the new inode, or -1 in the case of error.
+ *
+ * Possible errors:
+ *   - No free slots in inode table.
+ *   - (if creating a directory) No free data blocks.
+ */
+int inode_create(inode_type i_type) {
+	int inumber = inode_alloc();
+	if (inumber == -1) {
+		return -1; // no free slots in inode table
+	}
+
+	inode_t *inode = &inode_table[inumber];
+	insert_delay(); // simulate storage access delay (to inode)
+
+	inode->i_node_type = i_type;
+	inode->i_size = 0;
+	inode->i_block_count = 0;
+	inode->i_extent_count = 0;
+	inode->i_indirect_block = -1;
+	switch (i_type) {
+	case T_DIRECTORY: {
+		// Initializes directory (filling its block with empty entries, labeled
+		// with inumber==-1)
+		if (inode_reserve(inode, 1) == -1) {
+			// run regular deletion process
+			inode_delete(inumber);
+			return -1;
+		}
+
+		inode->i_size = BLOCK_SIZE;
+
+		dir_entry_t *dir_entry =
+			(dir_entry_t *)data_block_get(inode_block_get(inode, 0));
+		ALWAYS_ASSERT(dir_entry != NULL,
+					  "inode_create: data block freed while in use");
+
+		for (size_t i = 0; i < MAX_DIR_ENTRIES; i++) {
+			dir_entry[i].d_inumber = -1;
+		}
+		state_journal(dir_entry, BLOCK_SIZE);
+
+		if (inumber == ROOT_DIR_INUM && dir_index_build(inode) == -1) {
+			inode_delete(inumber);
+			return -1;
+		}
+	} break;
+	case T_FILE:
+		// In case of a new file, there is nothing else to initialize
+		break;
+	default:
+		PANIC("inode_create: unknown file type");
+	}
+	inode_journal(inode);
+
+	return inumber;
+}
+
+/**
+ * Delete an inode.
+ *
+ * Input:
+ *   - inumber: inode's number
+ */
+void inode_delete(int inumber) {
+	// simulate storage access delay (to inode and freeinode_ts)
+	insert_delay();
+	insert_delay();
+
+	ALWAYS_ASSERT(valid_inumber(inumber), "inode_delete: invalid inumber");
+
+	ALWAYS_ASSERT(bitmap_test(freeinode_ts, (size_t)inumber),
+				  "inode_delete: inode already freed");
+
+	inode_truncate(&inode_table[inumber]);
+
+	ALWAYS_ASSERT(pthread_mutex_lock(&free_inodes_lock) == 0,
+				  "inode_delete: failed to lock free inode table");
+	bitmap_clear(freeinode_ts, (size_t)inumber);
+	state_journal(&freeinode_ts[inumber / 64], sizeof(uint64_t));
+	pthread_mutex_unlock(&free_inodes_lock);
+}
+
+/**
+ * Delete an inode that was removed from its directory, as soon as it is no
+ * longer open: right away if it has no open file entries, or else when the
+ * last one is removed from the open file table.
+ *
+ * Input:
+ *   - inumber: inode's number, locked for writing by the caller
+ *
+ * Returns true if the inode was deleted, false if it was left to its last
+ * open file entry.
+ */
+bool inode_unlink(int inumber) {
+	ALWAYS_ASSERT(valid_inumber(inumber), "inode_unlink: invalid inumber");
+
+	if (inode_opens[inumber] > 0) {
+		inode_unlinked[inumber] = true;
+		return false;
+	}
+	inode_delete(inumber);
+	return true;
+}
+
+/**
+ * Drop an open file entry's reference to an inode, deleting the inode if it
+ * was the last reference to an unlinked one.
+ *
+ * Input:
+ *   - inumber: inode's number
+ *
+ * Returns true if the inode was deleted.
+ */
+static bool inode_release(int inumber) {
+	// inode_unlink checks the count with the lock held for writing, so it
+	// either sees this reference or leaves the deletion to it
+	inode_rdlock(inumber);
+	bool last = atomic_fetch_sub(&inode_opens[inumber], 1) == 1 &&
+				inode_unlinked[inumber];
+	inode_unlock(inumber);
+	if (!last) {
+		return false;
+	}
+
+	// Nothing refers to the inode anymore: no entry names it, and no open
+	// file entry holds it
+	inode_wrlock(inumber);
+	inode_unlinked[inumber] = false;
+	inode_delete(inumber);
+	inode_unlock(inumber);
+	return true;
+}
+
+/**
+ * Obtain a pointer to an inode from its inumber.
+ *
+ * Input:
+ *   - inumber: inode's number
+ *
+ * Returns pointer to inode.
+ */
+inode_t *inode_get(int inumber) {
+	ALWAYS_ASSERT(valid_inumber(inumber), "inode_get: invalid inumber");
+
+	insert_delay(); // simulate storage access delay to inode
+	return &inode_table[inumber];
+}
+
+/**
+ * Lock an inode for reading.
+ *
+ * Input:
+ *   - inumber: inode's number
+ */
+void inode_rdlock(int inumber) {
+	ALWAYS_ASSERT(valid_inumber(inumber), "inode_rdlock: invalid inumber");
+	ALWAYS_ASSERT(pthread_rwlock_rdlock(&inode_locks[inumber]) == 0,
+				  "inode_rdlock: failed to lock inode");
+}
+
+/**
+ * Lock an inode for writing.
+ *
+ * Input:
+ *   - inumber: inode's number
+ */
+void inode_wrlock(int inumber) {
+	ALWAYS_ASSERT(valid_inumber(inumber), "inode_wrlock: invalid inumber");
+	ALWAYS_ASSERT(pthread_rwlock_wrlock(&inode_locks[inumber]) == 0,
+				  "inode_wrlock: failed to lock inode");
+}
+
+/**
+ * Unlock an inode.
+ *
+ * Input:
+ *   - inumber: inode's number
+ */
+void inode_unlock(int inumber) {
+	ALWAYS_ASSERT(valid_inumber(inumber), "inode_unlock: invalid inumber");
+	ALWAYS_ASSERT(pthread_rwlock_unlock(&inode_locks[inumber]) == 0,
+				  "inode_unlock: failed to unlock inode");
+}
+
+/**
+ * Obtain a pointer to one of an inode's extents.
+ *
+ * Input:
+ *   - inode: the inode
+ *   - index: extent index (must be below inode->i_extent_count)
+ *
+ * Returns pointer to the extent, either in the inode or in its indirect block.
+ */
+static extent_t *inode_extent(inode_t *inode, size_t index) {
+	if (index < INODE_DIRECT_EXTENTS) {
+		return &inode->i_extents[index];
+	}
+
+	extent_t *indirect = (extent_t *)data_block_get(inode->i_indirect_block);
+	return &indirect[index - INODE_DIRECT_EXTENTS];
+}
+
+/**
+ * Append an extent to an inode's extent list.
+ *
+ * Input:
+ *   - inode: the inode
+ *   - start: first block of the extent
+ *   - length: number of blocks in the extent
+ *
+ * Returns 0 if successful, -1 otherwise.
+ *
+ * Possible errors:
+ *   - No free data block for the indirect extent block.
+ *   - Indirect extent block is full.
+ */
+static int inode_add_extent(inode_t *inode, int start, size_t length) {
+	size_t index = inode->i_extent_count;
+	if (index >= INODE_DIRECT_EXTENTS + MAX_INDIRECT_EXTENTS) {
+		return -1; // no room for more extents
+	}
+
+	if (index >= INODE_DIRECT_EXTENTS && inode->i_indirect_block == -1) {
+		int b = data_block_alloc();
+		if (b == -1) {
+			return -1; // no space for the indirect block
+		}
+		inode->i_indirect_block = b;
+	}
+
+	inode->i_extent_count++;
+	extent_t *extent = inode_extent(inode, index);
+	extent->e_start = start;
+	extent->e_length = (int)length;
+
+	return 0;
+}
+
+/**
+ * Obtain the data block holding a given block of a file.
+ *
+ * Input:
+ *   - inode: the inode
+ *   - file_block: block index within the file
+ *
+ * Returns the block number, or -1 if the file has no such block.
+ */
+int inode_block_get(inode_t const *inode, size_t file_block) {
+	extent_cursor_t cursor = EXTENT_CURSOR_INIT;
+	return inode_block_seek(inode, &cursor, file_block);
+}
+
+/**
+ * Obtain the data block holding a given block of a file, starting the search
+ * at a cursor's extent.
+ *
+ * The cursor is left at the extent holding the block, so a loop over the
+ * blocks of a range walks the extent list once, instead of once per block. It
+ * goes back to the first extent only if asked for a block before its own. The
+ * extent list must not shrink while the cursor is in use.
+ *
+ * Input:
+ *   - inode: the inode
+ *   - cursor: extent cursor, EXTENT_CURSOR_INIT before the first call
+ *   - file_block: block index within the file
+ *
+ * Returns the block number, or -1 if the file has no such block.
+ */
+int inode_block_seek(inode_t const *inode, extent_cursor_t *cursor,
+					 size_t file_block) {
+	if (file_block >= inode->i_block_count) {
+		return -1;
+	}
+
+	if (file_block < cursor->ec_first ||
+		cursor->ec_extent >= inode->i_extent_count) {
+		cursor->ec_extent = 0;
+		cursor->ec_first = 0;
+	}
+	for (; cursor->ec_extent < inode->i_extent_count; cursor->ec_extent++) {
+		extent_t const *extent =
+			inode_extent((inode_t *)inode, cursor->ec_extent);
+		size_t length = (size_t)extent->e_length;
+		if (file_block < cursor->ec_first + length) {
+			return extent->e_start + (int)(file_block - cursor->ec_first);
+		}
+		cursor->ec_first += length;
+	}
+
+	return -1;
+}
+
+/**
+ * Make sure an inode has (at least) a given number of data blocks.
+ *
+ * The last extent is grown in place whenever the following blocks are free, so
+ * that sequentially written files stay contiguous. Otherwise, new contiguous
+ * runs are allocated and added as extents.
+ *
+ * Input:
+ *   - inode: the inode
+ *   - block_count: number of blocks the inode must hold
+ *
+ * Returns 0 if successful, -1 otherwise (blocks allocated before the error
+ * remain with the inode).
+ *
+ * Possible errors:
+ *   - No free data blocks.
+ *   - No room for more extents.
+ */
+int inode_reserve(inode_t *inode, size_t block_count) {
+	while (inode->i_block_count < block_count) {
+		size_t missing = block_count - inode->i_block_count;
+
+		if (inode->i_extent_count > 0) {
+			extent_t *last = inode_extent(inode, inode->i_extent_count - 1);
+			size_t grown = 0;
+			while (grown < missing &&
+				   data_block_take(last->e_start + last->e_length)) {
+				last->e_length++;
+				grown++;
+			}
+			inode->i_block_count += grown;
+			if (grown > 0) {
+				continue;
+			}
+		}
+
+		size_t allocated;
+		int start = data_block_alloc_run(missing, &allocated);
+		if (start == -1) {
+			inode_journal(inode);
+			return -1; // no free blocks
+		}
+
+		if (inode_add_extent(inode, start, allocated) == -1) {
+			for (size_t i = 0; i < allocated; i++) {
+				data_block_free(start + (int)i);
+			}
+			inode_journal(inode);
+			return -1;
+		}
+		inode->i_block_count += allocated;
+	}
+	inode_journal(inode);
+
+	return 0;
+}
+
+/**
+ * Release all data blocks of an inode, leaving it empty.
+ *
+ * The emptied inode is journaled before the blocks are freed, so that no
+ * part of the journal has the blocks free while the inode still holds them.
+ *
+ * Input:
+ *   - inode: the inode
+ */
+void inode_truncate(inode_t *inode) {
+	inode_t old = *inode; // its indirect block is left as it is
+
+	inode->i_size = 0;
+	inode->i_block_count = 0;
+	inode->i_extent_count = 0;
+	inode->i_indirect_block = -1;
+	inode_journal(inode);
+
+	for (size_t i = 0; i < old.i_extent_count; i++) {
+		extent_t const *extent = inode_extent(&old, i);
+		for (int b = 0; b < extent->e_length; b++) {
+			data_block_free(extent->e_start + b);
+		}
+	}
+
+	if (old.i_indirect_block != -1) {
+		data_block_free(old.i_indirect_block);
+	}
+}
+
+/**
+ * Record an inode in the journal, with the extents in its indirect block.
+ *
+ * Input:
+ *   - inode: the inode, locked for writing by the caller
+ */
+void inode_journal(inode_t const *inode) {
+	if (!journaled) {
+		return;
+	}
+
+	state_journal(inode, sizeof(inode_t));
+	if (inode->i_extent_count > INODE_DIRECT_EXTENTS) {
+		state_journal(&fs_data[(size_t)inode->i_indirect_block * BLOCK_SIZE],
+					  (inode->i_extent_count - INODE_DIRECT_EXTENTS) *
+						  sizeof(extent_t));
+	}
 }
 
-size_t state_block_size(void) { return BLOCK_SIZE; }
-
 /**
- * Do nothing, while preventing the compiler from performing any optimizations.
- *
- * We need to defeat the optimizer for the insert_delay() function.
- * Under optimization, the empty loop would be completely optimized away.
- * This function tells the compiler that the assembly code being run (which is
- * none) might potentially change *all memory in the process*.
- *
- * This prevents the optimizer from optimizing this code away, because it does
- * not know what it does and it may have side effects.
- *
- * Reference with more information: https://youtu.be/nXaxk27zwlk?t=2775
- *
- * Exercise: try removing this function and look at the assembly generated to
- * compare.
+ * Hash a file name (FNV-1a).
  */
-static void touch_all_memory(void) { __asm volatile("" : : : "memory"); }
+static uint32_t dir_name_hash(char const *name) {
+	uint32_t hash = 2166136261u;
+	for (size_t i = 0; i < MAX_FILE_NAME && name[i] != '\0'; i++) {
+		hash ^= (uint8_t)name[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
 
 /**
- * Artifically delay execution (busy loop).
+ * Obtain a pointer to a directory entry.
  *
- * Auxiliary function to insert a delay.
- * Used in accesses to persistent FS state as a way of emulating access
- * latencies as if such data structures were really stored in secondary memory.
+ * Input:
+ *   - inode: directory inode
+ *   - slot: entry number, counting across all of the directory's blocks
+ *
+ * Returns pointer to the entry.
  */
-static void insert_delay(void) {
-	for (int i = 0; i < DELAY; i++) {
-		touch_all_memory();
-	}
+static dir_entry_t *dir_entry_get(inode_t const *inode, size_t slot) {
+	dir_entry_t *block = (dir_entry_t *)data_block_get(
+		inode_block_get(inode, slot / MAX_DIR_ENTRIES));
+	ALWAYS_ASSERT(block != NULL, "dir_entry_get: directory block missing");
+	return &block[slot % MAX_DIR_ENTRIES];
 }
 
 /**
- * Initialize FS state.
+ * Make room in the directory index for a directory with more slots.
+ *
+ * The new slots are all free; they are stacked so that the lowest slots are
+ * handed out first.
  *
  * Input:
- *   - params: TécnicoFS parameters
+ *   - slot_count: new number of slots in the directory
  *
  * Returns 0 if successful, -1 otherwise.
  *
  * Possible errors:
- *   - TFS already initialized.
- *   - malloc failure when allocating TFS structures.
+ *   - realloc failure.
  */
-int state_init(tfs_params params) {
-	fs_params = params;
-
-	if (inode_table != NULL) {
-		return -1; // already initialized
+static int dir_index_grow(size_t slot_count) {
+	int *next = realloc(dir_index_next, slot_count * sizeof(int));
+	if (next != NULL) {
+		dir_index_next = next;
 	}
-
-	inode_table = malloc(INODE_TABLE_SIZE * sizeof(inode_t));
-	freeinode_ts = malloc(INODE_TABLE_SIZE * sizeof(allocation_state_t));
-	fs_data = malloc(DATA_BLOCKS * BLOCK_SIZE);
-	free_blocks = malloc(DATA_BLOCKS * sizeof(allocation_state_t));
-	open_file_table = malloc(MAX_OPEN_FILES * sizeof(open_file_entry_t));
-	free_open_file_entries =
-		malloc(MAX_OPEN_FILES * sizeof(allocation_state_t));
-
-	if (!inode_table || !freeinode_ts || !fs_data || !free_blocks ||
-		!open_file_table || !free_open_file_entries) {
-		return -1; // allocation failed
+	uint32_t *hashes = realloc(dir_index_hashes, slot_count * sizeof(uint32_t));
+	if (hashes != NULL) {
+		dir_index_hashes = hashes;
 	}
-
-	for (size_t i = 0; i < INODE_TABLE_SIZE; i++) {
-		freeinode_ts[i] = FREE;
+	int *free_slots = realloc(dir_free_slots, slot_count * sizeof(int));
+	if (free_slots != NULL) {
+		dir_free_slots = free_slots;
 	}
-
-	for (size_t i = 0; i < DATA_BLOCKS; i++) {
-		free_blocks[i] = FREE;
+	if (next == NULL || hashes == NULL || free_slots == NULL) {
+		return -1;
 	}
 
-	for (size_t i = 0; i < MAX_OPEN_FILES; i++) {
-		free_open_file_entries[i] = FREE;
+	for (size_t slot = slot_count; slot > dir_slot_count; slot--) {
+		dir_free_slots[dir_free_count++] = (int)slot - 1;
 	}
+	dir_slot_count = slot_count;
 
 	return 0;
 }
 
 /**
- * Destroy FS state.
+ * Add a directory slot to the index.
  *
- * Returns 0 if succesful, -1 otherwise.
+ * Input:
+ *   - slot: the slot, holding an entry whose name hashes to hash
+ *   - hash: the name's hash
  */
-int state_destroy(void) {
-	free(inode_table);
-	free(freeinode_ts);
-	free(fs_data);
-	free(free_blocks);
-	free(open_file_table);
-	free(free_open_file_entries);
-
-	inode_table = NULL;
-	freeinode_ts = NULL;
-	fs_data = NULL;
-	free_blocks = NULL;
-	open_file_table = NULL;
-	free_open_file_entries = NULL;
+static void dir_index_link(size_t slot, uint32_t hash) {
+	size_t bucket = hash & (dir_index_bucket_count - 1);
+	dir_index_hashes[slot] = hash;
+	dir_index_next[slot] = dir_index_buckets[bucket];
+	dir_index_buckets[bucket] = (int)slot;
+}
 
-	return 0;
+/**
+ * Remove a directory slot from the index.
+ *
+ * Input:
+ *   - slot: the slot (must be in the index)
+ */
+static void dir_index_unlink(size_t slot) {
+	size_t bucket = dir_index_hashes[slot] & (dir_index_bucket_count - 1);
+	int *link = &dir_index_buckets[bucket];
+	while (*link != (int)slot) {
+		ALWAYS_ASSERT(*link != -1, "dir_index_unlink: slot not in index");
+		link = &dir_index_next[*link];
+	}
+	*link = dir_index_next[slot];
 }
 
 /**
- * (Try to) Allocate a new inode in the inode table, without initializing its
- * data.
+ * Find the directory slot holding a given name.
  *
- * Returns the inumber of the newly allocated inode, or -1 in the case of error.
+ * Input:
+ *   - inode: directory inode
+ *   - sub_name: sub file name
  *
- * Possible errors:
- *   - No free slots in inode table.
+ * Returns the slot, or -1 if there is no entry for sub_name.
  */
-static int inode_alloc(void) {
-	for (size_t inumber = 0; inumber < INODE_TABLE_SIZE; inumber++) {
-		if ((inumber * sizeof(allocation_state_t) % BLOCK_SIZE) == 0) {
-			insert_delay(); // simulate storage access delay (to freeinode_ts)
-		}
-
-		// Finds first free entry in inode table
-		if (freeinode_ts[inumber] == FREE) {
-			//  Found a free entry, so takes it for the new inode
-			freeinode_ts[inumber] = TAKEN;
-
-			return (int)inumber;
+static int dir_index_find(inode_t const *inode, char const *sub_name) {
+	uint32_t hash = dir_name_hash(sub_name);
+	int slot = dir_index_buckets[hash & (dir_index_bucket_count - 1)];
+	for (; slot != -1; slot = dir_index_next[slot]) {
+		if (dir_index_hashes[slot] == hash &&
+			strncmp(dir_entry_get(inode, (size_t)slot)->d_name, sub_name,
+					MAX_FILE_NAME) == 0) {
+			return slot;
 		}
 	}
-
-	// no free inodes
 	return -1;
 }
 
 /**
- * Create a new inode in the inode table.
- *
- * Allocates and initializes a new inode.
- * Directories will have their data block allocated and initialized, with i_size
- * set to BLOCK_SIZE. Regular files will not have their data block allocated
- * (i_size will be set to 0, i_data_block to -1).
+ * (Re)build the directory index from the root directory's blocks.
  *
  * Input:
- *   - i_type: the type of the node (file or directory)
+ *   - inode: root directory inode
  *
- * Returns inumber of the new inode, or -1 in the case of error.
+ * Returns 0 if successful, -1 otherwise.
  *
  * Possible errors:
- *   - No free slots in inode table.
- *   - (if creating a directory) No free data blocks.
+ *   - realloc failure.
  */
-int inode_create(inode_type i_type) {
-	int inumber = inode_alloc();
-	if (inumber == -1) {
-		return -1; // no free slots in inode table
+static int dir_index_build(inode_t const *inode) {
+	for (size_t i = 0; i < dir_index_bucket_count; i++) {
+		dir_index_buckets[i] = -1;
 	}
+	dir_slot_count = 0;
+	dir_free_count = 0;
 
-	inode_t *inode = &inode_table[inumber];
-	insert_delay(); // simulate storage access delay (to inode)
-
-	inode->i_node_type = i_type;
-	switch (i_type) {
-	case T_DIRECTORY: {
-		// Initializes directory (filling its block with empty entries, labeled
-		// with inumber==-1)
-		int b = data_block_alloc();
-		if (b == -1) {
-			// ensure fields are initialized
-			inode->i_size = 0;
-			inode->i_data_block = -1;
-
-			// run regular deletion process
-			inode_delete(inumber);
-			return -1;
-		}
-
-		inode_table[inumber].i_size = BLOCK_SIZE;
-		inode_table[inumber].i_data_block = b;
-
-		dir_entry_t *dir_entry = (dir_entry_t *)data_block_get(b);
-		ALWAYS_ASSERT(dir_entry != NULL,
-					  "inode_create: data block freed while in use");
+	if (dir_index_grow(inode->i_block_count * MAX_DIR_ENTRIES) == -1) {
+		return -1;
+	}
 
-		for (size_t i = 0; i < MAX_DIR_ENTRIES; i++) {
-			dir_entry[i].d_inumber = -1;
+	// Slots in use leave the free stack, keeping the others in order
+	size_t free_count = 0;
+	for (size_t i = 0; i < dir_free_count; i++) {
+		size_t slot = (size_t)dir_free_slots[i];
+		dir_entry_t const *entry = dir_entry_get(inode, slot);
+		if (entry->d_inumber == -1) {
+			dir_free_slots[free_count++] = (int)slot;
+		} else {
+			dir_index_link(slot, dir_name_hash(entry->d_name));
 		}
-	} break;
-	case T_FILE:
-		// In case of a new file, simply sets its size to 0
-		inode_table[inumber].i_size = 0;
-		inode_table[inumber].i_data_block = -1;
-		break;
-	default:
-		PANIC("inode_create: unknown file type");
 	}
+	dir_free_count = free_count;
 
-	return inumber;
+	return 0;
 }
 
 /**
- * Delete an inode.
- *
- * Input:
- *   - inumber: inode's number
+ * Delete the inodes left without a directory entry, which were still open
+ * when the previous run stopped. Called on a restored state, before any file
+ * is opened.
  */
-void inode_delete(int inumber) {
-	// simulate storage access delay (to inode and freeinode_ts)
-	insert_delay();
-	insert_delay();
-
-	ALWAYS_ASSERT(valid_inumber(inumber), "inode_delete: invalid inumber");
-
-	ALWAYS_ASSERT(freeinode_ts[inumber] == TAKEN,
-				  "inode_delete: inode already freed");
-
-	if (inode_table[inumber].i_size > 0) {
-		data_block_free(inode_table[inumber].i_data_block);
+static void inode_reclaim_orphans(void) {
+	inode_t const *root = &inode_table[ROOT_DIR_INUM];
+	uint64_t *named = bitmap_create(INODE_TABLE_SIZE);
+	if (named == NULL) {
+		return; // the orphans stay until the next start
 	}
 
-	freeinode_ts[inumber] = FREE;
+	size_t slots = root->i_block_count * MAX_DIR_ENTRIES;
+	for (size_t slot = 0; slot < slots; slot++) {
+		int inumber = dir_entry_get(root, slot)->d_inumber;
+		if (valid_inumber(inumber)) {
+			bitmap_set(named, (size_t)inumber);
+		}
+	}
+	for (size_t i = 0; i < INODE_TABLE_SIZE; i++) {
+		if (i != ROOT_DIR_INUM && bitmap_test(freeinode_ts, i) &&
+			!bitmap_test(named, i)) {
+			inode_delete((int)i);
+		}
+	}
+	free(named);
 }
 
-/**
- * Obtain a pointer to an inode from its inumber.
- *
- * Input:
- *   - inumber: inode's number
- *
- * Returns pointer to inode.
- */
-inode_t *inode_get(int inumber) {
-	ALWAYS_ASSERT(valid_inumber(inumber), "inode_get: invalid inumber");
-
-	insert_delay(); // simulate storage access delay to inode
-	return &inode_table[inumber];
+static inline bool is_root_dir(inode_t const *inode) {
+	return inode == &inode_table[ROOT_DIR_INUM];
 }
 
 /**
@@ -299,25 +1670,29 @@ int clear_dir_entry(inode_t *inode, char const *sub_name) {
 	if (inode->i_node_type != T_DIRECTORY) {
 		return -1; // not a directory
 	}
+	ALWAYS_ASSERT(is_root_dir(inode),
+				  "clear_dir_entry: only the root directory is supported");
 
-	// Locates the block containing the entries of the directory
-	dir_entry_t *dir_entry = (dir_entry_t *)data_block_get(inode->i_data_block);
-	ALWAYS_ASSERT(dir_entry != NULL,
-				  "clear_dir_entry: directory must have a data block");
-
-	for (size_t i = 0; i < MAX_DIR_ENTRIES; i++) {
-		if (!strcmp(dir_entry[i].d_name, sub_name)) {
-			dir_entry[i].d_inumber = -1;
-			memset(dir_entry[i].d_name, 0, MAX_FILE_NAME);
-			return 0;
-		}
+	int slot = dir_index_find(inode, sub_name);
+	if (slot == -1) {
+		return -1; // sub_name not found
 	}
-	return -1; // sub_name not found
+
+	dir_entry_t *dir_entry = dir_entry_get(inode, (size_t)slot);
+	dir_entry->d_inumber = -1;
+	memset(dir_entry->d_name, 0, MAX_FILE_NAME);
+	state_journal(dir_entry, sizeof(dir_entry_t));
+
+	dir_index_unlink((size_t)slot);
+	dir_free_slots[dir_free_count++] = slot;
+	return 0;
 }
 
 /**
  * Store the inumber for a sub file in a directory.
  *
+ * The directory grows by one block when all of its entries are in use.
+ *
  * Input:
  *   - inode: directory inode
  *   - sub_name: sub file name
@@ -328,7 +1703,7 @@ int clear_dir_entry(inode_t *inode, char const *sub_name) {
  * Possible errors:
  *   - inode is not a directory inode.
  *   - sub_name is not a valid file name (length 0 or > MAX_FILE_NAME - 1).
- *   - Directory is already full of entries.
+ *   - Directory is full of entries and cannot grow.
  */
 int add_dir_entry(inode_t *inode, char const *sub_name, int sub_inumber) {
 	if (strlen(sub_name) == 0 || strlen(sub_name) > MAX_FILE_NAME - 1) {
@@ -339,24 +1714,40 @@ int add_dir_entry(inode_t *inode, char const *sub_name, int sub_inumber) {
 	if (inode->i_node_type != T_DIRECTORY) {
 		return -1; // not a directory
 	}
+	ALWAYS_ASSERT(is_root_dir(inode),
+				  "add_dir_entry: only the root directory is supported");
+
+	if (dir_free_count == 0) {
+		// Add a block of empty entries to the directory
+		size_t block_count = inode->i_block_count + 1;
+		if (inode_reserve(inode, block_count) == -1) {
+			return -1; // no space for entry
+		}
+		int b = inode_block_get(inode, block_count - 1);
+		dir_entry_t *dir_entry = (dir_entry_t *)data_block_get(b);
+		for (size_t i = 0; i < MAX_DIR_ENTRIES; i++) {
+			dir_entry[i].d_inumber = -1;
+			memset(dir_entry[i].d_name, 0, MAX_FILE_NAME);
+		}
+		inode->i_size = block_count * BLOCK_SIZE;
+		state_journal(dir_entry, BLOCK_SIZE);
+		inode_journal(inode);
 
-	// Locates the block containing the entries of the directory
-	dir_entry_t *dir_entry = (dir_entry_t *)data_block_get(inode->i_data_block);
-	ALWAYS_ASSERT(dir_entry != NULL,
-				  "add_dir_entry: directory must have a data block");
-
-	// Finds and fills the first empty entry
-	for (size_t i = 0; i < MAX_DIR_ENTRIES; i++) {
-		if (dir_entry[i].d_inumber == -1) {
-			dir_entry[i].d_inumber = sub_inumber;
-			strncpy(dir_entry[i].d_name, sub_name, MAX_FILE_NAME - 1);
-			dir_entry[i].d_name[MAX_FILE_NAME - 1] = '\0';
-
-			return 0;
+		if (dir_index_grow(block_count * MAX_DIR_ENTRIES) == -1) {
+			return -1; // no space for entry
 		}
 	}
 
-	return -1; // no space for entry
+	// Fills the lowest empty entry
+	int slot = dir_free_slots[--dir_free_count];
+	dir_entry_t *dir_entry = dir_entry_get(inode, (size_t)slot);
+	dir_entry->d_inumber = sub_inumber;
+	strncpy(dir_entry->d_name, sub_name, MAX_FILE_NAME - 1);
+	dir_entry->d_name[MAX_FILE_NAME - 1] = '\0';
+	state_journal(dir_entry, sizeof(dir_entry_t));
+
+	dir_index_link((size_t)slot, dir_name_hash(dir_entry->d_name));
+	return 0;
 }
 
 /**
@@ -380,23 +1771,69 @@ int find_in_dir(inode_t const *inode, char const *sub_name) {
 	if (inode->i_node_type != T_DIRECTORY) {
 		return -1; // not a directory
 	}
+	ALWAYS_ASSERT(is_root_dir(inode),
+				  "find_in_dir: only the root directory is supported");
 
-	// Locates the block containing the entries of the directory
-	dir_entry_t *dir_entry = (dir_entry_t *)data_block_get(inode->i_data_block);
-	ALWAYS_ASSERT(dir_entry != NULL,
-				  "find_in_dir: directory inode must have a data block");
+	int slot = dir_index_find(inode, sub_name);
+	if (slot == -1) {
+		return -1; // entry not found
+	}
+
+	return dir_entry_get(inode, (size_t)slot)->d_inumber;
+}
 
-	// Iterates over the directory entries looking for one that has the target
-	// name
-	for (int i = 0; i < MAX_DIR_ENTRIES; i++)
-		if ((dir_entry[i].d_inumber != -1) &&
-			(strncmp(dir_entry[i].d_name, sub_name, MAX_FILE_NAME) == 0)) {
+/**
+ * Call a function on every entry of a directory.
+ *
+ * Input:
+ *   - inode: directory inode
+ *   - fn: called with the name and inumber of each entry
+ *   - arg: passed on to fn
+ *
+ * Returns 0 if successful, -1 otherwise.
+ *
+ * Possible errors:
+ *   - inode is not a directory inode.
+ */
+int dir_foreach(inode_t const *inode,
+				void (*fn)(char const *sub_name, int sub_inumber, void *arg),
+				void *arg) {
+	insert_delay(); // simulate storage access delay to inode
+	if (inode->i_node_type != T_DIRECTORY) {
+		return -1; // not a directory
+	}
 
-			int sub_inumber = dir_entry[i].d_inumber;
-			return sub_inumber;
+	size_t slots = inode->i_block_count * MAX_DIR_ENTRIES;
+	for (size_t slot = 0; slot < slots; slot++) {
+		dir_entry_t const *entry = dir_entry_get(inode, slot);
+		if (entry->d_inumber != -1) {
+			fn(entry->d_name, entry->d_inumber, arg);
 		}
+	}
+	return 0;
+}
+
+/**
+ * Hand the blocks whose free is now durable back to the allocator. Frees are
+ * journaled with free_blocks_lock held, so they are pending in journal order.
+ * Called with free_blocks_lock held.
+ */
+static void data_blocks_release(void) {
+	if (pending_free_count == 0) {
+		return;
+	}
 
-	return -1; // entry not found
+	uint64_t durable = wal_durable_lsn();
+	size_t released = 0;
+	while (released < pending_free_count &&
+		   pending_frees[released].pf_lsn <= durable) {
+		bitmap_clear(block_alloc_map,
+					 (size_t)pending_frees[released].pf_block);
+		released++;
+	}
+	pending_free_count -= released;
+	memmove(pending_frees, pending_frees + released,
+			pending_free_count * sizeof(pending_free_t));
 }
 
 /**
@@ -408,23 +1845,64 @@ int find_in_dir(inode_t const *inode, char const *sub_name) {
  *   - No free data blocks.
  */
 int data_block_alloc(void) {
-	for (size_t i = 0; i < DATA_BLOCKS; i++) {
-		if (i * sizeof(allocation_state_t) % BLOCK_SIZE == 0) {
-			insert_delay(); // simulate storage access delay to free_blocks
-		}
+	size_t allocated;
+	return data_block_alloc_run(1, &allocated);
+}
 
-		if (free_blocks[i] == FREE) {
-			free_blocks[i] = TAKEN;
+/**
+ * Allocate a run of contiguous data blocks.
+ *
+ * The search starts where the previous one left off (next-fit), and takes the
+ * first run of count free blocks. If there is no such run, the longest run
+ * found is taken instead.
+ *
+ * Input:
+ *   - count: maximum number of blocks to allocate
+ *   - allocated: set to the number of blocks actually allocated
+ *
+ * Returns the number/index of the first block if successful, -1 otherwise.
+ *
+ * Possible errors:
+ *   - No free data blocks.
+ */
+int data_block_alloc_run(size_t count, size_t *allocated) {
+	ALWAYS_ASSERT(pthread_mutex_lock(&free_blocks_lock) == 0,
+				  "data_block_alloc_run: failed to lock free block table");
+	data_blocks_release();
+	size_t start = 0;
+	size_t length = 0;
+	if (!bitmap_find_run(block_alloc_map, block_cursor, DATA_BLOCKS, count,
+						 &start, &length)) {
+		bitmap_find_run(block_alloc_map, 0, block_cursor, count, &start,
+						&length);
+	}
 
-			return (int)i;
-		}
+	if (length == 0) {
+		pthread_mutex_unlock(&free_blocks_lock);
+		return -1; // no free blocks
 	}
-	return -1;
+
+	for (size_t i = start; i < start + length; i++) {
+		bitmap_set(block_alloc_map, i);
+		bitmap_set(free_blocks, i);
+	}
+	state_journal(&free_blocks[start / 64],
+				  (BITMAP_WORDS(start + length) - start / 64) *
+					  sizeof(uint64_t));
+	block_cursor = (start + length) % DATA_BLOCKS;
+	pthread_mutex_unlock(&free_blocks_lock);
+
+	*allocated = length;
+	return (int)start;
 }
 
 /**
  * Free a data block.
  *
+ * With a journal, the allocator only gets the block back once its free is
+ * durable (see data_blocks_release). If there is no memory to keep track of
+ * it until then, it stays taken until the file system is next started.
+ *
  * Input:
  *   - block_number: the block number/index
  */
@@ -434,7 +1912,31 @@ void data_block_free(int block_number) {
 
 	insert_delay(); // simulate storage access delay to free_blocks
 
-	free_blocks[block_number] = FREE;
+	ALWAYS_ASSERT(pthread_mutex_lock(&free_blocks_lock) == 0,
+				  "data_block_free: failed to lock free block table");
+	bitmap_clear(free_blocks, (size_t)block_number);
+	state_journal(&free_blocks[block_number / 64], sizeof(uint64_t));
+	if (!journaled) {
+		pthread_mutex_unlock(&free_blocks_lock);
+		return; // the allocator searches free_blocks itself
+	}
+
+	if (pending_free_count == pending_free_capacity) {
+		size_t capacity =
+			pending_free_capacity == 0 ? 64 : pending_free_capacity * 2;
+		pending_free_t *grown =
+			realloc(pending_frees, capacity * sizeof(pending_free_t));
+		if (grown == NULL) {
+			pthread_mutex_unlock(&free_blocks_lock);
+			return;
+		}
+		pending_frees = grown;
+		pending_free_capacity = capacity;
+	}
+	pending_frees[pending_free_count].pf_block = block_number;
+	pending_frees[pending_free_count].pf_lsn = wal_last_lsn();
+	pending_free_count++;
+	pthread_mutex_unlock(&free_blocks_lock);
 }
 
 /**
@@ -453,6 +1955,80 @@ void *data_block_get(int block_number) {
 	return &fs_data[(size_t)block_number * BLOCK_SIZE];
 }
 
+/**
+ * Pop an entry off the free list.
+ *
+ * Returns the entry's file handle, or -1 if the list is empty.
+ */
+static int open_file_pop(void) {
+	uint64_t head = open_file_free_head;
+	while ((uint32_t)head != 0) {
+		int fhandle = (int)(uint32_t)head - 1;
+		int next = open_file_entry(fhandle)->of_next_free;
+		uint64_t popped = (((head >> 32) + 1) << 32) | (uint32_t)(next + 1);
+		if (atomic_compare_exchange_weak(&open_file_free_head, &head,
+										 popped)) {
+			return fhandle;
+		}
+	}
+	return -1;
+}
+
+/**
+ * Push an entry onto the free list.
+ */
+static void open_file_push(int fhandle) {
+	open_file_entry_t *file = open_file_entry(fhandle);
+	uint64_t head = open_file_free_head;
+	uint64_t pushed;
+	do {
+		file->of_next_free = (int)(uint32_t)head - 1;
+		pushed = (((head >> 32) + 1) << 32) | (uint32_t)(fhandle + 1);
+	} while (!atomic_compare_exchange_weak(&open_file_free_head, &head,
+										   pushed));
+}
+
+/**
+ * Grow the open file table by a chunk, unless another thread freed or added
+ * entries in the meantime.
+ *
+ * Returns the handle of a free entry, or -1 if the table is full.
+ */
+static int open_file_table_grow(void) {
+	ALWAYS_ASSERT(pthread_mutex_lock(&open_file_table_lock) == 0,
+				  "open_file_table_grow: failed to lock open file table");
+	int fhandle = open_file_pop();
+	size_t count = open_file_count;
+	if (fhandle != -1 || count >= MAX_OPEN_FILES) {
+		pthread_mutex_unlock(&open_file_table_lock);
+		return fhandle;
+	}
+
+	size_t len = MAX_OPEN_FILES - count;
+	if (len > OPEN_FILE_CHUNK) {
+		len = OPEN_FILE_CHUNK;
+	}
+	open_file_entry_t *chunk = malloc(len * sizeof(open_file_entry_t));
+	if (chunk == NULL) {
+		pthread_mutex_unlock(&open_file_table_lock);
+		return -1;
+	}
+	for (size_t i = 0; i < len; i++) {
+		pthread_mutex_init(&chunk[i].of_lock, NULL);
+		chunk[i].of_state = FREE;
+	}
+	open_file_chunks[count / OPEN_FILE_CHUNK] = chunk;
+	open_file_count = count + len;
+
+	// The first entry goes to the caller, the others to the free list
+	for (size_t i = len - 1; i > 0; i--) {
+		open_file_push((int)(count + i));
+	}
+	pthread_mutex_unlock(&open_file_table_lock);
+
+	return (int)count;
+}
+
 /**
  * Add a new entry to the open file table.
  *
@@ -466,33 +2042,43 @@ void *data_block_get(int block_number) {
  *   - No space in open file table for a new open file.
  */
 int add_to_open_file_table(int inumber, size_t offset) {
-	for (int i = 0; i < MAX_OPEN_FILES; i++) {
-		if (free_open_file_entries[i] == FREE) {
-			free_open_file_entries[i] = TAKEN;
-			open_file_table[i].of_inumber = inumber;
-			open_file_table[i].of_offset = offset;
-
-			return i;
+	int fhandle = open_file_pop();
+	if (fhandle == -1) {
+		fhandle = open_file_table_grow();
+		if (fhandle == -1) {
+			return -1;
 		}
 	}
 
-	return -1;
+	open_file_entry_t *file = open_file_entry(fhandle);
+	file->of_inumber = inumber;
+	file->of_offset = offset;
+	file->of_state = TAKEN;
+	inode_opens[inumber]++;
+	return fhandle;
 }
 
 /**
  * Free an entry from the open file table.
  *
+ * If it was the last entry of an unlinked inode, the inode is deleted.
+ *
  * Input:
  *   - fhandle: file handle to free/close
+ *
+ * Returns true if the inode was deleted.
  */
-void remove_from_open_file_table(int fhandle) {
+bool remove_from_open_file_table(int fhandle) {
 	ALWAYS_ASSERT(valid_file_handle(fhandle),
 				  "remove_from_open_file_table: file handle must be valid");
 
-	ALWAYS_ASSERT(free_open_file_entries[fhandle] == TAKEN,
+	open_file_entry_t *file = open_file_entry(fhandle);
+	int inumber = file->of_inumber;
+	allocation_state_t taken = TAKEN;
+	ALWAYS_ASSERT(atomic_compare_exchange_strong(&file->of_state, &taken, FREE),
 				  "remove_from_open_file_table: file handle must be taken");
-
-	free_open_file_entries[fhandle] = FREE;
+	open_file_push(fhandle);
+	return inode_release(inumber);
 }
 
 /**
@@ -509,9 +2095,31 @@ open_file_entry_t *get_open_file_entry(int fhandle) {
 		return NULL;
 	}
 
-	if (free_open_file_entries[fhandle] != TAKEN) {
+	open_file_entry_t *file = open_file_entry(fhandle);
+	if (file->of_state != TAKEN) {
 		return NULL;
 	}
+	return file;
+}
+
+/**
+ * Lock an open file entry, to use its offset.
+ *
+ * Input:
+ *   - file: open file entry
+ */
+void open_file_lock(open_file_entry_t *file) {
+	ALWAYS_ASSERT(pthread_mutex_lock(&file->of_lock) == 0,
+				  "open_file_lock: failed to lock open file entry");
+}
 
-	return &open_file_table[fhandle];
+/**
+ * Unlock an open file entry.
+ *
+ * Input:
+ *   - file: open file entry
+ */
+void open_file_unlock(open_file_entry_t *file) {
+	ALWAYS_ASSERT(pthread_mutex_unlock(&file->of_lock) == 0,
+				  "open_file_unlock: failed to unlock open file entry");
 }
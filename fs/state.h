@@ -4,6 +4,8 @@
 #include "config.h"
 #include "operations.h"
 
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -19,47 +21,97 @@ typedef struct {
 
 typedef enum { T_FILE, T_DIRECTORY } inode_type;
 
+/**
+ * Extent: a run of contiguous data blocks
+ */
+typedef struct {
+	int e_start;
+	int e_length;
+} extent_t;
+
 /**
  * Inode
+ *
+ * File data lives in a list of extents. The first INODE_DIRECT_EXTENTS are
+ * kept in the inode itself; further extents are stored in an indirect block.
  */
 typedef struct {
 	inode_type i_node_type;
 
 	size_t i_size;
-	int i_data_block;
+	size_t i_block_count; // blocks allocated, across all extents
+	size_t i_extent_count;
+	extent_t i_extents[INODE_DIRECT_EXTENTS];
+	int i_indirect_block; // block holding the remaining extents, or -1
 
 	// in a more complete FS, more fields could exist here
 } inode_t;
 
+/**
+ * Position in an inode's extent list, so that consecutive blocks of a file are
+ * looked up without walking the list from its start for each one
+ */
+typedef struct {
+	size_t ec_extent; // extent index
+	size_t ec_first;  // file block where that extent starts
+} extent_cursor_t;
+
+#define EXTENT_CURSOR_INIT {0, 0}
+
 typedef enum { FREE = 0, TAKEN = 1 } allocation_state_t;
 
 /**
  * Open file entry (in open file table)
  */
 typedef struct {
+	pthread_mutex_t of_lock; // protects of_offset
 	int of_inumber;
 	size_t of_offset;
+	_Atomic allocation_state_t of_state;
+	_Atomic int of_next_free; // next entry in the free list, or -1
 } open_file_entry_t;
 
-int state_init(tfs_params);
+int state_init(tfs_params params, bool *restored);
 int state_destroy(void);
+void state_journal(void const *ptr, size_t len);
+int state_data_written(void const *ptr, size_t len);
+uint64_t state_commit_point(void);
+int state_commit(void);
+int state_commit_upto(uint64_t lsn);
+bool state_failed(void);
 
 size_t state_block_size(void);
 
 int inode_create(inode_type n_type);
 void inode_delete(int inumber);
+bool inode_unlink(int inumber);
 inode_t *inode_get(int inumber);
+void inode_rdlock(int inumber);
+void inode_wrlock(int inumber);
+void inode_unlock(int inumber);
+int inode_block_get(inode_t const *inode, size_t file_block);
+int inode_block_seek(inode_t const *inode, extent_cursor_t *cursor,
+					 size_t file_block);
+int inode_reserve(inode_t *inode, size_t block_count);
+void inode_truncate(inode_t *inode);
+void inode_journal(inode_t const *inode);
 
 int clear_dir_entry(inode_t *inode, char const *sub_name);
 int add_dir_entry(inode_t *inode, char const *sub_name, int sub_inumber);
 int find_in_dir(inode_t const *inode, char const *sub_name);
+int dir_foreach(inode_t const *inode,
+				void (*fn)(char const *sub_name, int sub_inumber, void *arg),
+				void *arg);
 
 int data_block_alloc(void);
+int data_block_alloc_run(size_t count, size_t *allocated);
 void data_block_free(int block_number);
 void *data_block_get(int block_number);
 
 int add_to_open_file_table(int inumber, size_t offset);
-void remove_from_open_file_table(int fhandle);
+bool remove_from_open_file_table(int fhandle);
 open_file_entry_t *get_open_file_entry(int fhandle);
+void open_file_lock(open_file_entry_t *file);
+void open_file_unlock(open_file_entry_t *file);
 
 #endif // STATE_H
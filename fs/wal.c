@@ -0,0 +1,584 @@
+#include "wal.h"
+#include "betterassert.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define WAL_MAGIC "TFSWAL02"
+
+typedef struct {
+	char h_magic[8];
+	wal_geometry_t h_geometry;
+	uint64_t h_start; // offset of the first record not checkpointed yet
+} wal_header_t;
+
+typedef struct {
+	uint32_t r_checksum; // of the record (with r_checksum 0) and its data
+	uint32_t r_region;
+	uint64_t r_offset;
+	uint64_t r_length;
+} wal_record_t;
+
+// Records appended since the buffer was last written out
+typedef struct {
+	char *b_data;
+	size_t b_len;
+	size_t b_capacity;
+} wal_buffer_t;
+
+static int wal_fd = -1;
+static wal_header_t wal_header;
+static pthread_mutex_t wal_lock;
+static pthread_cond_t wal_flushed;
+
+// Appenders fill the active buffer while the other one is being written out
+static wal_buffer_t wal_buffers[2];
+static int wal_active;
+
+static uint64_t appended_lsn; // records appended so far
+static uint64_t durable_lsn;  // records known to be on disk
+static bool flushing;		  // a committer or checkpoint is writing the file
+static bool checkpointing;	  // a checkpoint is applying the journal
+static bool failed;			  // a write failed: no more changes are accepted
+static uint64_t wal_start;	  // offset of the first record not checkpointed
+static uint64_t wal_end;	  // offset past the last record written out
+
+// Makes the data the records refer to durable, before they are written out
+static int (*wal_sync_data)(void);
+
+// Last record appended by each thread, which wal_commit waits for
+static _Thread_local uint64_t last_lsn;
+
+/**
+ * Checksum (FNV-1a) of a record and its data.
+ */
+static uint32_t wal_checksum(wal_record_t const *record, void const *data) {
+	wal_record_t copy = *record;
+	copy.r_checksum = 0;
+
+	uint32_t hash = 2166136261u;
+	unsigned char const *bytes = (unsigned char const *)&copy;
+	for (size_t i = 0; i < sizeof(copy); i++) {
+		hash = (hash ^ bytes[i]) * 16777619u;
+	}
+	bytes = data;
+	for (size_t i = 0; i < record->r_length; i++) {
+		hash = (hash ^ bytes[i]) * 16777619u;
+	}
+	return hash;
+}
+
+static int write_full(int fd, void const *data, size_t len, off_t offset) {
+	size_t done = 0;
+	while (done < len) {
+		ssize_t n = pwrite(fd, (char const *)data + done, len - done,
+						   offset + (off_t)done);
+		if (n == -1) {
+			return -1;
+		}
+		done += (size_t)n;
+	}
+	return 0;
+}
+
+static bool read_full(int fd, void *data, size_t len, off_t offset) {
+	size_t done = 0;
+	while (done < len) {
+		ssize_t n = pread(fd, (char *)data + done, len - done,
+						  offset + (off_t)done);
+		if (n <= 0) {
+			return false;
+		}
+		done += (size_t)n;
+	}
+	return true;
+}
+
+/**
+ * Open (or create) the journal.
+ *
+ * Input:
+ *   - path: journal file
+ *   - geometry: geometry of the file system; if the journal already exists,
+ *     set to the geometry it was created with
+ *   - existing: set to whether the journal already existed
+ *   - sync_data: called before every write of the journal, to make the data
+ *     its records refer to (but do not hold) durable first; returns 0 if
+ *     successful
+ *
+ * Returns 0 if successful, -1 otherwise.
+ *
+ * Possible errors:
+ *   - The journal cannot be opened or created.
+ *   - The file is not a TécnicoFS journal.
+ */
+int wal_open(char const *path, wal_geometry_t *geometry, bool *existing,
+			 int (*sync_data)(void)) {
+	int fd = open(path, O_RDWR | O_CREAT, 0640);
+	if (fd == -1) {
+		return -1;
+	}
+
+	struct stat st;
+	wal_header_t header;
+	*existing = fstat(fd, &st) == 0 && st.st_size > 0;
+	if (*existing) {
+		if (!read_full(fd, &header, sizeof(header), 0) ||
+			memcmp(header.h_magic, WAL_MAGIC, sizeof(header.h_magic)) != 0) {
+			close(fd);
+			return -1; // not a journal
+		}
+		*geometry = header.h_geometry;
+	} else {
+		memset(&header, 0, sizeof(header));
+		memcpy(header.h_magic, WAL_MAGIC, sizeof(header.h_magic));
+		header.h_geometry = *geometry;
+		header.h_start = sizeof(header);
+		if (write_full(fd, &header, sizeof(header), 0) == -1 ||
+			fdatasync(fd) == -1) {
+			close(fd);
+			return -1;
+		}
+	}
+
+	wal_fd = fd;
+	wal_header = header;
+	wal_sync_data = sync_data;
+	pthread_mutex_init(&wal_lock, NULL);
+	pthread_cond_init(&wal_flushed, NULL);
+	wal_active = 0;
+	appended_lsn = 0;
+	durable_lsn = 0;
+	flushing = false;
+	checkpointing = false;
+	failed = false;
+	wal_start = header.h_start;
+	wal_end = header.h_start; // until wal_replay finds the last record
+	return 0;
+}
+
+/**
+ * Give up on the journal after a failed write: it is logged once, and from
+ * then on every commit fails, so that no change is reported durable that may
+ * not be. Called with wal_lock held.
+ *
+ * Input:
+ *   - what: what failed
+ *   - error: the errno it failed with
+ */
+static void wal_fail(char const *what, int error) {
+	if (!failed) {
+		failed = true;
+		fprintf(stderr,
+				"wal: %s failed: %s; no more changes are accepted until the "
+				"file system is restarted\n",
+				what, strerror(error));
+	}
+}
+
+/**
+ * Point the journal header at the first record to replay, and sync it.
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int wal_write_start(uint64_t start) {
+	wal_header.h_start = start;
+	if (write_full(wal_fd, &wal_header, sizeof(wal_header), 0) == -1 ||
+		fdatasync(wal_fd) == -1) {
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * Apply the records on disk from an offset, in order, up to another or to the
+ * first incomplete or corrupt record (the tail of a commit interrupted by a
+ * crash), whichever comes first.
+ *
+ * Input:
+ *   - from: offset of the first record
+ *   - to: offset to stop at
+ *   - apply: called with the region, offset and new contents of each record
+ *   - count: set to the number of records applied
+ *
+ * Returns the offset where the records stop, or -1 if apply failed.
+ */
+static off_t wal_scan(uint64_t from, uint64_t to, wal_apply_t apply,
+					  int *count) {
+	off_t offset = (off_t)from;
+	char *data = NULL;
+	size_t capacity = 0;
+	*count = 0;
+
+	wal_record_t record;
+	while ((uint64_t)offset < to &&
+		   read_full(wal_fd, &record, sizeof(record), offset)) {
+		if (record.r_length > capacity) {
+			char *grown = realloc(data, record.r_length);
+			if (grown == NULL) {
+				break; // no sane record is this large
+			}
+			data = grown;
+			capacity = record.r_length;
+		}
+		if (!read_full(wal_fd, data, record.r_length,
+					   offset + (off_t)sizeof(record)) ||
+			wal_checksum(&record, data) != record.r_checksum) {
+			break;
+		}
+
+		if (apply(record.r_region, record.r_offset, data, record.r_length) ==
+			-1) {
+			offset = -1;
+			break;
+		}
+		offset += (off_t)(sizeof(record) + record.r_length);
+		(*count)++;
+	}
+	free(data);
+	return offset;
+}
+
+/**
+ * Apply every record in the journal not checkpointed yet, in order.
+ *
+ * Replay stops at the first incomplete or corrupt record (the tail of a
+ * commit interrupted by a crash), which is cut off the journal.
+ *
+ * Input:
+ *   - apply: called with the region, offset and new contents of each record
+ *
+ * Returns the number of records applied, or -1 on error.
+ */
+int wal_replay(wal_apply_t apply) {
+	int count;
+	off_t offset = wal_scan(wal_start, UINT64_MAX, apply, &count);
+	if (offset == -1 || ftruncate(wal_fd, offset) == -1) {
+		return -1;
+	}
+	wal_end = (uint64_t)offset;
+	return count;
+}
+
+/**
+ * Append a record to the journal.
+ *
+ * Records of the same piece of state must be appended in the order the
+ * changes were made, so callers append while still holding the lock that
+ * protects it. The record is only durable after wal_commit.
+ *
+ * Input:
+ *   - region: region of the file system state
+ *   - offset: offset of the range in the region
+ *   - data: new contents of the range
+ *   - len: length of the range
+ */
+void wal_append(uint32_t region, uint64_t offset, void const *data,
+				size_t len) {
+	wal_record_t record = {
+		.r_checksum = 0,
+		.r_region = region,
+		.r_offset = offset,
+		.r_length = len,
+	};
+	record.r_checksum = wal_checksum(&record, data);
+
+	ALWAYS_ASSERT(pthread_mutex_lock(&wal_lock) == 0,
+				  "wal_append: failed to lock journal");
+	wal_buffer_t *buffer = &wal_buffers[wal_active];
+	size_t needed = buffer->b_len + sizeof(record) + len;
+	if (needed > buffer->b_capacity) {
+		size_t capacity = buffer->b_capacity == 0 ? 4096 : buffer->b_capacity;
+		while (capacity < needed) {
+			capacity *= 2;
+		}
+		char *grown = realloc(buffer->b_data, capacity);
+		ALWAYS_ASSERT(grown != NULL, "wal_append: out of memory");
+		buffer->b_data = grown;
+		buffer->b_capacity = capacity;
+	}
+	memcpy(buffer->b_data + buffer->b_len, &record, sizeof(record));
+	memcpy(buffer->b_data + buffer->b_len + sizeof(record), data, len);
+	buffer->b_len = needed;
+	last_lsn = ++appended_lsn;
+	pthread_mutex_unlock(&wal_lock);
+}
+
+/**
+ * Return the position in the journal of the last record appended by the
+ * calling thread, to be made durable later with wal_commit_upto.
+ */
+uint64_t wal_last_lsn(void) { return last_lsn; }
+
+/**
+ * Return the position in the journal up to which records are durable.
+ */
+uint64_t wal_durable_lsn(void) {
+	ALWAYS_ASSERT(pthread_mutex_lock(&wal_lock) == 0,
+				  "wal_durable_lsn: failed to lock journal");
+	uint64_t lsn = durable_lsn;
+	pthread_mutex_unlock(&wal_lock);
+	return lsn;
+}
+
+/**
+ * Make the records appended by the calling thread durable.
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+int wal_commit(void) { return wal_commit_upto(last_lsn); }
+
+/**
+ * Make the records up to a position in the journal durable, whichever thread
+ * appended them.
+ *
+ * The first committer to find no write in progress becomes the leader: it
+ * writes out everything appended so far, from every thread, with one write
+ * and one fdatasync. Committers arriving meanwhile wait for it, and the next
+ * leader takes all of their records at once.
+ *
+ * Input:
+ *   - lsn: position returned by wal_last_lsn
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+int wal_commit_upto(uint64_t lsn) {
+	ALWAYS_ASSERT(pthread_mutex_lock(&wal_lock) == 0,
+				  "wal_commit_upto: failed to lock journal");
+	while (durable_lsn < lsn && !failed) {
+		if (flushing) {
+			pthread_cond_wait(&wal_flushed, &wal_lock);
+			continue;
+		}
+
+		flushing = true;
+		wal_buffer_t *buffer = &wal_buffers[wal_active];
+		wal_active ^= 1;
+		uint64_t upto = appended_lsn;
+		off_t at = (off_t)wal_end;
+		pthread_mutex_unlock(&wal_lock);
+
+		char const *what = NULL;
+		if (wal_sync_data() == -1) {
+			what = "sync of file data";
+		} else if (write_full(wal_fd, buffer->b_data, buffer->b_len, at) ==
+				   -1) {
+			what = "journal write";
+		} else if (fdatasync(wal_fd) == -1) {
+			what = "journal sync";
+		}
+		int error = errno;
+
+		ALWAYS_ASSERT(pthread_mutex_lock(&wal_lock) == 0,
+					  "wal_commit_upto: failed to lock journal");
+		flushing = false;
+		if (what == NULL) {
+			durable_lsn = upto;
+			wal_end += buffer->b_len;
+		} else {
+			wal_fail(what, error);
+		}
+		buffer->b_len = 0;
+		pthread_cond_broadcast(&wal_flushed);
+	}
+	int ret = failed ? -1 : 0;
+	pthread_mutex_unlock(&wal_lock);
+
+	return ret;
+}
+
+/**
+ * Drop the records before a boundary, once a checkpoint has applied them.
+ *
+ * If nothing was written past the boundary meanwhile, the journal is cut back
+ * to its header. If what was fits in front of the first record the header
+ * points at, it is copied there, followed by a record that never passes its
+ * checksum, and the header is pointed at the copy before the rest is cut
+ * off: at every step, a replay sees the records after the boundary once, in
+ * order. Otherwise, the header just moves past the dropped records, and a
+ * later checkpoint reclaims the space.
+ *
+ * Committers wait meanwhile, as they would for a leader, but the journal is
+ * not locked, so appends carry on.
+ *
+ * Input:
+ *   - boundary: offset past the last record applied
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int wal_drop(uint64_t boundary) {
+	ALWAYS_ASSERT(pthread_mutex_lock(&wal_lock) == 0,
+				  "wal_drop: failed to lock journal");
+	while (flushing) {
+		pthread_cond_wait(&wal_flushed, &wal_lock);
+	}
+	flushing = true;
+	uint64_t start = wal_start;
+	uint64_t end = wal_end;
+	pthread_mutex_unlock(&wal_lock);
+
+	uint64_t first = sizeof(wal_header_t);
+	size_t tail = (size_t)(end - boundary);
+	wal_record_t stop = {0, UINT32_MAX, 0, 0};
+	stop.r_checksum = wal_checksum(&stop, NULL) + 1;
+	char *copy = NULL;
+	bool cut = tail == 0 || tail + sizeof(stop) <= start - first;
+	if (tail > 0 && cut) {
+		copy = malloc(tail + sizeof(stop));
+		cut = copy != NULL && read_full(wal_fd, copy, tail, (off_t)boundary);
+	}
+
+	int ret;
+	if (!cut) {
+		ret = wal_write_start(boundary);
+		start = boundary;
+	} else {
+		ret = 0;
+		if (tail > 0) {
+			memcpy(copy + tail, &stop, sizeof(stop));
+			ret = write_full(wal_fd, copy, tail + sizeof(stop), (off_t)first);
+			if (ret == 0) {
+				ret = fdatasync(wal_fd);
+			}
+		}
+		if (ret == 0) {
+			ret = wal_write_start(first);
+		}
+		if (ret == 0) {
+			ret = ftruncate(wal_fd, (off_t)(first + tail));
+		}
+		if (ret == 0) {
+			ret = fsync(wal_fd); // no stale record may outlive the cut
+		}
+		start = first;
+		end = first + tail;
+	}
+	int error = errno;
+	free(copy);
+
+	ALWAYS_ASSERT(pthread_mutex_lock(&wal_lock) == 0,
+				  "wal_drop: failed to lock journal");
+	flushing = false;
+	if (ret == 0) {
+		wal_start = start;
+		wal_end = end;
+	} else {
+		wal_fail("journal checkpoint", error);
+	}
+	pthread_cond_broadcast(&wal_flushed);
+	pthread_mutex_unlock(&wal_lock);
+	return ret;
+}
+
+/**
+ * Apply the journal to where the state is kept on disk, and drop the records
+ * applied.
+ *
+ * Everything appended so far is committed first. The boundary of the
+ * checkpoint is then taken with the journal locked, but the records up to it
+ * are applied and synced without holding the lock, so commits carry on
+ * meanwhile, past the boundary. The state on disk only ever has committed
+ * changes, exactly as a replay of the journal up to the boundary leaves it.
+ * A checkpoint that finds another one in progress leaves it to that one.
+ *
+ * Input:
+ *   - apply: writes the new contents of a range of the state, returning 0 if
+ *     successful
+ *   - sync: makes what apply wrote durable, returning 0 if successful
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+int wal_checkpoint(wal_apply_t apply, int (*sync)(void)) {
+	ALWAYS_ASSERT(pthread_mutex_lock(&wal_lock) == 0,
+				  "wal_checkpoint: failed to lock journal");
+	uint64_t lsn = appended_lsn;
+	pthread_mutex_unlock(&wal_lock);
+	if (wal_commit_upto(lsn) == -1) {
+		return -1;
+	}
+
+	ALWAYS_ASSERT(pthread_mutex_lock(&wal_lock) == 0,
+				  "wal_checkpoint: failed to lock journal");
+	if (checkpointing || failed) {
+		int ret = failed ? -1 : 0;
+		pthread_mutex_unlock(&wal_lock);
+		return ret;
+	}
+	checkpointing = true;
+	uint64_t start = wal_start;
+	uint64_t boundary = wal_end;
+	pthread_mutex_unlock(&wal_lock);
+
+	int count;
+	int ret = 0;
+	int error = -1;
+	if (wal_scan(start, boundary, apply, &count) != (off_t)boundary ||
+		sync() == -1) {
+		ret = -1;
+		error = errno;
+	} else if (boundary > sizeof(wal_header_t)) {
+		ret = wal_drop(boundary);
+	}
+
+	ALWAYS_ASSERT(pthread_mutex_lock(&wal_lock) == 0,
+				  "wal_checkpoint: failed to lock journal");
+	if (error != -1) {
+		wal_fail("checkpoint of the image", error);
+	}
+	checkpointing = false;
+	pthread_mutex_unlock(&wal_lock);
+	return ret;
+}
+
+/**
+ * Return how many bytes of records the journal holds that are not
+ * checkpointed yet, i.e. what a checkpoint would apply.
+ */
+uint64_t wal_length(void) {
+	ALWAYS_ASSERT(pthread_mutex_lock(&wal_lock) == 0,
+				  "wal_length: failed to lock journal");
+	uint64_t length = wal_end - wal_start;
+	pthread_mutex_unlock(&wal_lock);
+	return length;
+}
+
+/**
+ * Return whether a write to the journal failed, after which no more changes
+ * are accepted.
+ */
+bool wal_failed(void) {
+	ALWAYS_ASSERT(pthread_mutex_lock(&wal_lock) == 0,
+				  "wal_failed: failed to lock journal");
+	bool ret = failed;
+	pthread_mutex_unlock(&wal_lock);
+	return ret;
+}
+
+/**
+ * Close the journal, after writing out what is still buffered.
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+int wal_close(void) {
+	if (wal_fd == -1) {
+		return 0;
+	}
+
+	int ret = wal_commit_upto(appended_lsn);
+	close(wal_fd);
+	wal_fd = -1;
+
+	for (size_t i = 0; i < 2; i++) {
+		free(wal_buffers[i].b_data);
+		wal_buffers[i] = (wal_buffer_t){NULL, 0, 0};
+	}
+	pthread_mutex_destroy(&wal_lock);
+	pthread_cond_destroy(&wal_flushed);
+	return ret;
+}
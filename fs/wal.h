@@ -0,0 +1,48 @@
+#ifndef WAL_H
+#define WAL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Write-ahead journal
+ *
+ * The journal is a redo log of byte ranges of the file system state: every
+ * record holds the new contents of a range of one region (bitmap, inode
+ * table, data). Records are appended to a buffer in memory and written out by
+ * wal_commit, where concurrent committers share a single write and fdatasync
+ * (group commit). Data the records only refer to is synced before the records
+ * are written out, so a record on disk never points to data that is not.
+ * A checkpoint applies the records on disk to wherever the state is kept, and
+ * is the only way changes get there. After a write fails, the journal logs it
+ * and fails every commit from then on.
+ */
+
+typedef int (*wal_apply_t)(uint32_t region, uint64_t offset, void const *data,
+						   size_t len);
+
+/**
+ * Journal geometry, checked against the file system it is replayed into.
+ */
+typedef struct {
+	uint64_t g_inode_count;
+	uint64_t g_block_count;
+	uint64_t g_block_size;
+} wal_geometry_t;
+
+int wal_open(char const *path, wal_geometry_t *geometry, bool *existing,
+			 int (*sync_data)(void));
+int wal_replay(wal_apply_t apply);
+void wal_append(uint32_t region, uint64_t offset, void const *data,
+				size_t len);
+uint64_t wal_last_lsn(void);
+uint64_t wal_durable_lsn(void);
+int wal_commit(void);
+int wal_commit_upto(uint64_t lsn);
+int wal_checkpoint(wal_apply_t apply, int (*sync)(void));
+uint64_t wal_length(void);
+bool wal_failed(void);
+int wal_close(void);
+
+#endif // WAL_H
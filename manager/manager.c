@@ -5,6 +5,7 @@
 #include <signal.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <sys/types.h>
@@ -19,7 +20,9 @@ static void print_usage() {
 			"usage: \n"
 			"   manager <register_pipe_name> <pipe_name> create <box_name>\n"
 			"   manager <register_pipe_name> <pipe_name> remove <box_name>\n"
-			"   manager <register_pipe_name> <pipe_name> list\n");
+			"   manager <register_pipe_name> <pipe_name> list "
+			"[name|size|rate|lag]\n"
+			"   manager <register_pipe_name> <pipe_name> stats\n");
 }
 
 int new_pipe(const char *pipe_name) {
@@ -43,8 +46,15 @@ int send_request(const char *server_pipe, struct basic_request request) {
 		return -1; // failed to open pipe
 	}
 
-	ssize_t ret = write(server, &request, sizeof(request));
+	char frame[FRAME_MAX_SIZE];
+	ssize_t ret = request_encode(frame, sizeof(frame), request.code,
+								 request.client_named_pipe_path,
+								 request.box_name, START_EARLIEST);
+	if (ret > 0) {
+		ret = write(server, frame, (size_t)ret);
+	}
 	if (ret < 0) {
+		close(server);
 		return -1;
 	}
 
@@ -52,55 +62,207 @@ int send_request(const char *server_pipe, struct basic_request request) {
 	return 0;
 }
 
-int list_boxes(const char *server_pipe, const char *pipe_name) {
+// A box list entry, copied out of its frame
+struct box_row {
+	char box_name[32];
+	uint64_t box_size;
+	uint64_t n_publishers;
+	uint64_t n_subscribers;
+	struct box_list_stats stats;
+};
+
+// Orders for the sorted view: by name, or busiest (or furthest behind) first
+static int by_name(const void *a, const void *b) {
+	return strcmp(((struct box_row const *)a)->box_name,
+				  ((struct box_row const *)b)->box_name);
+}
+
+static int descending(uint64_t a, uint64_t b) {
+	return a < b ? 1 : a > b ? -1 : 0;
+}
+
+static int by_size(const void *a, const void *b) {
+	return descending(((struct box_row const *)a)->box_size,
+					  ((struct box_row const *)b)->box_size);
+}
+
+static int by_rate(const void *a, const void *b) {
+	return descending(((struct box_row const *)a)->stats.bytes_per_sec_10s,
+					  ((struct box_row const *)b)->stats.bytes_per_sec_10s);
+}
+
+static int by_lag(const void *a, const void *b) {
+	return descending(((struct box_row const *)a)->stats.max_lag,
+					  ((struct box_row const *)b)->stats.max_lag);
+}
+
+// Lists the boxes in the order the broker sends them or, given a sort key,
+// sorted and with their throughput and backlog:
+//   <box_name> <box_size> <n_publishers> <n_subscribers> <messages>
+//   <bytes/s over 10s> <bytes/s over 60s> <max lag, in messages>
+int list_boxes(const char *server_pipe, const char *pipe_name,
+			   const char *sort_key) {
+	int (*compare)(const void *, const void *) = NULL;
+	if (sort_key != NULL) {
+		if (!strcmp(sort_key, "name"))
+			compare = by_name;
+		else if (!strcmp(sort_key, "size"))
+			compare = by_size;
+		else if (!strcmp(sort_key, "rate"))
+			compare = by_rate;
+		else if (!strcmp(sort_key, "lag"))
+			compare = by_lag;
+		else {
+			print_usage();
+			return -1;
+		}
+	}
+
 	struct basic_request request = basic_request_init(LIST_BOX_REQUEST_CODE,
 													  pipe_name, NULL);
 
+	// the session fifo must exist before the broker gets the request
+	if (new_pipe(pipe_name) == -1) {
+		return -1;
+	}
+
 	if (send_request(server_pipe, request) == -1) {
+		unlink(pipe_name);
 		return -1;
 	}
 
+	int pipenum = open(pipe_name, O_RDONLY);
+	if (pipenum == -1) {
+		unlink(pipe_name);
+		return -1; // failed to open pipe
+	}
+
+	struct frame_reader reader;
+	frame_reader_init(&reader, pipenum);
+	struct box_row *rows = NULL;
+	size_t count = 0, capacity = 0;
+	struct wire_list_entry entry;
+	do {
+		char const *frame;
+		ssize_t n = frame_reader_next(&reader, &frame);
+		if (n <= 0 || list_entry_decode(frame, (size_t)n, &entry) <= 0) {
+			// n == -1 indicates error, n == 0 EOF
+			break;
+		}
+		if (entry.box_name.length == 0 ||
+			entry.box_name.length >= sizeof(rows->box_name))
+			continue;
+
+		if (count == capacity) {
+			capacity = capacity == 0 ? 16 : capacity * 2;
+			struct box_row *grown = realloc(rows, capacity * sizeof(*rows));
+			if (grown == NULL)
+				break;
+			rows = grown;
+		}
+		struct box_row *row = &rows[count++];
+		memcpy(row->box_name, entry.box_name.data, entry.box_name.length);
+		row->box_name[entry.box_name.length] = '\0';
+		row->box_size = entry.box_size;
+		row->n_publishers = entry.n_publishers;
+		row->n_subscribers = entry.n_subscribers;
+		row->stats = entry.stats;
+	} while (entry.last != 1);
+
+	if (count == 0)
+		fprintf(stdout, "NO BOXES FOUND\n");
+	if (compare != NULL)
+		qsort(rows, count, sizeof(*rows), compare);
+	for (size_t i = 0; i < count; i++) {
+		struct box_row const *row = &rows[i];
+		if (compare == NULL)
+			fprintf(stdout, "%s %zu %zu %zu\n", row->box_name,
+					row->box_size, row->n_publishers, row->n_subscribers);
+		else
+			fprintf(stdout, "%s %zu %zu %zu %zu %zu %zu %zu\n",
+					row->box_name, row->box_size, row->n_publishers,
+					row->n_subscribers, row->stats.messages,
+					row->stats.bytes_per_sec_10s,
+					row->stats.bytes_per_sec_60s, row->stats.max_lag);
+	}
+	free(rows);
+
+	close(pipenum);
+	unlink(pipe_name);
+	return 0;
+}
+
+int print_stats(const char *server_pipe, const char *pipe_name) {
+	struct basic_request request = basic_request_init(STATS_REQUEST_CODE,
+													  pipe_name, NULL);
+
+	// the session fifo must exist before the broker gets the request
 	if (new_pipe(pipe_name) == -1) {
 		return -1;
 	}
 
+	if (send_request(server_pipe, request) == -1) {
+		unlink(pipe_name);
+		return -1;
+	}
+
 	int pipenum = open(pipe_name, O_RDONLY);
 	if (pipenum == -1) {
 		unlink(pipe_name);
 		return -1; // failed to open pipe
 	}
 
-	struct box_list_entry buffer;
-	do {
-		ssize_t n = read(pipenum, &buffer, sizeof(buffer));
-		if (n == -1) {
-			// ret == -1 indicates error
+	// one JSON object per frame, until the broker closes the fifo
+	struct frame_reader reader;
+	frame_reader_init(&reader, pipenum);
+	while (true) {
+		char const *frame;
+		ssize_t n = frame_reader_next(&reader, &frame);
+		struct wire_message line;
+		if (n <= 0 || message_decode(frame, (size_t)n, &line) <= 0) {
+			// n == -1 indicates error, n == 0 EOF
 			break;
-		} else if (n != 0) {
-			if (buffer.box_name[0] == 0)
-				fprintf(stdout, "NO BOXES FOUND\n");
-			else
-				fprintf(stdout, "%s %zu %zu %zu\n", buffer.box_name,
-						buffer.box_size, buffer.n_publishers,
-						buffer.n_subscribers);
 		}
-	} while (buffer.last != 1);
+		fprintf(stdout, "%.*s\n", (int)line.message.length, line.message.data);
+	}
 
 	close(pipenum);
 	unlink(pipe_name);
 	return 0;
 }
 
+// Waits for the answer to a create or remove request, and prints it
+void print_answer(int pipenum) {
+	struct frame_reader reader;
+	frame_reader_init(&reader, pipenum);
+
+	char const *frame;
+	ssize_t n = frame_reader_next(&reader, &frame);
+	struct wire_answer answer;
+	if (n <= 0 || answer_decode(frame, (size_t)n, &answer) <= 0) {
+		// n == -1 indicates error, n == 0 EOF
+		return;
+	}
+
+	if (answer.return_code == 0)
+		fprintf(stdout, "OK\n");
+	else
+		fprintf(stdout, "ERROR %.*s\n", (int)answer.error_message.length,
+				answer.error_message.data);
+}
+
 int create_box(const char *server_pipe, const char *pipe_name,
 			   const char *box_name) {
 	struct basic_request request = basic_request_init(CREATE_BOX_REQUEST_CODE,
 													  pipe_name, box_name);
 
-	if (send_request(server_pipe, request) == -1) {
+	// the session fifo must exist before the broker gets the request
+	if (new_pipe(pipe_name) == -1) {
 		return -1;
 	}
 
-	if (new_pipe(pipe_name) == -1) {
+	if (send_request(server_pipe, request) == -1) {
+		unlink(pipe_name);
 		return -1;
 	}
 
@@ -110,20 +272,7 @@ int create_box(const char *server_pipe, const char *pipe_name,
 		return -1; // failed to open pipe
 	}
 
-	while (true) {
-		struct box_answer buffer;
-		ssize_t n = read(pipenum, &buffer, sizeof(buffer));
-		if (n == -1) {
-			// ret == -1 indicates error
-			break;
-		} else if (n != 0) {
-			if (buffer.return_code == 0)
-				fprintf(stdout, "OK\n");
-			else
-				fprintf(stdout, "ERROR %s\n", buffer.error_message);
-			break;
-		}
-	}
+	print_answer(pipenum);
 
 	close(pipenum);
 	unlink(pipe_name);
@@ -135,11 +284,13 @@ int remove_box(const char *server_pipe, const char *pipe_name,
 	struct basic_request request = basic_request_init(REMOVE_BOX_REQUEST_CODE,
 													  pipe_name, box_name);
 
-	if (send_request(server_pipe, request) == -1) {
+	// the session fifo must exist before the broker gets the request
+	if (new_pipe(pipe_name) == -1) {
 		return -1;
 	}
 
-	if (new_pipe(pipe_name) == -1) {
+	if (send_request(server_pipe, request) == -1) {
+		unlink(pipe_name);
 		return -1;
 	}
 
@@ -149,22 +300,7 @@ int remove_box(const char *server_pipe, const char *pipe_name,
 		return -1; // failed to open pipe
 	}
 
-	while (true) {
-		struct box_answer buffer;
-		ssize_t n = read(pipenum, &buffer, sizeof(buffer));
-		if (n == 0) {
-			// ret == 0 indicates EOF
-			break;
-		} else if (n == -1) {
-			// ret == -1 indicates error
-			break;
-		} else if (n != 0) {
-			if (buffer.return_code == 0)
-				fprintf(stdout, "OK\n");
-			else
-				fprintf(stdout, "ERROR %s\n", buffer.error_message);
-		}
-	}
+	print_answer(pipenum);
 
 	close(pipenum);
 	unlink(pipe_name);
@@ -176,10 +312,14 @@ int main(int argc, char **argv) {
 	switch (argc) {
 	case 4:
 		if (!strcmp(argv[3], "list"))
-			return list_boxes(argv[1], argv[2]);
+			return list_boxes(argv[1], argv[2], NULL);
+		else if (!strcmp(argv[3], "stats"))
+			return print_stats(argv[1], argv[2]);
 		break;
 	case 5:
-		if (!strcmp(argv[3], "create"))
+		if (!strcmp(argv[3], "list"))
+			return list_boxes(argv[1], argv[2], argv[4]);
+		else if (!strcmp(argv[3], "create"))
 			return create_box(argv[1], argv[2], argv[4]);
 		else if (!strcmp(argv[3], "remove"))
 			return remove_box(argv[1], argv[2], argv[4]);
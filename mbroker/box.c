@@ -1,34 +1,914 @@
 #include "box.h"
+#include "operations.h"
+#include "session.h"
+#include "stats.h"
+#include "slab.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// Locks a box, recording how long it had to wait for its box_lock
+void lock_box(struct box* box) {
+	if (pthread_mutex_trylock(&box->box_lock) == 0) {
+		stats_record(STATS_BOX_LOCK_WAIT_NS, 0);
+		return;
+	}
+	uint64_t start = stats_now();
+	pthread_mutex_lock(&box->box_lock);
+	stats_record(STATS_BOX_LOCK_WAIT_NS, stats_now() - start);
+}
+
+void unlock_box(struct box* box) {
+	pthread_mutex_unlock(&box->box_lock);
+}
+
+// Counts messages delivered to one of the box's subscribers
+void box_delivered(struct box* box, uint64_t messages) {
+	atomic_fetch_add_explicit(&box->messages_out, messages,
+							  memory_order_relaxed);
+	stats_count(STATS_MESSAGES_OUT, messages);
+}
+
+// Every box is allocated from this slab, set up the first time one is
+static slab_t box_slab;
+static pthread_once_t box_slab_once = PTHREAD_ONCE_INIT;
+static int box_slab_ret;
+
+static void box_slab_init(void) {
+	box_slab_ret = slab_init(&box_slab, sizeof(struct box));
+}
+
+// Allocates and initializes a box, holding the reference that the box table
+// takes over once the box is inserted. box_put frees it.
+// Returns NULL if there is no memory left.
+struct box* box_new(const char* box_name) {
+	pthread_once(&box_slab_once, box_slab_init);
+	if (box_slab_ret != 0) {
+		return NULL;
+	}
+	struct box* box = slab_alloc(&box_slab);
+	if (box != NULL) {
+		init_box(box, box_name);
+	}
+	return box;
+}
 
 void init_box(struct box* box, const char* box_name) {
 	strcpy(box->box_name, box_name);
+	atomic_init(&box->state, BOX_CREATING);
+	atomic_init(&box->refs, 1);
 	box->n_publishers = 0;
 	box->n_subscribers = 0;
 	box->box_size = 0;
+	atomic_init(&box->durable_size, 0);
+	box->durable_seq = 0;
+	atomic_init(&box->messages_in, 0);
+	atomic_init(&box->messages_out, 0);
+	for (size_t i = 0; i < BOX_RATE_SLOTS; i++) {
+		atomic_init(&box->rate[i].second, 0);
+		atomic_init(&box->rate[i].bytes, 0);
+	}
+	box->box_fd = -1;
+	box->segment_name[0] = '\0';
+	box->segment = NULL;
+	box->segment_fd = -1;
+	box->segment_size = 0;
+	box->segment_len = 0;
+	box->segment_end = 0;
+	box->segment_full = false;
+	box->next_seq = 0;
+	box->index = NULL;
+	box->index_len = 0;
+	box->index_capacity = 0;
 	pthread_mutex_init(&box->box_lock, NULL);
-	pthread_cond_init(&box->box_condvar, NULL);
+	box->waiters = NULL;
+	box->subscribers = NULL;
+	box->cursors = NULL;
 	box->next = NULL;
 }
 
-void destroy_box_list(struct box* node) {
+static void destroy_box(struct box* box) {
+	if (box->segment != NULL) {
+		// subscribers that still have it mapped keep their mapping
+		munmap(box->segment, BOX_SEGMENT_MAX);
+		close(box->segment_fd);
+		if (!box_removed(box)) {
+			shm_unlink(box->segment_name); // box_remove did it otherwise
+		}
+	}
+	free(box->index);
+	pthread_mutex_destroy(&box->box_lock);
+	slab_free(&box_slab, box);
+}
+
+// Drops a reference to the box, freeing it with the last one
+void box_put(struct box* box) {
+	if (atomic_fetch_sub(&box->refs, 1) == 1) {
+		destroy_box(box);
+	}
+}
+
+// Whether the box was removed. Checked under box_lock, it stays false until
+// the sessions waiting on the box have been woken up.
+bool box_removed(struct box* box) {
+	return atomic_load(&box->state) == BOX_REMOVED;
+}
+
+// Wakes up the armed thread-mode subscribers and every event-loop subscriber
+// session. Called with box_lock held.
+static void box_wake(struct box* box) {
+	for (struct box_waiter* w = box->waiters; w != NULL; w = w->next) {
+		if (w->armed) {
+			w->armed = false;
+			uint64_t one = 1;
+			if (write(w->wake_fd, &one, sizeof(one)) < 0) {
+				// the counter is already non-zero, so it wakes up anyway
+			}
+		}
+	}
+	for (struct session* s = box->subscribers; s != NULL; s = s->box_next) {
+		session_wake(s);
+	}
+}
+
+// Detaches the sessions of a box taken out of the table with box_table_take:
+// subscribers are woken up to send what is left and leave, and publishing
+// fails from now on. The segment's name is freed for the next box with the
+// same name; mapped subscribers keep their mapping.
+void box_remove(struct box* box) {
+	lock_box(box);
+	box_wake(box);
+	unlock_box(box);
+	if (box->segment != NULL) {
+		shm_unlink(box->segment_name);
+	}
+}
+
+// Creates the shared-memory segment that mirrors the box file, which mapped
+// subscribers read messages from instead of being sent copies of them. It is
+// empty until messages are published.
+// Returns 0 if successful, -1 otherwise.
+int box_map_segment(struct box* box) {
+	snprintf(box->segment_name, sizeof(box->segment_name), "/mbroker-%d-%s",
+			 (int) getpid(), box->box_name);
+
+	// Never another box's segment: a segment by that name is left over
+	int fd = shm_open(box->segment_name, O_RDWR | O_CREAT | O_EXCL, 0640);
+	if (fd == -1) {
+		return -1; // failed to create segment
+	}
+
+	// Mapping past the end of the segment only reserves address space
+	void* segment = mmap(NULL, BOX_SEGMENT_MAX, PROT_READ | PROT_WRITE,
+						 MAP_SHARED, fd, 0);
+	if (segment == MAP_FAILED) {
+		close(fd);
+		shm_unlink(box->segment_name);
+		return -1; // failed to map segment
+	}
+	box->segment = segment;
+	box->segment_fd = fd;
+	return 0;
+}
+
+// Makes room for size bytes in the box segment, allocating whole chunks so
+// that running out of memory fails here rather than on a later write to it.
+// Returns 0 if successful, -1 if the segment cannot grow that much.
+static int box_segment_grow(struct box* box, uint64_t size) {
+	if (size <= box->segment_size) {
+		return 0;
+	}
+	if (box->segment == NULL || size > BOX_SEGMENT_MAX) {
+		return -1;
+	}
+	uint64_t new_size = (size + BOX_SEGMENT_CHUNK - 1) / BOX_SEGMENT_CHUNK *
+						BOX_SEGMENT_CHUNK;
+	if (new_size > BOX_SEGMENT_MAX) {
+		new_size = BOX_SEGMENT_MAX;
+	}
+	if (posix_fallocate(box->segment_fd, (off_t) box->segment_size,
+						(off_t) (new_size - box->segment_size)) != 0) {
+		return -1;
+	}
+	box->segment_size = new_size;
+	return 0;
+}
+
+// Copies records appended to the box into its segment, unless the segment has
+// already stopped following the box or cannot grow to hold them, in which case
+// the box is only kept in its file from now on. Mapped subscribers are not
+// told of the copy until box_commit. Called with box_lock held.
+static void box_segment_append(struct box* box, char const* records,
+							   size_t len) {
+	if (box->segment_full) {
+		return;
+	}
+	if (box_segment_grow(box, box->segment_len + len) != 0) {
+		box->segment_full = true;
+		return;
+	}
+	memcpy(box->segment + box->segment_len, records, len);
+	box->segment_len += len;
+}
+
+// Whether a mapped subscriber told the box segment holds sent_end bytes has
+// been told all it ever will: the box was removed, or its segment no longer
+// follows it and all it holds is durable. Called with box_lock held.
+bool box_mapped_done(struct box* box, uint64_t sent_end) {
+	return box->segment_end == sent_end &&
+		   (box_removed(box) ||
+			(box->segment_full && box->segment_end == box->segment_len));
+}
+
+// Registers a publisher on the box and opens the append handle it publishes
+// through, which stays open until the publisher leaves.
+// Returns 0 if successful, -1 if the box already has a publisher or its file
+// cannot be opened.
+int box_open_publisher(struct box* box) {
+	char name[strlen(box->box_name)+2];
+	sprintf(name, "/%s", box->box_name);
+
+	lock_box(box);
+	if (box->n_publishers >= 1 || box_removed(box)) {
+		unlock_box(box);
+		return -1; // box already has a publisher, or is gone
+	}
+
+	box->box_fd = tfs_open(name, TFS_O_APPEND);
+	if (box->box_fd < 0) {
+		unlock_box(box);
+		return -1; // failed to open box file
+	}
+	box->n_publishers += 1;
+	unlock_box(box);
+	return 0;
+}
+
+void box_close_publisher(struct box* box) {
+	lock_box(box);
+	tfs_close(box->box_fd);
+	box->box_fd = -1;
+	box->n_publishers -= 1;
+	unlock_box(box);
+}
+
+// Adds a record to the offset index. Called with box_lock held.
+static void box_index_add(struct box* box, uint64_t seq, uint64_t offset) {
+	if (box->index_len == box->index_capacity) {
+		size_t capacity =
+			box->index_capacity == 0 ? 64 : box->index_capacity * 2;
+		struct box_index_entry* index =
+			realloc(box->index, capacity * sizeof(struct box_index_entry));
+		if (index == NULL) {
+			return; // seeks past this record just scan further
+		}
+		box->index = index;
+		box->index_capacity = capacity;
+	}
+	box->index[box->index_len].seq = seq;
+	box->index[box->index_len].offset = offset;
+	box->index_len++;
+}
+
+// Opens a read handle on the box file.
+// Returns the handle, or -1 on error.
+static int box_open_file(struct box* box) {
+	char name[strlen(box->box_name)+2];
+	sprintf(name, "/%s", box->box_name);
+	return tfs_open(name, 0);
+}
+
+// Reads the header of the record at offset, from the box segment if it holds
+// it and from the box file otherwise, through *box_fd, opened on first use.
+// Returns 0 if successful, -1 otherwise.
+static int box_record_at(struct box* box, int* box_fd, uint64_t offset,
+						 struct box_record* record) {
+	if (offset + sizeof(*record) <= box->segment_len) {
+		memcpy(record, box->segment + offset, sizeof(*record));
+		return 0;
+	}
+	if (*box_fd < 0 && (*box_fd = box_open_file(box)) < 0) {
+		return -1; // failed to open box file
+	}
+	if (tfs_seek(*box_fd, offset) != 0 ||
+		tfs_read(*box_fd, record, sizeof(*record)) !=
+			(ssize_t) sizeof(*record)) {
+		return -1;
+	}
+	return 0;
+}
+
+// Reloads a box kept in a file system image: copies its file into the box
+// segment, as far as the segment can grow, and rebuilds the sequence numbers
+// and offset index from the records.
+// Returns 0 if successful, -1 otherwise.
+int box_restore(struct box* box) {
+	int box_fd = box_open_file(box);
+	if (box_fd < 0) {
+		return -1; // failed to open box file
+	}
+
+	char buffer[BOX_READ_SIZE];
+	ssize_t n;
+	while ((n = tfs_read(box_fd, buffer, sizeof(buffer))) > 0) {
+		box_segment_append(box, buffer, (size_t) n);
+		box->box_size += (uint64_t) n;
+	}
+
+	uint64_t offset = 0;
+	int ret = 0;
+	while (box->box_size - offset >= sizeof(struct box_record)) {
+		struct box_record record;
+		if (box_record_at(box, &box_fd, offset, &record) != 0) {
+			ret = -1;
+			break;
+		}
+		if (box->box_size - offset < sizeof(record) + record.length) {
+			break;
+		}
+		if (record.seq % BOX_INDEX_INTERVAL == 0) {
+			box_index_add(box, record.seq, offset);
+		}
+		box->next_seq = record.seq + 1;
+		offset += sizeof(record) + record.length;
+	}
+	tfs_close(box_fd);
+	if (ret != 0 || offset != box->box_size) {
+		return -1; // file ends in a torn record
+	}
+	atomic_store(&box->durable_size, box->box_size);
+	box->durable_seq = box->next_seq;
+	box->segment_end = box->segment_len;
+	return 0;
+}
+
+// Returns the offset of the first record numbered seq or later (the end of the
+// durable records if there is none yet): a binary search of the index, then a
+// scan of at most BOX_INDEX_INTERVAL records, in the box segment or, past what
+// it holds, the box file. The index also has the records not durable yet, but
+// as seq is below durable_seq, the entry found is never one of them.
+// Called with box_lock held.
+uint64_t box_seek(struct box* box, uint64_t seq) {
+	if (seq >= box->durable_seq) {
+		return atomic_load(&box->durable_size);
+	}
+
+	uint64_t offset = 0;
+	size_t low = 0;
+	size_t high = box->index_len;
+	while (low < high) {
+		size_t mid = low + (high - low) / 2;
+		if (box->index[mid].seq <= seq) {
+			offset = box->index[mid].offset;
+			low = mid + 1;
+		} else {
+			high = mid;
+		}
+	}
+
+	int box_fd = -1;
+	while (offset < box->box_size) {
+		struct box_record record;
+		if (box_record_at(box, &box_fd, offset, &record) != 0 ||
+			record.seq >= seq) {
+			break; // an unreadable record is where the seek stops
+		}
+		offset += sizeof(record) + record.length;
+	}
+	if (box_fd >= 0) {
+		tfs_close(box_fd);
+	}
+	return offset;
+}
+
+// Opens a handle on the box file for a subscriber, at the first record
+// numbered start_seq or later (at the end of the box for START_LATEST), and
+// sets *offset to where that is, for box_read.
+// Returns the handle, or -1 on error.
+int box_open_cursor(struct box* box, uint64_t start_seq, uint64_t* offset) {
+	int box_fd = box_open_file(box);
+	if (box_fd < 0) {
+		return -1; // failed to open box file
+	}
+
+	lock_box(box);
+	*offset = box_seek(box, start_seq);
+	int ret = tfs_seek(box_fd, *offset);
+	unlock_box(box);
+	if (ret != 0) {
+		tfs_close(box_fd);
+		return -1;
+	}
+	return box_fd;
+}
+
+// Reads from a handle opened with box_open_cursor, which is at *offset, up to
+// len bytes of the durable records, and moves *offset past them. The file may
+// already hold more, appended but not yet committed, which are left unread.
+// Returns the number of bytes read, 0 if every durable record has been read,
+// or -1 on error.
+ssize_t box_read(struct box* box, int box_fd, uint64_t* offset, void* buffer,
+				 size_t len) {
+	uint64_t durable = atomic_load(&box->durable_size);
+	if (durable - *offset < len) {
+		len = (size_t) (durable - *offset);
+	}
+	if (len == 0) {
+		return 0;
+	}
+	ssize_t n = tfs_read(box_fd, buffer, len);
+	if (n > 0) {
+		*offset += (uint64_t) n;
+	}
+	return n;
+}
+
+// Registers a thread-mode subscriber's wait slot on the box.
+// Returns 0 if successful, -1 otherwise.
+int box_waiter_add(struct box* box, struct box_waiter* waiter) {
+	waiter->wake_fd = eventfd(0, 0);
+	if (waiter->wake_fd < 0) {
+		return -1;
+	}
+	waiter->armed = false;
+
+	lock_box(box);
+	waiter->next = box->waiters;
+	box->waiters = waiter;
+	unlock_box(box);
+	return 0;
+}
+
+void box_waiter_remove(struct box* box, struct box_waiter* waiter) {
+	lock_box(box);
+	struct box_waiter** link = &box->waiters;
+	while (*link != waiter) {
+		link = &(*link)->next;
+	}
+	*link = waiter->next;
+	unlock_box(box);
+
+	close(waiter->wake_fd);
+}
+
+// Blocks until the next publish on the box, like pthread_cond_wait: called
+// with box_lock held, which is released while waiting and taken again before
+// returning.
+void box_wait(struct box* box, struct box_waiter* waiter) {
+	waiter->armed = true;
+	unlock_box(box);
+
+	uint64_t count;
+	while (read(waiter->wake_fd, &count, sizeof(count)) < 0 &&
+		   errno == EINTR) {
+		// interrupted by a signal, keep waiting
+	}
+
+	lock_box(box);
+}
+
+// Registers a subscriber's cursor, starting at start_seq or, if that is
+// further, at the next record to be published. Every subscriber has a cursor,
+// so this is also where it is counted.
+void box_cursor_add(struct box* box, struct box_cursor* cursor,
+					uint64_t start_seq) {
+	lock_box(box);
+	atomic_init(&cursor->next_seq,
+				start_seq < box->durable_seq ? start_seq : box->durable_seq);
+	cursor->next = box->cursors;
+	box->cursors = cursor;
+	box->n_subscribers += 1;
+	unlock_box(box);
+}
+
+void box_cursor_remove(struct box* box, struct box_cursor* cursor) {
+	lock_box(box);
+	struct box_cursor** link = &box->cursors;
+	while (*link != cursor) {
+		link = &(*link)->next;
+	}
+	*link = cursor->next;
+	box->n_subscribers -= 1;
+	unlock_box(box);
+}
+
+// Moves a cursor past the records its subscriber has been sent (or skipped)
+void box_cursor_advance(struct box_cursor* cursor, uint64_t next_seq) {
+	atomic_store_explicit(&cursor->next_seq, next_seq, memory_order_relaxed);
+}
+
+// Adds published bytes to the current second's slot. Called with box_lock
+// held, so the slot has a single writer.
+static void box_rate_add(struct box* box, uint64_t bytes) {
+	uint64_t second = stats_now() / 1000000000u;
+	struct box_rate_slot* slot = &box->rate[second % BOX_RATE_SLOTS];
+	if (atomic_load_explicit(&slot->second, memory_order_relaxed) != second) {
+		// readers that see the old second with the new count are only off
+		// for a slot already out of every window
+		atomic_store_explicit(&slot->bytes, 0, memory_order_relaxed);
+		atomic_store_explicit(&slot->second, second, memory_order_release);
+	}
+	atomic_store_explicit(
+		&slot->bytes,
+		atomic_load_explicit(&slot->bytes, memory_order_relaxed) + bytes,
+		memory_order_relaxed);
+}
+
+// Average bytes per second published over the last `seconds` whole seconds
+static uint64_t box_rate(struct box* box, uint64_t now, uint64_t seconds) {
+	uint64_t bytes = 0;
+	for (size_t i = 0; i < BOX_RATE_SLOTS; i++) {
+		struct box_rate_slot* slot = &box->rate[i];
+		uint64_t second =
+			atomic_load_explicit(&slot->second, memory_order_acquire);
+		uint64_t count = atomic_load_explicit(&slot->bytes,
+											  memory_order_relaxed);
+		if (second < now && second + seconds >= now &&
+			atomic_load_explicit(&slot->second, memory_order_acquire) ==
+				second) {
+			bytes += count;
+		}
+	}
+	return bytes / seconds;
+}
+
+// Snapshot of the box's throughput and backlog. Only the subscribers' lag
+// needs box_lock, which is held just long enough to walk their cursors.
+void box_get_stats(struct box* box, struct box_list_stats* stats) {
+	uint64_t now = stats_now() / 1000000000u;
+	stats->messages =
+		atomic_load_explicit(&box->messages_in, memory_order_relaxed);
+	stats->bytes_per_sec_10s = box_rate(box, now, 10);
+	stats->bytes_per_sec_60s = box_rate(box, now, 60);
+
+	stats->max_lag = 0;
+	lock_box(box);
+	for (struct box_cursor* c = box->cursors; c != NULL; c = c->next) {
+		uint64_t next_seq =
+			atomic_load_explicit(&c->next_seq, memory_order_relaxed);
+		if (next_seq < box->durable_seq &&
+			box->durable_seq - next_seq > stats->max_lag) {
+			stats->max_lag = box->durable_seq - next_seq;
+		}
+	}
+	unlock_box(box);
+}
+
+// Copies the lag of the box's max furthest behind subscribers into lags,
+// furthest behind first.
+// Returns how many were copied.
+size_t box_get_lags(struct box* box, uint64_t* lags, size_t max) {
+	size_t count = 0;
+	lock_box(box);
+	for (struct box_cursor* c = box->cursors; c != NULL; c = c->next) {
+		uint64_t next_seq =
+			atomic_load_explicit(&c->next_seq, memory_order_relaxed);
+		uint64_t lag =
+			next_seq < box->durable_seq ? box->durable_seq - next_seq : 0;
+		if (count == max && (max == 0 || lag <= lags[max - 1])) {
+			continue;
+		}
+
+		size_t i = count < max ? count++ : max - 1;
+		for (; i > 0 && lags[i - 1] < lag; i--) {
+			lags[i] = lags[i - 1];
+		}
+		lags[i] = lag;
+	}
+	unlock_box(box);
+	return count;
+}
+
+// Numbers the records and appends them to the box file, through the
+// publisher's append handle, and to the box segment while it can grow.
+// Subscribers only see them once box_commit has made them durable, with
+// *lsn, which is 0 if there is no journal to wait for. Only the box's
+// publisher appends, so appends and commits never overlap.
+// Returns the number of bytes written, or -1 on error.
+ssize_t box_append(struct box* box, char* records, size_t len,
+				   uint64_t* lsn) {
+	lock_box(box);
+	if (box_removed(box)) {
+		unlock_box(box);
+		return -1; // box was removed
+	}
+
+	uint64_t seq = box->next_seq;
+	for (size_t pos = 0; pos < len;) {
+		struct box_record record;
+		memcpy(&record, records + pos, sizeof(record));
+		record.seq = seq++;
+		memcpy(records + pos, &record, sizeof(record));
+		pos += sizeof(record) + record.length;
+	}
+
+	ssize_t bytes_written = tfs_write_nowait(box->box_fd, records, len, lsn);
+	if (bytes_written != (ssize_t) len) {
+		unlock_box(box);
+		return -1; // failed to write OR write exceeded box max size
+	}
+
+	box_segment_append(box, records, len);
+	for (size_t pos = 0; pos < len;) {
+		struct box_record record;
+		memcpy(&record, records + pos, sizeof(record));
+		if (record.seq % BOX_INDEX_INTERVAL == 0) {
+			box_index_add(box, record.seq, box->box_size + pos);
+		}
+		pos += sizeof(record) + record.length;
+	}
+	box->box_size += len;
+	box->next_seq = seq;
+	unlock_box(box);
+	return bytes_written;
+}
+
+// Commits the records appended to the box up to lsn, which box_append gave
+// for the latest of them, without holding box_lock, so that subscribers and
+// list requests are not held up by the sync. Then makes every appended record
+// visible to subscribers, and wakes them up. Records whose commit failed are
+// never made visible.
+// Returns 0 if successful, -1 otherwise.
+int box_commit(struct box* box, uint64_t lsn) {
+	if (lsn != 0 && tfs_commit(lsn) != 0) {
+		return -1;
+	}
+
+	lock_box(box);
+	uint64_t size = atomic_load(&box->durable_size);
+	uint64_t published = box->next_seq - box->durable_seq;
+	if (published == 0) {
+		unlock_box(box);
+		return 0;
+	}
+	uint64_t bytes =
+		box->box_size - size - published * sizeof(struct box_record);
+	box->durable_seq = box->next_seq;
+	atomic_store(&box->durable_size, box->box_size);
+	// Mapped subscribers only learn of the new records through the update
+	// sent after this, so the copy in the segment needs no further
+	// synchronization
+	box->segment_end = box->segment_len;
+	atomic_fetch_add_explicit(&box->messages_in, published,
+							  memory_order_relaxed);
+	box_rate_add(box, bytes);
+	stats_count(STATS_MESSAGES_IN, published);
+	stats_count(STATS_BYTES_IN, bytes);
+	box_wake(box);
+	unlock_box(box);
+	return 0;
+}
+
+// Appends records to the box and commits them.
+// Returns the number of bytes written, or -1 on error.
+ssize_t box_publish(struct box* box, char* records, size_t len) {
+	uint64_t lsn;
+	ssize_t bytes_written = box_append(box, records, len, &lsn);
+	if (bytes_written < 0 || box_commit(box, lsn) != 0) {
+		return -1;
+	}
+	return bytes_written;
+}
+
+// Appends the records decoded by box_publish_frames, raising *lsn to the
+// append's
+static int box_append_records(struct box* box, char* records, size_t len,
+							  uint64_t* lsn) {
+	uint64_t append_lsn;
+	if (len == 0) {
+		return 0;
+	}
+	if (box_append(box, records, len, &append_lsn) < 0) {
+		return -1;
+	}
+	if (append_lsn > *lsn) {
+		*lsn = append_lsn;
+	}
+	return 0;
+}
+
+// Appends every complete frame at the start of frames (as read from a
+// publisher fifo), with one box_append per BOX_PUBLISH_CHUNK bytes of records,
+// and moves what is left of an incomplete frame to the start of the buffer.
+// The caller commits them with box_commit, after raising *lsn to the appends'.
+// Returns 0 if successful, -1 on an invalid frame or a failed write.
+int box_publish_frames(struct box* box, char* frames, size_t* len,
+					   uint64_t* lsn) {
+	char records[BOX_PUBLISH_CHUNK];
+	size_t records_len = 0;
+	size_t pos = 0;
+	int ret = 0;
+	while (pos < *len) {
+		if (sizeof(records) - records_len < 4 * PUBLISHER_FRAME_MAX) {
+			if (box_append_records(box, records, records_len, lsn) != 0) {
+				ret = -1;
+				break;
+			}
+			records_len = 0;
+		}
+
+		// Frames never span more than PUBLISHER_FRAME_MAX bytes, so that the
+		// records fit in what is left of the buffer
+		size_t rest = *len - pos;
+		size_t limit = rest < PUBLISHER_FRAME_MAX ? rest : PUBLISHER_FRAME_MAX;
+		ssize_t n = publisher_frame_decode(frames + pos, limit, records,
+										   &records_len);
+		if (n < 0 || (n == 0 && limit == PUBLISHER_FRAME_MAX)) {
+			ret = -1; // invalid, or too large
+			break;
+		} else if (n == 0) {
+			break; // rest of the frame not read yet
+		}
+		pos += (size_t) n;
+	}
+	if (ret == 0 && box_append_records(box, records, records_len, lsn) != 0) {
+		ret = -1;
+	}
+
+	memmove(frames, frames + pos, *len - pos);
+	*len -= pos;
+	return ret;
+}
+
+// FNV-1a
+static size_t hash_box_name(const char* box_name) {
+	uint64_t hash = 14695981039346656037ULL;
+	for (; *box_name != '\0'; box_name++) {
+		hash ^= (uint8_t) *box_name;
+		hash *= 1099511628211ULL;
+	}
+	return (size_t) hash;
+}
+
+static pthread_mutex_t* bucket_lock(struct box_table* table, size_t bucket) {
+	return &table->stripes[bucket % BOX_TABLE_STRIPES];
+}
+
+// Locks a bucket's stripe, recording how long it had to wait for it
+static void lock_bucket(struct box_table* table, size_t bucket) {
+	pthread_mutex_t* lock = bucket_lock(table, bucket);
+	if (pthread_mutex_trylock(lock) == 0) {
+		stats_record(STATS_TABLE_LOCK_WAIT_NS, 0);
+		return;
+	}
+	uint64_t start = stats_now();
+	pthread_mutex_lock(lock);
+	stats_record(STATS_TABLE_LOCK_WAIT_NS, stats_now() - start);
+}
+
+int box_table_init(struct box_table* table, size_t max_boxes) {
+	size_t bucket_count = BOX_TABLE_STRIPES;
+	while (bucket_count < max_boxes) {
+		bucket_count <<= 1;
+	}
+
+	table->buckets = calloc(bucket_count, sizeof(struct box*));
+	if (table->buckets == NULL) {
+		return -1;
+	}
+	table->bucket_count = bucket_count;
+	for (size_t i = 0; i < BOX_TABLE_STRIPES; i++) {
+		pthread_mutex_init(&table->stripes[i], NULL);
+	}
+	atomic_init(&table->box_count, 0);
+	table->max_boxes = max_boxes;
+	return 0;
+}
+
+void box_table_destroy(struct box_table* table) {
+	for (size_t i = 0; i < table->bucket_count; i++) {
+		struct box* node = table->buckets[i];
+		while (node != NULL) {
+			struct box* next = node->next;
+			box_put(node);
+			node = next;
+		}
+	}
+	for (size_t i = 0; i < BOX_TABLE_STRIPES; i++) {
+		pthread_mutex_destroy(&table->stripes[i]);
+	}
+	free(table->buckets);
+	table->buckets = NULL;
+}
+
+// Finds a box that is ready, in the bucket locked by the caller
+static struct box* find_ready(struct box_table* table, size_t bucket,
+							  const char* box_name) {
+	struct box* node = table->buckets[bucket];
+	while (node != NULL && (strcmp(box_name, node->box_name) ||
+							atomic_load(&node->state) != BOX_READY)) {
+		node = node->next;
+	}
+	return node;
+}
+
+// Returns the box with that name, with a reference taken for the caller, who
+// drops it with box_put; or NULL if there is no such box (ready for use)
+struct box* box_table_lookup(struct box_table* table, const char* box_name) {
+	size_t bucket = hash_box_name(box_name) & (table->bucket_count - 1);
+
+	lock_bucket(table, bucket);
+	struct box* node = find_ready(table, bucket, box_name);
 	if (node != NULL) {
-		pthread_mutex_destroy(&node->box_lock);
-		pthread_cond_destroy(&node->box_condvar);
-		destroy_box_list(node->next);
-		free(node);
+		atomic_fetch_add(&node->refs, 1);
 	}
+	pthread_mutex_unlock(bucket_lock(table, bucket));
+
+	return node;
 }
 
-struct box* lookup_box_in_list(struct box* head_box, const char* box_name) {
-	if (head_box == NULL) {
-		return NULL;
+// Inserts a box that is being created, which takes its name: the check and
+// the insertion are atomic, so of two boxes with the same name only one gets
+// in. The table takes over the box's reference.
+// Returns 0 if the box was inserted, -1 if the table is full (errno ENOSPC)
+// or a box with the same name already exists (errno EEXIST).
+int box_table_insert(struct box_table* table, struct box* box) {
+	if (atomic_fetch_add(&table->box_count, 1) >= table->max_boxes) {
+		atomic_fetch_sub(&table->box_count, 1);
+		errno = ENOSPC;
+		return -1;
+	}
+
+	size_t bucket = hash_box_name(box->box_name) & (table->bucket_count - 1);
+
+	lock_bucket(table, bucket);
+	for (struct box* node = table->buckets[bucket]; node != NULL;
+		 node = node->next) {
+		if (!strcmp(box->box_name, node->box_name)) {
+			pthread_mutex_unlock(bucket_lock(table, bucket));
+			atomic_fetch_sub(&table->box_count, 1);
+			errno = EEXIST;
+			return -1;
+		}
+	}
+	box->next = table->buckets[bucket];
+	table->buckets[bucket] = box;
+	pthread_mutex_unlock(bucket_lock(table, bucket));
+
+	return 0;
+}
+
+// Makes an inserted box visible to lookups, once it is fully set up
+void box_table_ready(struct box* box) {
+	atomic_store(&box->state, BOX_READY);
+}
+
+// Marks the box with that name removed, so lookups no longer find it, while
+// it keeps its name in the table until box_table_remove. Marking it under
+// box_lock makes every subscriber waiting on it see it is gone.
+// Returns the box, with a reference taken for the caller; or NULL if there is
+// no such box, or it is already being removed.
+struct box* box_table_take(struct box_table* table, const char* box_name) {
+	size_t bucket = hash_box_name(box_name) & (table->bucket_count - 1);
+
+	lock_bucket(table, bucket);
+	struct box* node = find_ready(table, bucket, box_name);
+	if (node != NULL) {
+		atomic_fetch_add(&node->refs, 1);
+		lock_box(node);
+		atomic_store(&node->state, BOX_REMOVED);
+		unlock_box(node);
 	}
-	if (!strcmp(box_name, head_box->box_name)) {
-		return head_box;
-	} else {
-		return lookup_box_in_list(head_box->next, box_name);
+	pthread_mutex_unlock(bucket_lock(table, bucket));
+
+	return node;
+}
+
+// Unlinks the box from the table, freeing its name, and drops the table's
+// reference
+void box_table_remove(struct box_table* table, struct box* box) {
+	size_t bucket = hash_box_name(box->box_name) & (table->bucket_count - 1);
+
+	lock_bucket(table, bucket);
+	struct box** link = &table->buckets[bucket];
+	while (*link != box) {
+		link = &(*link)->next;
 	}
+	*link = box->next;
+	atomic_fetch_sub(&table->box_count, 1);
+	pthread_mutex_unlock(bucket_lock(table, bucket));
 
+	box_put(box);
+}
+
+// Calls fn on every box that is ready, one bucket at a time: only the stripe
+// of the bucket being visited is locked, so creates and removes elsewhere
+// carry on
+void box_table_foreach(struct box_table* table,
+					   void (*fn)(struct box* box, void* arg), void* arg) {
+	for (size_t i = 0; i < table->bucket_count; i++) {
+		lock_bucket(table, i);
+		for (struct box* node = table->buckets[i]; node != NULL;
+			 node = node->next) {
+			if (atomic_load(&node->state) == BOX_READY) {
+				fn(node, arg);
+			}
+		}
+		pthread_mutex_unlock(bucket_lock(table, i));
+	}
 }
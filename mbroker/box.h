@@ -1,21 +1,167 @@
 #ifndef __BOX_H__
 #define __BOX_H__
 
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <pthread.h>
+#include <sys/types.h>
+#include "protocol.h"
+
+struct session;
+
+#define BOX_TABLE_STRIPES 64
+
+// Address space reserved for the shared-memory segment mirroring each box,
+// which is all that mapped subscribers map of it. The segment itself starts
+// empty and grows BOX_SEGMENT_CHUNK bytes at a time as messages are published;
+// once it cannot grow any further the box is only kept in its file.
+#define BOX_SEGMENT_MAX ((size_t) 1 << 30)
+#define BOX_SEGMENT_CHUNK ((size_t) 1 << 20)
+
+// The offset index has an entry for every BOX_INDEX_INTERVAL-th record
+#define BOX_INDEX_INTERVAL 64
+
+// Largest record in a box
+#define BOX_RECORD_MAX (sizeof(struct box_record) + MESSAGE_MAX_LENGTH)
+
+// How much of a box a subscriber reads at once; always holds a whole record
+#define BOX_READ_SIZE (4 * BOX_RECORD_MAX)
+
+// How much a publisher session reads from its fifo at once
+#define PUBLISHER_READ_SIZE (4 * BATCH_MAX_SIZE)
+
+// Largest publisher frame: a batch (a version 1 message is smaller)
+#define PUBLISHER_FRAME_MAX BATCH_MAX_SIZE
+
+// How many bytes of records box_publish_frames decodes before appending them;
+// a frame decodes to at most four times its size
+#define BOX_PUBLISH_CHUNK (8 * PUBLISHER_FRAME_MAX)
+
+// Wait slot of a thread-mode subscriber. Publishing only wakes the slots that
+// are armed, i.e. whose subscriber has caught up and is blocked, and disarms
+// them, so a subscriber is woken once however many publishes happen before it
+// runs again.
+struct box_waiter {
+	int wake_fd; // eventfd
+	bool armed;
+	struct box_waiter* next;
+};
+
+// Where a subscriber is in its box, to tell how far behind it is. Only the
+// subscriber moves it; list requests read it under box_lock.
+struct box_cursor {
+	_Atomic uint64_t next_seq; // first record not yet sent to the subscriber
+	struct box_cursor* next;
+};
+
+// Bytes published during one second, kept for the last BOX_RATE_SLOTS
+// seconds. Slots are only written by box_publish, with box_lock held, and
+// read without it.
+#define BOX_RATE_SLOTS 64
+
+struct box_rate_slot {
+	_Atomic uint64_t second;
+	_Atomic uint64_t bytes;
+};
+
+struct box_index_entry {
+	uint64_t seq;
+	uint64_t offset;
+};
+
+// Where a box is in its life: a box being created holds its name in the
+// table, so that no other box can take it, but is not found by lookups until
+// it is ready; a removed box stays alive until its last reference is dropped.
+enum box_state { BOX_CREATING, BOX_READY, BOX_REMOVED };
 
 struct box {
 	char box_name[32];
-	uint64_t n_publishers;
-	uint64_t n_subscribers;
-	uint64_t box_size; //maybe remove this?
+	_Atomic enum box_state state;
+	// The table's reference, plus one per request or session using the box
+	_Atomic size_t refs;
+	_Atomic uint64_t n_publishers;
+	_Atomic uint64_t n_subscribers;
+	uint64_t box_size; // bytes appended to the box file
+	// How much of the box is durable, which is all that subscribers, seeks
+	// and list requests see of it. Only box_commit moves it, with box_lock
+	// held; subscribers read the size without it.
+	_Atomic uint64_t durable_size;
+	uint64_t durable_seq; // sequence number of the first record not durable
+	_Atomic uint64_t messages_in; // published
+	_Atomic uint64_t messages_out; // delivered, to all subscribers
+	struct box_rate_slot rate[BOX_RATE_SLOTS];
+	int box_fd; // append handle, open while the box has a publisher
+	char segment_name[64]; // shared-memory mirror of the box file
+	char* segment; // BOX_SEGMENT_MAX bytes mapped
+	int segment_fd; // kept open to grow the segment
+	uint64_t segment_size; // bytes allocated to the segment
+	uint64_t segment_len; // how much of the box file the segment holds
+	uint64_t segment_end; // how much of it mapped subscribers can read
+	bool segment_full; // could not grow, so no longer follows the box
+	uint64_t next_seq; // sequence number of the next record appended
+	struct box_index_entry* index; // sorted by seq
+	size_t index_len;
+	size_t index_capacity;
 	pthread_mutex_t box_lock;
-	pthread_cond_t box_condvar;
-	struct box* next;
+	struct box_waiter* waiters; // thread-mode subscribers
+	struct session* subscribers; // event-loop subscriber sessions
+	struct box_cursor* cursors; // every subscriber's
+	struct box* next; // next box in the same hash bucket
 };
 
+// Hash table of boxes, keyed by box_name. Buckets are protected by striped
+// locks: bucket i uses stripe (i % BOX_TABLE_STRIPES).
+struct box_table {
+	struct box** buckets;
+	size_t bucket_count; // power of two
+	pthread_mutex_t stripes[BOX_TABLE_STRIPES];
+	_Atomic size_t box_count;
+	size_t max_boxes;
+};
+
+void lock_box(struct box* box);
+void unlock_box(struct box* box);
+void box_delivered(struct box* box, uint64_t messages);
+struct box* box_new(const char* box_name);
 void init_box(struct box* box, const char* box_name);
-void destroy_box_list(struct box* node);
-struct box* lookup_box_in_list(struct box* head_box, const char* box_name);
+void box_put(struct box* box);
+bool box_removed(struct box* box);
+void box_remove(struct box* box);
+int box_map_segment(struct box* box);
+bool box_mapped_done(struct box* box, uint64_t sent_end);
+int box_restore(struct box* box);
+int box_open_publisher(struct box* box);
+void box_close_publisher(struct box* box);
+ssize_t box_append(struct box* box, char* records, size_t len,
+				   uint64_t* lsn);
+int box_commit(struct box* box, uint64_t lsn);
+ssize_t box_publish(struct box* box, char* records, size_t len);
+uint64_t box_seek(struct box* box, uint64_t seq);
+int box_open_cursor(struct box* box, uint64_t start_seq, uint64_t* offset);
+ssize_t box_read(struct box* box, int box_fd, uint64_t* offset, void* buffer,
+				 size_t len);
+int box_waiter_add(struct box* box, struct box_waiter* waiter);
+void box_waiter_remove(struct box* box, struct box_waiter* waiter);
+void box_wait(struct box* box, struct box_waiter* waiter);
+void box_cursor_add(struct box* box, struct box_cursor* cursor,
+					uint64_t start_seq);
+void box_cursor_remove(struct box* box, struct box_cursor* cursor);
+void box_cursor_advance(struct box_cursor* cursor, uint64_t next_seq);
+void box_get_stats(struct box* box, struct box_list_stats* stats);
+size_t box_get_lags(struct box* box, uint64_t* lags, size_t max);
+int box_publish_frames(struct box* box, char* frames, size_t* len,
+					   uint64_t* lsn);
+
+int box_table_init(struct box_table* table, size_t max_boxes);
+void box_table_destroy(struct box_table* table);
+struct box* box_table_lookup(struct box_table* table, const char* box_name);
+int box_table_insert(struct box_table* table, struct box* box);
+void box_table_ready(struct box* box);
+struct box* box_table_take(struct box_table* table, const char* box_name);
+void box_table_remove(struct box_table* table, struct box* box);
+void box_table_foreach(struct box_table* table,
+					   void (*fn)(struct box* box, void* arg), void* arg);
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,76 @@
+#include "delivery.h"
+#include <string.h>
+
+// Version 1 messages are fixed-size: the message is padded with zeros
+static char const padding[sizeof(((struct message*) 0)->message)];
+
+// delivery_init: starts an empty delivery of at most max_frames messages
+// (DELIVERY_MAX_FRAMES if 0 or more than that)
+void delivery_init(struct delivery* d, uint8_t version, size_t max_frames) {
+	d->version = version;
+	d->max_frames = max_frames == 0 || max_frames > DELIVERY_MAX_FRAMES ?
+		DELIVERY_MAX_FRAMES : max_frames;
+	d->frames = 0;
+	d->bytes = 0;
+	d->next_seq = 0;
+	d->iov_count = 0;
+}
+
+// delivery_add: gathers a message, numbered seq, for the next delivery_send.
+// Returns false if the delivery is full, in which case it must be sent first.
+bool delivery_add(struct delivery* d, char const* message, uint16_t length,
+				  uint64_t seq) {
+	if (d->frames == d->max_frames) {
+		return false;
+	}
+
+	char* header = d->headers[d->frames];
+	size_t header_len;
+	size_t frame_len;
+	if (d->version == PROTOCOL_VERSION) {
+		ssize_t n = message_header_encode(header, MESSAGE_HEADER_MAX_SIZE,
+										  SUBSCRIBER_MESSAGE_CODE, length);
+		if (n < 0) {
+			return false;
+		}
+		header_len = (size_t) n;
+		frame_len = header_len + length;
+	} else {
+		header[0] = SUBSCRIBER_MESSAGE_CODE;
+		header_len = 1;
+		frame_len = sizeof(struct message);
+	}
+	if (d->bytes + frame_len > PIPE_BUF) {
+		return false;
+	}
+
+	d->iov[d->iov_count++] = (struct iovec) {header, header_len};
+	d->iov[d->iov_count++] = (struct iovec) {(void*) message, length};
+	if (d->version != PROTOCOL_VERSION) {
+		d->iov[d->iov_count++] = (struct iovec) {
+			(void*) padding, frame_len - header_len - length};
+	}
+	d->frames++;
+	d->bytes += frame_len;
+	d->next_seq = seq + 1;
+	return true;
+}
+
+// delivery_send: writes the gathered messages to fd, all at once, and empties
+// the delivery.
+// Returns the number of messages sent, or -1 on error (errno is EAGAIN if the
+// fifo is non-blocking and full), in which case the delivery is kept.
+ssize_t delivery_send(struct delivery* d, int fd) {
+	if (d->frames == 0) {
+		return 0;
+	}
+	if (writev(fd, d->iov, (int) d->iov_count) < 0) {
+		return -1;
+	}
+
+	ssize_t frames = (ssize_t) d->frames;
+	d->frames = 0;
+	d->bytes = 0;
+	d->iov_count = 0;
+	return frames;
+}
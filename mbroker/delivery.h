@@ -0,0 +1,34 @@
+#ifndef __DELIVERY_H__
+#define __DELIVERY_H__
+
+#include "protocol.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+// Most messages sent to a subscriber with a single writev
+#define DELIVERY_MAX_FRAMES 64
+
+// Messages for a subscriber, gathered to be sent with a single writev: the
+// message bytes are not copied, so they must stay put until it is sent. A
+// delivery never holds more than PIPE_BUF bytes, so the write is atomic: a
+// non-blocking fifo takes all of it or, if full, none of it.
+struct delivery {
+	uint8_t version; // of the subscriber's protocol
+	size_t max_frames;
+	size_t frames;
+	size_t bytes;
+	uint64_t next_seq; // sequence number after the last message gathered
+	char headers[DELIVERY_MAX_FRAMES][MESSAGE_HEADER_MAX_SIZE];
+	struct iovec iov[3 * DELIVERY_MAX_FRAMES];
+	size_t iov_count;
+};
+
+void delivery_init(struct delivery* d, uint8_t version, size_t max_frames);
+bool delivery_add(struct delivery* d, char const* message, uint16_t length,
+				  uint64_t seq);
+ssize_t delivery_send(struct delivery* d, int fd);
+
+#endif
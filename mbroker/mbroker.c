@@ -2,6 +2,7 @@
 #include "protocol.h"
 #include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
@@ -13,31 +14,113 @@
 #include "operations.h"
 #include <signal.h>
 #include "box.h"
+#include "session.h"
+#include "pool.h"
+#include "delivery.h"
+#include "stats.h"
+#include "slab.h"
+#include <time.h>
 
 #define BUFFER_SIZE 128
-#define MESSAGE_SIZE 1024
-#define MAX_BOX_AMOUNT 128
+#define DEFAULT_MAX_BOXES 128
+// How much of the server fifo is read at once: all of it, at its default size
+#define REQUEST_READ_SIZE (16 * PIPE_BUF)
 
 #define CREATE_BOX_ANSWER_CODE 4
 #define REMOVE_BOX_ANSWER_CODE 6
 #define LIST_BOX_ANSWER_CODE 8
-#define SUBSCRIBER_MESSAGE_CODE 10
 
-// Global box head struct: used as the start of a global box linked list.
-struct box* head;
+// A request taken off the server fifo, in either protocol version
+struct request {
+	uint8_t version; // PROTOCOL_VERSION, or 1 for the fixed-size structs
+	uint8_t code;
+	char client_named_pipe_path[256];
+	char box_name[32];
+	uint64_t start_seq;
+};
+
+// Global box table: every box, indexed by name.
+static struct box_table boxes;
+
+// Requests taken off the server fifo. Each one is queued for a worker, which
+// frees it once served.
+static slab_t request_slab;
 
 // Global flag variable: used to exit out of the main thread loop when a signal is received.
 int flag = 0;
 
-// Global counting variable: used to assign unique IDs to box objects
-static int box_count = 0;
+// Number of event loop threads; 0 means every session keeps a worker thread.
+static size_t event_loop_threads = 0;
+
+// File system image the boxes are kept in (NULL keeps them in memory only),
+// and how often it is synced to disk.
+static const char *image_path = NULL;
+static unsigned int sync_interval_ms = 1000;
+
+// Journal that makes every box change durable before it is acknowledged.
+// It only holds metadata, so it needs an image to keep messages in.
+static const char *journal_path = NULL;
+
+// Storage latency emulated by the file system: none unless asked for
+static tfs_latency_model_t latency_model = TFS_LATENCY_NONE;
+static unsigned long latency_ns = 0;
 
-static pthread_mutex_t box_list_lock;
+// Workers serving publisher and subscriber sessions: the pool starts with
+// max_sessions workers and grows up to max_workers (by default,
+// WORKERS_GROWTH times as many) while sessions keep them all busy
+#define WORKERS_GROWTH 4
+static struct worker_pool session_workers;
+static size_t max_workers = 0;
+
+// Workers serving create, remove, list and stats requests. They only hold a
+// worker while answering, and give up on a client that does not open its fifo
+// within CLIENT_OPEN_TIMEOUT_MS, so a few of them keep up with managers
+// however busy the session workers are: each pool has its own queue.
+#define DEFAULT_CONTROL_WORKERS 2
+static struct worker_pool control_workers;
+static size_t control_worker_count = DEFAULT_CONTROL_WORKERS;
+
+// Requests dropped because their pool was full, waiting for the rejecter
+// thread to turn their clients away
+#define REJECTED_REQUESTS_MAX 1024
+static pc_queue_t rejected_requests;
+
+// How often the broker's stats are printed (0: never)
+static unsigned long stats_interval_ms = 0;
+
+// How long a worker waits for a client to open its fifo
+#define CLIENT_OPEN_TIMEOUT_MS 1000
 
 static void sighandler() {
 	exit(EXIT_SUCCESS);
 }
 
+// Opens a client's fifo without blocking on a client that never opens its own
+// end. For writing, the open is retried until the client has the fifo open
+// for reading, for up to CLIENT_OPEN_TIMEOUT_MS, and the handle is then made
+// blocking. For reading, it opens at once and is left non-blocking: until the
+// client opens its end, reads return end of file, so the caller polls first.
+// Returns the handle, or -1 on error.
+static int open_client(const char *client_named_pipe_path, int flags) {
+	int fd;
+	for (int waited_ms = 0;
+		 (fd = open(client_named_pipe_path, flags | O_NONBLOCK)) == -1;
+		 waited_ms++) {
+		if (errno != ENXIO || waited_ms == CLIENT_OPEN_TIMEOUT_MS) {
+			return -1; // no such fifo, or the client never opened it
+		}
+		struct timespec one_ms = {0, 1000000L};
+		nanosleep(&one_ms, NULL);
+	}
+
+	if (flags == O_WRONLY &&
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK) == -1) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
 int send_message(int pipenum, char const *box_message) {
 	struct message msg = message_init(SUBSCRIBER_MESSAGE_CODE, box_message);
 	ssize_t n = write(pipenum, &msg, sizeof(struct message));
@@ -47,13 +130,24 @@ int send_message(int pipenum, char const *box_message) {
 	return 0;
 }
 
-int send_answer(const char *client_named_pipe_path, struct box_answer answer) {
-	int pipenum = open(client_named_pipe_path, O_WRONLY);
+int send_answer(const char *client_named_pipe_path, uint8_t version,
+				struct box_answer answer) {
+	int pipenum = open_client(client_named_pipe_path, O_WRONLY);
 	if (pipenum == -1) {
 		return -1; // failed to open pipe
 	}
 
-	ssize_t n = write(pipenum, &answer, sizeof(struct box_answer));
+	ssize_t n;
+	if (version == PROTOCOL_VERSION) {
+		char frame[FRAME_MAX_SIZE];
+		n = answer_encode(frame, sizeof(frame), answer.code,
+						  answer.return_code, answer.error_message);
+		if (n > 0) {
+			n = write(pipenum, frame, (size_t) n);
+		}
+	} else {
+		n = write(pipenum, &answer, sizeof(struct box_answer));
+	}
 	if (n == -1) {
 		close(pipenum);
 		return -1;
@@ -63,299 +157,774 @@ int send_answer(const char *client_named_pipe_path, struct box_answer answer) {
 	return 0;
 }
 
+// Serves a publisher session on this worker thread. A publisher whose box is
+// removed finds out on its next publish, which fails.
 int handle_publisher(const char *client_named_pipe_path, const char *box_name) {
-	struct box* box = lookup_box_in_list(head, box_name);
+	struct box* box = box_table_lookup(&boxes, box_name);
 	if (box == NULL) {
 		return -1; //TODO: implement worker thread response to failed handling
 	}
 
-	int pub_pipenum = open(client_named_pipe_path, O_RDONLY);
+	int pub_pipenum = open_client(client_named_pipe_path, O_RDONLY);
 	if (pub_pipenum == -1) {
+		box_put(box);
 		return -1; //failed to open pipe
 	}
 
-	if (box->n_publishers >= 1) {
+	if (box_open_publisher(box) != 0) {
 		close(pub_pipenum);
+		box_put(box);
 		return -1; // box already has a publisher
 	}
 
-	box->n_publishers += 1;
+	// Reads block once the publisher has its end open, which it has by the
+	// time it sends something or leaves
+	struct pollfd opened = {pub_pipenum, POLLIN, 0};
+	while (poll(&opened, 1, -1) == -1 && errno == EINTR) {
+	}
+	fcntl(pub_pipenum, F_SETFL, fcntl(pub_pipenum, F_GETFL) & ~O_NONBLOCK);
+
+	char frames[PUBLISHER_READ_SIZE];
+	size_t frames_len = 0;
 	while (true) {
-		// Reading published message from session fifo
-		struct message msg;
-		ssize_t n = read(pub_pipenum, &msg, sizeof(struct message));
+		// Reading published messages from session fifo, as many frames as
+		// are available at once
+		ssize_t n = read(pub_pipenum, frames + frames_len,
+						 sizeof(frames) - frames_len);
 		if (n == 0) {
 			break;
 		} else if (n == -1) {
 			// ret == -1 indicates error
-			box->n_publishers -= 1;
+			box_close_publisher(box);
 			close(pub_pipenum); //FIXME: estes return -1
+			box_put(box);
 			return -1;
-		} else if (n != 0) {
-			size_t len = strlen(msg.message);
-			msg.message[len] = '\n';	
-			// Writing in box file
-			pthread_mutex_lock(&box->box_lock);
-			char name[strlen(box_name)+2];
-			sprintf(name, "/%s", box_name);
-			int box_fd = tfs_open(name, TFS_O_APPEND);
-			if (box_fd < 0) {
-				box->n_publishers -= 1;
-				close(pub_pipenum);
-				pthread_mutex_unlock(&box->box_lock);
-				return -1; // failed to open box file
-			}
-			
-			ssize_t bytes_written = tfs_write(box_fd, msg.message, len+1);
-			if (bytes_written < 0) {
-				box->n_publishers -= 1;
-				close(pub_pipenum);
-				pthread_mutex_unlock(&box->box_lock);
-				return -1; // failed to write OR write exceeded box max size
-			}
+		}
 
-			box->box_size += (uint64_t) bytes_written;
-			if (tfs_close(box_fd) != 0) {
-				box->n_publishers -= 1;
-				close(pub_pipenum);
-				pthread_mutex_unlock(&box->box_lock);
-				return -1; // failed to close box file
-			}
-			pthread_cond_broadcast(&box->box_condvar);
-			pthread_mutex_unlock(&box->box_lock);
+		// Writing in box file
+		frames_len += (size_t) n;
+		uint64_t lsn = 0;
+		if (box_publish_frames(box, frames, &frames_len, &lsn) < 0 ||
+			box_commit(box, lsn) != 0) {
+			box_close_publisher(box);
+			close(pub_pipenum);
+			box_put(box);
+			return -1;
 		}
 	}
 
-	box->n_publishers -= 1;
+	box_close_publisher(box);
 	close(pub_pipenum);
+	box_put(box);
+	return 0;
+}
+
+// Sends a subscriber the messages gathered for it, and counts them.
+// Returns 0 if successful, -1 otherwise.
+static int deliver(struct box* box, struct box_cursor* cursor,
+				   struct delivery* delivery, int sub_pipenum) {
+	ssize_t sent = delivery_send(delivery, sub_pipenum);
+	if (sent < 0) {
+		return -1;
+	} else if (sent > 0) {
+		box_delivered(box, (uint64_t) sent);
+		box_cursor_advance(cursor, delivery->next_seq);
+	}
 	return 0;
 }
 
-int handle_subscriber(const char *client_named_pipe_path, const char *box_name) {
-	struct box* box = lookup_box_in_list(head, box_name);
+// Serves a subscriber session on this worker thread, until the subscriber
+// leaves, or its box is removed and it has been sent everything in it
+int handle_subscriber(const char *client_named_pipe_path, const char *box_name,
+					  uint64_t start_seq, uint8_t version) {
+	struct box* box = box_table_lookup(&boxes, box_name);
 	if (box == NULL) {
 		return -1; //TODO: implement worker thread response to failed handling
 	}
 
-	int sub_pipenum = open(client_named_pipe_path, O_WRONLY);
+	int sub_pipenum = open_client(client_named_pipe_path, O_WRONLY);
 	if (sub_pipenum == -1) {
+		box_put(box);
 		return -1; //failed to open pipe
 	}
 
-	char name[strlen(box_name)+2];
-	sprintf(name, "/%s", box_name);
-	int box_fd = tfs_open(name, 0b000);
+	uint64_t offset;
+	int box_fd = box_open_cursor(box, start_seq, &offset);
 	if (box_fd < 0) {
 		close(sub_pipenum);
+		box_put(box);
 		return -1; // failed to open file
 	}
+	// a future start_seq is reached by skipping the records before it
+	uint64_t min_seq = start_seq == START_LATEST ? 0 : start_seq;
 
-	box->n_subscribers += 1;
-	while(true) {
-		struct message msg_buffer = message_init(SUBSCRIBER_MESSAGE_CODE, NULL);
-		memset(msg_buffer.message, 0, sizeof(msg_buffer.message));
+	struct box_waiter waiter;
+	if (box_waiter_add(box, &waiter) != 0) {
+		tfs_close(box_fd);
+		close(sub_pipenum);
+		box_put(box);
+		return -1;
+	}
+
+	// Box files span many blocks, so a read can end halfway through a record:
+	// the incomplete tail is kept at the start of the buffer for the next read
+	char records[BOX_READ_SIZE];
+	size_t pending = 0;
 
-		char message[MESSAGE_SIZE];
-		memset(message, 0, MESSAGE_SIZE);
+	// Every message in a read is sent with as few writes as PIPE_BUF allows
+	struct delivery delivery;
+	delivery_init(&delivery, version, DELIVERY_MAX_FRAMES);
 
-		pthread_mutex_unlock(&box->box_lock);
-		while (tfs_read(box_fd, message, MESSAGE_SIZE) == 0) {
-			pthread_cond_wait(&box->box_condvar, &box->box_lock);
+	struct box_cursor cursor;
+	box_cursor_add(box, &cursor, start_seq);
+	while(true) {
+		ssize_t bytes_read;
+		lock_box(box);
+		while ((bytes_read = box_read(box, box_fd, &offset, records + pending,
+									  sizeof(records) - pending)) == 0 &&
+			   !box_removed(box)) {
+			box_wait(box, &waiter);
 		}
-		pthread_mutex_unlock(&box->box_lock);
+		unlock_box(box);
 
-		if (strlen(message) == 0) {
-			break; // error on reading from box
+		if (bytes_read <= 0) {
+			break; // error on reading from box, or box removed
 		}
 
-		char *token = strtok(message, "\n");   
-		while( token != NULL ) {
-			strcpy(msg_buffer.message, token);
-			ssize_t n = write(sub_pipenum, &msg_buffer, sizeof(msg_buffer));
-			if (n == 0) {
-				// n == 0 indicates EOF
-				tfs_close(box_fd);
-				box->n_subscribers -= 1;
-				close(sub_pipenum); 
-				break;
-			} else if (n == -1) {
-				// n == -1 indicates error
-				box->n_subscribers -= 1;
-				close(sub_pipenum);
-				return -1;
+		size_t len = pending + (size_t) bytes_read;
+		size_t pos = 0;
+		struct box_record record;
+		int ret = 0;
+		while (ret == 0 && len - pos >= sizeof(record)) {
+			memcpy(&record, records + pos, sizeof(record));
+			if (len - pos < sizeof(record) + record.length) {
+				break; // rest of the record not read yet
+			}
+			pos += sizeof(record);
+			if (record.seq < min_seq) {
+				pos += record.length;
+				box_cursor_advance(&cursor, record.seq + 1);
+				continue;
+			}
+
+			if (!delivery_add(&delivery, records + pos, record.length,
+							  record.seq)) {
+				// full: send it, and start the next one with this message
+				ret = deliver(box, &cursor, &delivery, sub_pipenum);
+				delivery_add(&delivery, records + pos, record.length,
+							 record.seq);
 			}
-			token = strtok(NULL, "\n");
+			pos += record.length;
 		}
 
+		// The messages gathered point into records, so they are sent before
+		// the rest of it is moved
+		if (ret != 0 ||
+			deliver(box, &cursor, &delivery, sub_pipenum) != 0) {
+			tfs_close(box_fd);
+			box_cursor_remove(box, &cursor);
+			box_waiter_remove(box, &waiter);
+			close(sub_pipenum);
+			box_put(box);
+			return -1;
+		}
+
+		pending = len - pos;
+		memmove(records, records + pos, pending);
 	}
 
+	box_cursor_remove(box, &cursor);
+	box_waiter_remove(box, &waiter);
 	if (tfs_close(box_fd) != 0) {
-		box->n_subscribers -= 1;
 		close(sub_pipenum);
-		pthread_mutex_unlock(&box->box_lock);
+		box_put(box);
 		return -1; // failed to close box file
 	}
 
-	box->n_subscribers -= 1;
 	close(sub_pipenum);
+	box_put(box);
 	return -1;
 }
 
+// Mapped fan-out: the subscriber reads the box segment itself, and is only
+// sent how far into it the published messages go
+int handle_mapped_subscriber(const char *client_named_pipe_path,
+							 const char *box_name, uint64_t start_seq) {
+	struct box* box = box_table_lookup(&boxes, box_name);
+	if (box == NULL) {
+		return -1;
+	}
+
+	int sub_pipenum = open_client(client_named_pipe_path, O_WRONLY);
+	if (sub_pipenum == -1) {
+		box_put(box);
+		return -1; //failed to open pipe
+	}
+
+	lock_box(box);
+	uint64_t sent_end = box_seek(box, start_seq);
+	bool mapped = !box->segment_full;
+	unlock_box(box);
+	if (!mapped) {
+		close(sub_pipenum);
+		box_put(box);
+		return -1; // the box segment no longer follows the box
+	}
+
+	struct segment_info info =
+		segment_info_init(box->segment_name, BOX_SEGMENT_MAX, sent_end);
+	struct box_waiter waiter;
+	if (write(sub_pipenum, &info, sizeof(info)) == -1 ||
+		box_waiter_add(box, &waiter) != 0) {
+		close(sub_pipenum);
+		box_put(box);
+		return -1;
+	}
+
+	// the subscriber counts as sent what it has been told it can read
+	struct box_cursor cursor;
+	box_cursor_add(box, &cursor, start_seq);
+	lock_box(box);
+	while (true) {
+		while (box->segment_end == sent_end &&
+			   !box_mapped_done(box, sent_end)) {
+			box_wait(box, &waiter);
+		}
+		if (box_mapped_done(box, sent_end)) {
+			break; // the subscriber was told all the segment will hold
+		}
+		uint64_t end = box->segment_end;
+		uint64_t end_seq = box->durable_seq;
+		unlock_box(box);
+
+		struct segment_update update = segment_update_init(end);
+		ssize_t n = write(sub_pipenum, &update, sizeof(update));
+		lock_box(box);
+		if (n == -1) {
+			break; // subscriber is gone
+		}
+		sent_end = end;
+		box_cursor_advance(&cursor, end_seq);
+	}
+	unlock_box(box);
+
+	box_cursor_remove(box, &cursor);
+	box_waiter_remove(box, &waiter);
+	close(sub_pipenum);
+	box_put(box);
+	return -1;
+}
+
+// Event-loop mode: registers the publisher and hands the session over to an
+// event loop, freeing the worker thread
+int attach_publisher(const char *client_named_pipe_path, const char *box_name) {
+	struct box* box = box_table_lookup(&boxes, box_name);
+	if (box == NULL) {
+		return -1;
+	}
+
+	int pub_pipenum = open_client(client_named_pipe_path, O_RDONLY);
+	if (pub_pipenum == -1) {
+		box_put(box);
+		return -1; //failed to open pipe
+	}
+
+	if (box_open_publisher(box) != 0) {
+		close(pub_pipenum);
+		box_put(box);
+		return -1; // box already has a publisher
+	}
+
+	// the session takes over the reference to the box
+	if (session_start_publisher(box, pub_pipenum) != 0) {
+		box_close_publisher(box);
+		close(pub_pipenum);
+		box_put(box);
+		return -1;
+	}
+	return 0;
+}
+
+// Event-loop mode: opens the box for the subscriber and hands the session over
+// to an event loop, freeing the worker thread
+int attach_subscriber(const char *client_named_pipe_path, const char *box_name,
+					  uint64_t start_seq, uint8_t version) {
+	struct box* box = box_table_lookup(&boxes, box_name);
+	if (box == NULL) {
+		return -1;
+	}
+
+	int sub_pipenum = open_client(client_named_pipe_path, O_WRONLY);
+	if (sub_pipenum == -1) {
+		box_put(box);
+		return -1; //failed to open pipe
+	}
+
+	uint64_t offset;
+	int box_fd = box_open_cursor(box, start_seq, &offset);
+	if (box_fd < 0) {
+		close(sub_pipenum);
+		box_put(box);
+		return -1; // failed to open file
+	}
+
+	// the session takes over the reference to the box
+	if (session_start_subscriber(box, sub_pipenum, box_fd, offset, start_seq,
+								 version) != 0) {
+		tfs_close(box_fd);
+		close(sub_pipenum);
+		box_put(box);
+		return -1;
+	}
+	return 0;
+}
+
+// Event-loop mode: sends the subscriber the box segment's name and hands the
+// session over to an event loop
+int attach_mapped_subscriber(const char *client_named_pipe_path,
+							 const char *box_name, uint64_t start_seq) {
+	struct box* box = box_table_lookup(&boxes, box_name);
+	if (box == NULL) {
+		return -1;
+	}
+
+	int sub_pipenum = open_client(client_named_pipe_path, O_WRONLY);
+	if (sub_pipenum == -1) {
+		box_put(box);
+		return -1; //failed to open pipe
+	}
+
+	lock_box(box);
+	uint64_t start = box_seek(box, start_seq);
+	bool mapped = !box->segment_full;
+	unlock_box(box);
+	if (!mapped) {
+		close(sub_pipenum);
+		box_put(box);
+		return -1; // the box segment no longer follows the box
+	}
+
+	// the session takes over the reference to the box
+	struct segment_info info =
+		segment_info_init(box->segment_name, BOX_SEGMENT_MAX, start);
+	if (write(sub_pipenum, &info, sizeof(info)) == -1 ||
+		session_start_mapped_subscriber(box, sub_pipenum, start_seq) != 0) {
+		close(sub_pipenum);
+		box_put(box);
+		return -1;
+	}
+	return 0;
+}
+
+// Creates a box. Its name is taken in the box table before anything else, so
+// that of two creates with the same name only one goes on to make the box
+// file and segment, and the other leaves them alone.
 struct box_answer create_box(const char *box_name) {
-	char name[strlen(box_name)+2];
-	sprintf(name, "/%s", box_name); 
-	int box_fd = tfs_open(name, 0b000);
-	if (box_fd != -1) {
-		close(box_fd);
-		return box_answer_init(CREATE_BOX_ANSWER_CODE, -1, "box already exists.");
+	struct box* new_box = box_new(box_name);
+	if (new_box == NULL) {
+		return box_answer_init(CREATE_BOX_ANSWER_CODE, -1, "unable to create box.");
+	}
+	if (box_table_insert(&boxes, new_box) != 0) {
+		bool exists = errno == EEXIST;
+		box_put(new_box);
+		return box_answer_init(CREATE_BOX_ANSWER_CODE, -1, exists ?
+			"box already exists." : "unable to create box.");
 	}
 
-	box_fd = tfs_open(name, TFS_O_CREAT);
+	// The name is this box's now: a file left with it is stale
+	char name[strlen(box_name)+2];
+	sprintf(name, "/%s", box_name); 
+	int box_fd = tfs_open(name, TFS_O_CREAT | TFS_O_TRUNC);
 	if (box_fd == -1) { 
+		box_table_remove(&boxes, new_box);
 		return box_answer_init(CREATE_BOX_ANSWER_CODE, -1, "unable to create box.");
 	}
+	tfs_close(box_fd);
 
-	if (box_count >= MAX_BOX_AMOUNT) {
+	if (box_map_segment(new_box) != 0) {
+		tfs_unlink(name);
+		box_table_remove(&boxes, new_box);
 		return box_answer_init(CREATE_BOX_ANSWER_CODE, -1, "unable to create box.");
 	}
 
-	struct box* new_box = (struct box*) malloc(sizeof(struct box));
-	init_box(new_box, box_name);
+	box_table_ready(new_box);
+	return box_answer_init(CREATE_BOX_ANSWER_CODE, 0, NULL);
+}
 
-	pthread_mutex_lock(&box_list_lock);
-	
-	box_count++;
-	if (head == NULL) {
-		head = new_box;
-	} else {
-		new_box->next = head;
-		head = new_box;
+// Names of the box files found in the file system image
+struct box_names {
+	char (*names)[32];
+	size_t count;
+	size_t capacity;
+};
+
+static void collect_box_name(char const *name, void *arg) {
+	struct box_names *found = arg;
+	if (found->count < found->capacity && strlen(name) < 32) {
+		strcpy(found->names[found->count++], name);
 	}
+}
 
-	pthread_mutex_unlock(&box_list_lock);
+// Rebuilds the box table from the boxes kept in the file system image.
+// Returns 0 if successful, -1 otherwise.
+static int restore_boxes(size_t max_boxes) {
+	struct box_names found = {malloc(max_boxes * sizeof(*found.names)), 0,
+							  max_boxes};
+	if (found.names == NULL || tfs_list(collect_box_name, &found) != 0) {
+		free(found.names);
+		return -1;
+	}
 
-	return box_answer_init(CREATE_BOX_ANSWER_CODE, 0, NULL);
+	for (size_t i = 0; i < found.count; i++) {
+		struct box* box = box_new(found.names[i]);
+		if (box == NULL || box_table_insert(&boxes, box) != 0) {
+			fprintf(stderr, "mbroker: failed to restore box %s\n",
+					found.names[i]);
+			if (box != NULL) {
+				box_put(box);
+			}
+		} else if (box_map_segment(box) != 0 || box_restore(box) != 0) {
+			fprintf(stderr, "mbroker: failed to restore box %s\n",
+					found.names[i]);
+			box_table_remove(&boxes, box);
+		} else {
+			box_table_ready(box);
+		}
+	}
+	free(found.names);
+	return 0;
 }
 
+// Removes a box. Its sessions are detached, but the box is only freed once
+// the last of them lets go of it; until its file is unlinked, it keeps its
+// name in the box table, so a new box with that name cannot get the old file.
 struct box_answer remove_box(const char *box_name) {
+	struct box* box = box_table_take(&boxes, box_name);
+	if (box == NULL) {
+		return box_answer_init(REMOVE_BOX_ANSWER_CODE, -1, "unable to remove box.");
+	}
+	box_remove(box);
 
+	// Open handles keep the file's data until they are closed
 	char name[strlen(box_name)+2];
 	sprintf(name, "/%s", box_name); 
-	if (tfs_unlink(name) < 0 || head == NULL) {
+	int ret = tfs_unlink(name);
+	box_table_remove(&boxes, box);
+	box_put(box);
+	if (ret < 0) {
 		return box_answer_init(REMOVE_BOX_ANSWER_CODE, -1, "unable to remove box.");
 	}
 
-	pthread_mutex_lock(&box_list_lock);
-	struct box* prev = NULL;
-	struct box* curr = head;
-	while (curr != NULL) {
-		if (!strcmp(curr->box_name, box_name)) {
-			if (prev == NULL) {
-				head = curr->next;
-			} else {
-				prev->next = curr->next;
-			}
-			free(curr);
-			break;
+	return box_answer_init(REMOVE_BOX_ANSWER_CODE, 0, NULL);
+}
+
+// Snapshot of the box table, taken for a list request
+struct box_list_item {
+	struct box_list_entry entry;
+	struct box_list_stats stats;
+};
+
+struct box_list {
+	struct box_list_item *items;
+	size_t count;
+	size_t capacity;
+};
+
+static void add_to_box_list(struct box* box, void* arg) {
+	struct box_list *list = (struct box_list*) arg;
+	if (list->count == list->capacity) {
+		size_t capacity = list->capacity == 0 ? 16 : list->capacity * 2;
+		struct box_list_item *items =
+			realloc(list->items, capacity * sizeof(struct box_list_item));
+		if (items == NULL) {
+			return; // box left out of the listing
 		}
-		prev = curr;
-		curr = curr->next;
+		list->items = items;
+		list->capacity = capacity;
 	}
-	box_count--;
-	pthread_mutex_unlock(&box_list_lock);
 
-	return box_answer_init(REMOVE_BOX_ANSWER_CODE, 0, NULL);
+	struct box_list_item *item = &list->items[list->count++];
+	item->entry = box_list_entry_init(LIST_BOX_ANSWER_CODE, 0, box->box_name,
+		atomic_load(&box->durable_size), box->n_publishers,
+		box->n_subscribers);
+	box_get_stats(box, &item->stats);
+}
+
+// Sends one box list entry, in the client's protocol version; the box's
+// stats (if any) only fit in version 2 frames.
+// Returns the number of bytes written, or -1 on error.
+static ssize_t send_list_entry(int client_pipe, uint8_t version,
+							   struct box_list_entry const *entry,
+							   struct box_list_stats const *stats) {
+	if (version != PROTOCOL_VERSION) {
+		return write(client_pipe, entry, sizeof(*entry));
+	}
+
+	char frame[FRAME_MAX_SIZE];
+	ssize_t n = list_entry_encode(frame, sizeof(frame), entry->code,
+								  entry->last, entry->box_name,
+								  entry->box_size, entry->n_publishers,
+								  entry->n_subscribers, stats);
+	return n < 0 ? -1 : write(client_pipe, frame, (size_t) n);
 }
 
-int list_boxes(const char *client_named_pipe_path) {
+int list_boxes(const char *client_named_pipe_path, uint8_t version) {
 
-	int client_pipe = open(client_named_pipe_path, O_WRONLY);
+	int client_pipe = open_client(client_named_pipe_path, O_WRONLY);
 	if (client_pipe < 0) {
 		return -1;
 	}
 
-	struct box_list_entry entry;
+	// Copy the entries out of the table first, so that no bucket (or box)
+	// stays locked while writing to the client
+	struct box_list list = {NULL, 0, 0};
+	box_table_foreach(&boxes, add_to_box_list, &list);
 
-	pthread_mutex_lock(&box_list_lock);
+	if (list.count == 0) {
+		struct box_list_entry entry =
+			box_list_entry_init(LIST_BOX_ANSWER_CODE, 1, NULL, 0, 0, 0);
 
-	if (head == NULL) {
-		entry = box_list_entry_init(LIST_BOX_ANSWER_CODE, 1, NULL, 0, 0, 0);
+		ssize_t n = send_list_entry(client_pipe, version, &entry, NULL);
+		close(client_pipe);
+		return n < 0 ? -1 : 0;
+	}
 
-		ssize_t n = write(client_pipe, &entry, sizeof(entry));
+	list.items[list.count - 1].entry.last = 1;
+	for (size_t i = 0; i < list.count; i++) {
+		ssize_t n = send_list_entry(client_pipe, version,
+									&list.items[i].entry,
+									&list.items[i].stats);
 		if (n < 0) {
+			free(list.items);
 			close(client_pipe);
-			pthread_mutex_unlock(&box_list_lock);
 			return -1;
 		}
-		pthread_mutex_unlock(&box_list_lock);
-		return 0;
-	}	
-	
-	struct box* temp = head;
-	for (; temp != NULL; temp = temp->next) {
-		if (temp->next == NULL) {
-			entry = box_list_entry_init(LIST_BOX_ANSWER_CODE, 1, temp->box_name,
-										temp->box_size, temp->n_publishers,
-										temp->n_subscribers);
-		} else {
-			entry = box_list_entry_init(LIST_BOX_ANSWER_CODE, 0, temp->box_name,
-										temp->box_size, temp->n_publishers,
-										temp->n_subscribers);
-		}
+	}
 
-		ssize_t n = write(client_pipe, &entry, sizeof(entry));
-		if (n < 0) {
-			close(client_pipe);
-			pthread_mutex_unlock(&box_list_lock);
-			return -1;
+	free(list.items);
+	close(client_pipe);
+	return 0;
+}
+
+// Most subscriber lags reported per box: those furthest behind
+#define REPORT_LAGS_MAX 16
+
+// Stats of every box, copied out of the box table
+struct box_counts {
+	char box_name[32];
+	uint64_t messages_in;
+	uint64_t messages_out;
+	uint64_t n_subscribers;
+	uint64_t lags[REPORT_LAGS_MAX];
+	size_t n_lags;
+};
+
+struct box_counts_list {
+	struct box_counts *entries;
+	size_t count;
+	size_t capacity;
+};
+
+static void add_to_box_counts(struct box* box, void* arg) {
+	struct box_counts_list *list = (struct box_counts_list*) arg;
+	if (list->count == list->capacity) {
+		size_t capacity = list->capacity == 0 ? 16 : list->capacity * 2;
+		struct box_counts *entries =
+			realloc(list->entries, capacity * sizeof(struct box_counts));
+		if (entries == NULL) {
+			return; // box left out of the stats
 		}
+		list->entries = entries;
+		list->capacity = capacity;
 	}
 
-	pthread_mutex_unlock(&box_list_lock);
+	struct box_counts *entry = &list->entries[list->count++];
+	strcpy(entry->box_name, box->box_name);
+	entry->messages_in = box->messages_in;
+	entry->messages_out = box->messages_out;
+	entry->n_subscribers = box->n_subscribers;
+	entry->n_lags = box_get_lags(box, entry->lags, REPORT_LAGS_MAX);
+}
 
-	close(client_pipe);
-	return 0;
+static int emit_pool_stats(int (*emit)(char const *line, void *arg),
+						   void *arg, const char *name,
+						   struct worker_pool *pool) {
+	struct pool_stats stats;
+	pool_get_stats(pool, &stats);
+	double wait_avg_us = stats.jobs == 0 ? 0.0 :
+		(double) stats.wait_ns_total / (double) stats.jobs / 1e3;
+	char line[MESSAGE_MAX_LENGTH + 1];
+	snprintf(line, sizeof(line), "{\"pool\": \"%s\", \"workers\": %zu, "
+			 "\"max_workers\": %zu, \"busy\": %zu, \"queued\": %zu, "
+			 "\"parked\": %zu, \"jobs\": %lu, \"wait_avg_us\": %.1f, "
+			 "\"wait_max_us\": %.1f}",
+			 name, stats.workers, stats.max_workers, stats.busy, stats.queued,
+			 stats.parked, (unsigned long) stats.jobs, wait_avg_us,
+			 (double) stats.wait_ns_max / 1e3);
+	return emit(line, arg);
 }
 
-void *work(void* main_queue) {
-	pc_queue_t *queue = (pc_queue_t*) main_queue;
-	while (true) {
+// Hands every stat of the broker to emit, one JSON object per line: counters,
+// latency histograms (in ns), worker pools and boxes.
+// Returns 0 if successful, -1 as soon as emit fails.
+static int report(int (*emit)(char const *line, void *arg), void *arg) {
+	stats_snapshot_t *snapshot = malloc(sizeof(stats_snapshot_t));
+	if (snapshot == NULL) {
+		return -1;
+	}
+	stats_snapshot(snapshot);
+
+	char line[MESSAGE_MAX_LENGTH + 1];
+	int ret = 0;
+	for (size_t c = 0; c < STATS_COUNTERS && ret == 0; c++) {
+		snprintf(line, sizeof(line), "{\"counter\": \"%s\", \"value\": %lu}",
+				 stats_counter_name((stats_counter_t) c),
+				 (unsigned long) snapshot->s_counters[c]);
+		ret = emit(line, arg);
+	}
+	for (size_t h = 0; h < STATS_HISTOGRAMS && ret == 0; h++) {
+		histogram_t const *hist = &snapshot->s_histograms[h];
+		double mean = hist->h_count == 0 ? 0.0 :
+			(double) hist->h_sum / (double) hist->h_count;
+		snprintf(line, sizeof(line), "{\"histogram\": \"%s\", "
+				 "\"count\": %lu, \"mean\": %.1f, \"p50\": %lu, "
+				 "\"p99\": %lu, \"p999\": %lu, \"max\": %lu}",
+				 stats_histogram_name((stats_histogram_t) h),
+				 (unsigned long) hist->h_count, mean,
+				 (unsigned long) histogram_percentile(hist, 0.5),
+				 (unsigned long) histogram_percentile(hist, 0.99),
+				 (unsigned long) histogram_percentile(hist, 0.999),
+				 (unsigned long) hist->h_max);
+		ret = emit(line, arg);
+	}
+	free(snapshot);
 
-		struct basic_request *request = (struct basic_request *) pcq_dequeue(queue);
+	if (ret == 0) {
+		ret = emit_pool_stats(emit, arg, "session", &session_workers);
+	}
+	if (ret == 0) {
+		ret = emit_pool_stats(emit, arg, "control", &control_workers);
+	}
 
-		switch (request->code) {
-			case 1:
-				//Pedido de registo de publisher
-				handle_publisher(request->client_named_pipe_path, request->box_name);
-				break;
-			case 2:
-				//Pedido de registo de subscriber
-				handle_subscriber(request->client_named_pipe_path, request->box_name);
-				break; 
-			case 3: ;
-				//Pedido de criação de caixa
-				struct box_answer boxcreation_answer;
-				boxcreation_answer = create_box(request->box_name);
-				send_answer(request->client_named_pipe_path, boxcreation_answer);
-				break;
-			//   4: Resposta ao pedido de criação de caixa (mandado pela worker thread na subrotina)
-			case 5: ;
-				//Pedido de remoção de caixa
-				struct box_answer boxremoval_answer;
-				boxremoval_answer = remove_box(request->box_name);
-				send_answer(request->client_named_pipe_path, boxremoval_answer);
-				break;
-			//   6: Resposta ao pedido de remoção de caixa (mandado pela worker thread na subrotina)
-			case 7:
-				//Pedido de listagem de caixas
-				list_boxes(request->client_named_pipe_path);
-				break;
-			//   8: Resposta ao pedido de listagem de caixas (mandado pela worker thread na subrotina)
-			default:
-				continue;
+	struct box_counts_list boxes_list = {NULL, 0, 0};
+	box_table_foreach(&boxes, add_to_box_counts, &boxes_list);
+	for (size_t i = 0; i < boxes_list.count && ret == 0; i++) {
+		struct box_counts const *entry = &boxes_list.entries[i];
+		int len = snprintf(line, sizeof(line), "{\"box\": \"%s\", "
+						   "\"messages_in\": %lu, \"messages_out\": %lu, "
+						   "\"subscribers\": %lu, \"lags\": [",
+						   entry->box_name,
+						   (unsigned long) entry->messages_in,
+						   (unsigned long) entry->messages_out,
+						   (unsigned long) entry->n_subscribers);
+		for (size_t l = 0; l < entry->n_lags; l++) {
+			len += snprintf(line + len, sizeof(line) - (size_t) len,
+							l == 0 ? "%lu" : ", %lu",
+							(unsigned long) entry->lags[l]);
 		}
+		snprintf(line + len, sizeof(line) - (size_t) len, "]}");
+		ret = emit(line, arg);
 	}
-	return NULL;
+	free(boxes_list.entries);
+	return ret;
+}
+
+// Where a stats answer goes
+struct stats_client {
+	int pipenum;
+	uint8_t version;
+};
+
+// Sends one line of a stats answer, in the client's protocol version
+static int send_stats_line(char const *line, void *arg) {
+	struct stats_client *client = (struct stats_client*) arg;
+	ssize_t n;
+	if (client->version == PROTOCOL_VERSION) {
+		char frame[FRAME_MAX_SIZE];
+		n = message_encode(frame, sizeof(frame), STATS_ANSWER_CODE, line,
+						   strlen(line));
+		if (n > 0) {
+			n = write(client->pipenum, frame, (size_t) n);
+		}
+	} else {
+		struct message msg = message_init(STATS_ANSWER_CODE, line);
+		n = write(client->pipenum, &msg, sizeof(msg));
+	}
+	return n < 0 ? -1 : 0;
+}
+
+// Answers a stats request; the client knows it has every line once the fifo
+// is closed
+int send_stats(const char *client_named_pipe_path, uint8_t version) {
+	struct stats_client client = {open_client(client_named_pipe_path, O_WRONLY),
+								  version};
+	if (client.pipenum < 0) {
+		return -1;
+	}
+
+	int ret = report(send_stats_line, &client);
+	close(client.pipenum);
+	return ret;
+}
+
+// Serves one request taken off the server fifo, on a pool worker, and frees it
+void work(void* job) {
+	struct request *request = (struct request *) job;
+	stats_count(STATS_REQUESTS, 1);
+	switch (request->code) {
+		case 1:
+			//Pedido de registo de publisher
+			if (event_loop_threads > 0)
+				attach_publisher(request->client_named_pipe_path, request->box_name);
+			else
+				handle_publisher(request->client_named_pipe_path, request->box_name);
+			break;
+		case 2:
+			//Pedido de registo de subscriber
+			if (event_loop_threads > 0)
+				attach_subscriber(request->client_named_pipe_path, request->box_name,
+					request->start_seq, request->version);
+			else
+				handle_subscriber(request->client_named_pipe_path, request->box_name,
+					request->start_seq, request->version);
+			break; 
+		case 3: ;
+			//Pedido de criação de caixa
+			struct box_answer boxcreation_answer;
+			boxcreation_answer = create_box(request->box_name);
+			send_answer(request->client_named_pipe_path, request->version,
+				boxcreation_answer);
+			break;
+		//   4: Resposta ao pedido de criação de caixa (mandado pela worker thread na subrotina)
+		case 5: ;
+			//Pedido de remoção de caixa
+			struct box_answer boxremoval_answer;
+			boxremoval_answer = remove_box(request->box_name);
+			send_answer(request->client_named_pipe_path, request->version,
+				boxremoval_answer);
+			break;
+		//   6: Resposta ao pedido de remoção de caixa (mandado pela worker thread na subrotina)
+		case 7:
+			//Pedido de listagem de caixas
+			list_boxes(request->client_named_pipe_path, request->version);
+			break;
+		//   8: Resposta ao pedido de listagem de caixas (mandado pela worker thread na subrotina)
+		case SUBSCRIBER_MAPPED_REGISTER_CODE:
+			//Pedido de registo de subscriber com a caixa mapeada em memória
+			if (event_loop_threads > 0)
+				attach_mapped_subscriber(request->client_named_pipe_path, request->box_name,
+					request->start_seq);
+			else
+				handle_mapped_subscriber(request->client_named_pipe_path, request->box_name,
+					request->start_seq);
+			break;
+		case STATS_REQUEST_CODE:
+			send_stats(request->client_named_pipe_path, request->version);
+			break;
+		default:
+			break;
+	}
+	slab_free(&request_slab, request);
 }
 
 int new_pipe(const char *pipe_name) {
@@ -377,7 +946,235 @@ int new_pipe(const char *pipe_name) {
 	return pipenum;
 }
 
-int create_server(const char *pipe_name, int num) {
+// Requests read off the server fifo, as many as one read brings in: during a
+// burst of registrations, that is a read per fifo's worth of requests rather
+// than a read (or more) per request
+struct request_reader {
+	int fd;
+	size_t len;
+	size_t pos; // start of the first request not parsed yet
+	char buffer[REQUEST_READ_SIZE];
+};
+
+// Reads what the fifo holds into the buffer, after the start of a request
+// that did not fully fit in the last read, if there is one.
+// Returns the number of bytes read, 0 at end of file, -1 on error.
+static ssize_t request_reader_fill(struct request_reader *reader) {
+	memmove(reader->buffer, reader->buffer + reader->pos,
+			reader->len - reader->pos);
+	reader->len -= reader->pos;
+	reader->pos = 0;
+	ssize_t n = read(reader->fd, reader->buffer + reader->len,
+					 sizeof(reader->buffer) - reader->len);
+	if (n > 0) {
+		reader->len += (size_t) n;
+	}
+	return n;
+}
+
+// Parses the next request in the buffer, in whichever protocol version the
+// client sent it.
+// Returns 1 if a request was parsed, 0 if the buffer holds no whole request,
+// -1 if the request was invalid (and dropped).
+static int request_reader_next(struct request_reader *reader,
+							   struct request *request) {
+	char const *buf = reader->buffer + reader->pos;
+	size_t len = reader->len - reader->pos;
+	if (len == 0) {
+		return 0;
+	}
+
+	if ((uint8_t) buf[0] != PROTOCOL_VERSION) {
+		// version 1: a fixed-size struct starting with the code
+		struct basic_request basic;
+		if (len < sizeof(basic)) {
+			return 0;
+		}
+		memcpy(&basic, buf, sizeof(basic));
+		reader->pos += sizeof(basic);
+		request->version = 1;
+		request->code = basic.code;
+		memcpy(request->client_named_pipe_path, basic.client_named_pipe_path,
+			   sizeof(basic.client_named_pipe_path));
+		request->client_named_pipe_path[255] = '\0';
+		memcpy(request->box_name, basic.box_name, sizeof(basic.box_name));
+		request->box_name[31] = '\0';
+		request->start_seq = START_EARLIEST;
+		return 1;
+	}
+
+	ssize_t frame_len = frame_length(buf, len);
+	if (frame_len == 0) {
+		return 0;
+	} else if (frame_len < 0) {
+		// no telling where it ends: drop the version byte, and go on from
+		// the next one
+		reader->pos++;
+		return -1;
+	}
+	reader->pos += (size_t) frame_len;
+
+	struct wire_request wire;
+	if (request_decode(buf, (size_t) frame_len, &wire) <= 0 ||
+		wire.client_named_pipe_path.length >=
+			sizeof(request->client_named_pipe_path) ||
+		wire.box_name.length >= sizeof(request->box_name)) {
+		return -1; // invalid request
+	}
+	request->version = PROTOCOL_VERSION;
+	request->code = wire.code;
+	memcpy(request->client_named_pipe_path, wire.client_named_pipe_path.data,
+		   wire.client_named_pipe_path.length);
+	request->client_named_pipe_path[wire.client_named_pipe_path.length] = '\0';
+	memcpy(request->box_name, wire.box_name.data, wire.box_name.length);
+	request->box_name[wire.box_name.length] = '\0';
+	request->start_seq = wire.start_seq;
+	return 1;
+}
+
+// Turns away a request the broker had no room for, so that its client is not
+// left waiting: box requests get an error answer, publishers find the fifo
+// closed on their first write, and other clients find it closed before any
+// answer
+static void reject(struct request *request) {
+	switch (request->code) {
+		case 3:
+		case 5:
+			send_answer(request->client_named_pipe_path, request->version,
+				box_answer_init(request->code == 3 ? CREATE_BOX_ANSWER_CODE :
+					REMOVE_BOX_ANSWER_CODE, -1, "broker busy."));
+			break;
+		case 1: ;
+			int pub_pipenum = open_client(request->client_named_pipe_path,
+										  O_RDONLY);
+			if (pub_pipenum != -1) {
+				// the publisher's open only returns once the fifo is open at
+				// both ends
+				struct pollfd opened = {pub_pipenum, POLLIN, 0};
+				poll(&opened, 1, CLIENT_OPEN_TIMEOUT_MS);
+				close(pub_pipenum);
+			}
+			break;
+		default: ;
+			int pipenum = open_client(request->client_named_pipe_path,
+									  O_WRONLY);
+			if (pipenum != -1) {
+				close(pipenum);
+			}
+			break;
+	}
+}
+
+// Rejecter thread: turns away the requests dropped by the server loop, one at
+// a time, as it waits on each client for up to CLIENT_OPEN_TIMEOUT_MS
+static void *reject_requests(void *arg) {
+	(void) arg;
+	while (true) {
+		struct request *request =
+			(struct request *) pcq_dequeue(&rejected_requests);
+		reject(request);
+		slab_free(&request_slab, request);
+	}
+	return NULL;
+}
+
+// Box management and stats requests go to the control workers, so they are
+// never queued behind sessions
+static struct worker_pool *pool_for(uint8_t code) {
+	switch (code) {
+		case 3:
+		case 5:
+		case 7:
+		case STATS_REQUEST_CODE:
+			return &control_workers;
+		default:
+			return &session_workers;
+	}
+}
+
+// Requests parsed for a pool, to be queued all at once
+struct request_batch {
+	struct worker_pool *pool;
+	size_t count;
+	void *requests[POOL_SUBMIT_BATCH];
+};
+
+// Queues the batch's requests on its pool. Those it could not queue are
+// dropped, and handed to the rejecter thread to turn their clients away; if
+// it is as far behind, their clients are left to time out.
+static void submit_batch(struct request_batch *batch) {
+	size_t queued = pool_submit_batch(batch->pool, batch->requests,
+									  batch->count);
+	if (queued == batch->count) {
+		batch->count = 0;
+		return;
+	}
+
+	stats_count(STATS_REQUESTS_DROPPED, batch->count - queued);
+	queued += pcq_offer_batch(&rejected_requests, batch->requests + queued,
+							  batch->count - queued);
+	for (size_t i = queued; i < batch->count; i++) {
+		slab_free(&request_slab, batch->requests[i]);
+	}
+	batch->count = 0;
+}
+
+// Queues every whole request in the reader's buffer, each on its pool, with
+// one enqueue per batch.
+// Returns 0 if successful, -1 if no memory is left.
+static int submit_requests(struct request_reader *reader) {
+	struct request_batch sessions = {&session_workers, 0, {NULL}};
+	struct request_batch controls = {&control_workers, 0, {NULL}};
+	struct request *request = NULL;
+	int ret = 0;
+	while (true) {
+		if (request == NULL &&
+			(request = (struct request *) slab_alloc(&request_slab)) == NULL) {
+			ret = -1;
+			break;
+		}
+		int n = request_reader_next(reader, request);
+		if (n == 0) {
+			break;
+		} else if (n < 0) {
+			continue; // dropped: parse the next one into the same request
+		}
+
+		struct request_batch *batch =
+			pool_for(request->code) == &control_workers ? &controls : &sessions;
+		batch->requests[batch->count++] = request;
+		request = NULL;
+		if (batch->count == POOL_SUBMIT_BATCH) {
+			submit_batch(batch);
+		}
+	}
+	if (request != NULL) {
+		slab_free(&request_slab, request);
+	}
+	submit_batch(&sessions);
+	submit_batch(&controls);
+	return ret;
+}
+
+static int print_stats_line(char const *line, void *arg) {
+	(void) arg;
+	fprintf(stderr, "%s\n", line);
+	return 0;
+}
+
+// Prints the broker's stats every stats_interval_ms, one JSON object per line
+static void *report_stats(void *arg) {
+	(void) arg;
+	struct timespec interval = {(time_t) (stats_interval_ms / 1000),
+								(long) (stats_interval_ms % 1000) * 1000000L};
+	while (true) {
+		nanosleep(&interval, NULL);
+		report(print_stats_line, NULL);
+	}
+	return NULL;
+}
+
+int create_server(const char *pipe_name, int num, size_t max_boxes) {
 
 	// TODO: garantir que não apaga pipes em uso maybe??
 	if (unlink(pipe_name) != 0 && errno != ENOENT) {
@@ -388,14 +1185,38 @@ int create_server(const char *pipe_name, int num) {
 		return -1; // failed to create pipe
 	}
 
-	int pipenum = open(pipe_name, O_RDONLY);
+	// The broker keeps a write end of its own fifo open, so that reads block
+	// while no client has it open instead of returning end of file at once
+	int pipenum = open(pipe_name, O_RDONLY | O_NONBLOCK);
 	if (pipenum == -1) {
 		unlink(pipe_name);
 		return -1; // failed to open pipe
 	}
+	int keep_open = open(pipe_name, O_WRONLY);
+	if (keep_open == -1 ||
+		fcntl(pipenum, F_SETFL, fcntl(pipenum, F_GETFL) & ~O_NONBLOCK) == -1) {
+		if (keep_open != -1) {
+			close(keep_open);
+		}
+		close(pipenum);
+		unlink(pipe_name);
+		return -1;
+	}
 
-	// Initialize server
-	if (tfs_init(NULL) < 0) {
+	// Initialize server: one inode per box, plus the root directory
+	tfs_params params = tfs_default_params();
+	if (params.max_inode_count < max_boxes + 1) {
+		params.max_inode_count = max_boxes + 1;
+	}
+	params.image_path = image_path;
+	params.sync_interval_ms = sync_interval_ms;
+	params.journal_path = journal_path;
+	params.latency_model = latency_model;
+	params.latency_ns = latency_ns;
+	if (tfs_init(&params) < 0 || box_table_init(&boxes, max_boxes) < 0 ||
+		restore_boxes(max_boxes) < 0 ||
+		slab_init(&request_slab, sizeof(struct request)) != 0) {
+		close(keep_open);
 		close(pipenum);
 		unlink(pipe_name);
 		exit(EXIT_FAILURE);
@@ -404,48 +1225,139 @@ int create_server(const char *pipe_name, int num) {
 	signal(SIGINT, sighandler);
 	signal(SIGPIPE, SIG_IGN);
 
-	pthread_mutex_init(&box_list_lock, NULL);
-
-	pc_queue_t queue;
-	pcq_create(&queue, (size_t) num*2); //change num to a different constant?
-	head = NULL;
+	if (event_loop_threads > 0 && event_loop_start(event_loop_threads) < 0) {
+		tfs_destroy();
+		close(keep_open);
+		close(pipenum);
+		unlink(pipe_name);
+		exit(EXIT_FAILURE);
+	}
 
-	pthread_t pid[num];
-	// for testing purposes, I only want to create a single thread
-	for (size_t i = 0; i < num; i++) {
-		if (pthread_create(&pid[i], NULL, work, (void *)&queue) < 0) {
-			tfs_destroy();
-			close(pipenum);
-			unlink(pipe_name);
-			exit(EXIT_FAILURE);
-		}
+	size_t min_workers = num > 0 ? (size_t) num : 1;
+	if (max_workers < min_workers) {
+		max_workers = min_workers * WORKERS_GROWTH;
+	}
+	pthread_t reporter;
+	pthread_t rejecter;
+	if (pool_start(&session_workers, min_workers, max_workers, work) < 0 ||
+		pool_start(&control_workers, control_worker_count,
+				   control_worker_count, work) < 0 ||
+		pcq_create(&rejected_requests, REJECTED_REQUESTS_MAX) != 0 ||
+		pthread_create(&rejecter, NULL, reject_requests, NULL) != 0 ||
+		(stats_interval_ms > 0 &&
+		 pthread_create(&reporter, NULL, report_stats, NULL) != 0)) {
+		tfs_destroy();
+		close(keep_open);
+		close(pipenum);
+		unlink(pipe_name);
+		exit(EXIT_FAILURE);
 	}
 
-	while (true) {
-		struct basic_request buffer;
-		ssize_t n = read(pipenum, &buffer, sizeof(struct basic_request));
-		if (n == -1) {
-			// ret == -1 indicates error
-			break;
-		} else if (n != 0) {
-			pcq_enqueue(&queue, (void *)&buffer);
+	// Every request gets its own slab object, which the pool takes over: the
+	// next read never overwrites a request still queued
+	struct request_reader *reader = malloc(sizeof(struct request_reader));
+	if (reader != NULL) {
+		reader->fd = pipenum;
+		reader->len = 0;
+		reader->pos = 0;
+		// the fifo never reaches end of file, so only an error ends this
+		while (request_reader_fill(reader) > 0 &&
+			   submit_requests(reader) == 0) {
 		}
+		free(reader);
 	}
 
-	pthread_mutex_destroy(&box_list_lock);
-	pcq_destroy(&queue);
-	destroy_box_list(head);
+	pool_stop(&session_workers);
+	pool_stop(&control_workers);
+	box_table_destroy(&boxes);
 	tfs_destroy();
+	close(keep_open);
 	close(pipenum);
 	unlink(pipe_name);
 	return 0;
 }
 
+// Parses a storage latency model: none, spin, sleep:<ns> or ns:<ns>.
+// Returns 0 if successful, -1 otherwise.
+static int parse_latency(const char *arg) {
+	const char *ns = strchr(arg, ':');
+	size_t len = ns != NULL ? (size_t) (ns - arg) : strlen(arg);
+
+	if (strncmp(arg, "none", len) == 0 && len == 4) {
+		latency_model = TFS_LATENCY_NONE;
+	} else if (strncmp(arg, "spin", len) == 0 && len == 4) {
+		latency_model = TFS_LATENCY_SPIN;
+	} else if (strncmp(arg, "sleep", len) == 0 && len == 5 && ns != NULL) {
+		latency_model = TFS_LATENCY_SLEEP;
+	} else if (strncmp(arg, "ns", len) == 0 && len == 2 && ns != NULL) {
+		latency_model = TFS_LATENCY_CALIBRATED;
+	} else {
+		return -1;
+	}
+	if (ns != NULL) {
+		latency_ns = strtoul(ns + 1, NULL, 10);
+	}
+	return 0;
+}
+
 int main(int argc, char **argv) {
+	int opt;
+	while ((opt = getopt(argc, argv, "c:e:i:j:l:m:s:w:")) != -1) {
+		switch (opt) {
+			case 'c':
+				control_worker_count = strtoul(optarg, NULL, 10);
+				break;
+			case 'e':
+				// serve sessions from event loops instead of worker threads
+				event_loop_threads = strtoul(optarg, NULL, 10);
+				break;
+			case 'i':
+				// keep boxes in a file system image, restored on restart
+				image_path = optarg;
+				break;
+			case 'j':
+				journal_path = optarg;
+				break;
+			case 'l':
+				if (parse_latency(optarg) != 0) {
+					fprintf(stderr, "mbroker: unknown latency model %s\n",
+							optarg);
+					return -1;
+				}
+				break;
+			case 'm':
+				sync_interval_ms = (unsigned int) strtoul(optarg, NULL, 10);
+				break;
+			case 's':
+				stats_interval_ms = strtoul(optarg, NULL, 10);
+				break;
+			case 'w':
+				max_workers = strtoul(optarg, NULL, 10);
+				break;
+			default:
+				break;
+		}
+	}
+	argc -= optind - 1;
+	argv += optind - 1;
+
+	if (journal_path != NULL && image_path == NULL) {
+		fprintf(stderr, "mbroker: a journal (-j) needs an image (-i)\n");
+		return -1;
+	}
+
 	if (argc == 3)
-		return create_server(argv[1], atoi(argv[2]));
+		return create_server(argv[1], atoi(argv[2]), DEFAULT_MAX_BOXES);
+	else if (argc == 4)
+		return create_server(argv[1], atoi(argv[2]),
+							 strtoul(argv[3], NULL, 10));
 	else
-		fprintf(stderr, "usage: mbroker <pipename>\n");
+		fprintf(stderr, "usage: mbroker [-c <control_workers>] "
+						"[-e <loop_threads>] [-i <image>] "
+						"[-j <journal>] [-m <sync_ms>] [-s <stats_ms>] "
+						"[-w <max_workers>] "
+						"[-l none|spin|sleep:<ns>|ns:<ns>] <pipename> "
+						"<max_sessions> [max_boxes]\n");
 
 	return -1;
 }
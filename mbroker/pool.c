@@ -0,0 +1,303 @@
+#include "pool.h"
+#include "stats.h"
+#include <time.h>
+
+// A job waiting in the queue, or parked. A NULL job tells the worker taking
+// it to exit.
+struct pool_job {
+	void* arg;
+	uint64_t queued_ns;
+	struct pool_job* next; // next parked job
+};
+
+static uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000u + (uint64_t) ts.tv_nsec;
+}
+
+// Workers neither busy nor about to exit. The counters are updated
+// independently, so the count is only a snapshot.
+static size_t idle_workers(struct worker_pool* pool) {
+	size_t workers = pool->workers - pool->retiring;
+	size_t busy = pool->busy;
+	return workers > busy ? workers - busy : 0;
+}
+
+static void record_wait(struct worker_pool* pool, uint64_t wait_ns) {
+	atomic_fetch_add(&pool->jobs, 1);
+	atomic_fetch_add(&pool->wait_ns_total, wait_ns);
+	stats_record(STATS_QUEUE_WAIT_NS, wait_ns);
+	uint64_t max = pool->wait_ns_max;
+	while (wait_ns > max &&
+		   !atomic_compare_exchange_weak(&pool->wait_ns_max, &max, wait_ns)) {
+	}
+}
+
+// Moves parked jobs into the queue, oldest first, for as long as it has room.
+// Called with park_lock held.
+static void pool_unpark(struct worker_pool* pool) {
+	struct pool_job* jobs[POOL_SUBMIT_BATCH];
+	while (pool->parked_head != NULL) {
+		size_t n = 0;
+		for (struct pool_job* job = pool->parked_head;
+			 job != NULL && n < POOL_SUBMIT_BATCH; job = job->next) {
+			jobs[n++] = job;
+		}
+		// once queued, a job may be taken and freed at any time
+		struct pool_job* rest = jobs[n - 1]->next;
+		size_t moved = pcq_offer_batch(&pool->queue, (void**) jobs, n);
+		atomic_fetch_sub(&pool->parked, moved);
+		if (moved < n) {
+			pool->parked_head = jobs[moved];
+			return; // queue is full
+		}
+		pool->parked_head = rest;
+	}
+	pool->parked_tail = NULL;
+}
+
+// Parks jobs behind those already parked, up to POOL_PARK_MAX in all, and
+// moves as many as fit into the queue.
+// Returns how many jobs were taken, the first ones.
+static size_t pool_park(struct worker_pool* pool, struct pool_job** jobs,
+						size_t count) {
+	pthread_mutex_lock(&pool->park_lock);
+	size_t room = POOL_PARK_MAX - pool->parked;
+	size_t taken = count < room ? count : room;
+	for (size_t i = 0; i < taken; i++) {
+		jobs[i]->next = NULL;
+		if (pool->parked_tail != NULL) {
+			pool->parked_tail->next = jobs[i];
+		} else {
+			pool->parked_head = jobs[i];
+		}
+		pool->parked_tail = jobs[i];
+	}
+	atomic_fetch_add(&pool->parked, taken);
+	pool_unpark(pool);
+	pthread_mutex_unlock(&pool->park_lock);
+	return taken;
+}
+
+static void* pool_worker(void* arg) {
+	struct worker_pool* pool = (struct worker_pool*) arg;
+	while (true) {
+		struct pool_job* job = (struct pool_job*) pcq_dequeue(&pool->queue);
+		// taking a job made room for a parked one
+		if (atomic_load(&pool->parked) > 0) {
+			pthread_mutex_lock(&pool->park_lock);
+			pool_unpark(pool);
+			pthread_mutex_unlock(&pool->park_lock);
+		}
+		if (job == NULL) {
+			atomic_fetch_sub(&pool->retiring, 1);
+			atomic_fetch_sub(&pool->workers, 1);
+			return NULL;
+		}
+
+		atomic_fetch_add(&pool->busy, 1);
+		atomic_fetch_sub(&pool->queued, 1);
+		record_wait(pool, now_ns() - job->queued_ns);
+		void* job_arg = job->arg;
+		slab_free(&pool->job_slab, job);
+
+		pool->run(job_arg);
+		atomic_fetch_sub(&pool->busy, 1);
+	}
+}
+
+// Adds a worker. Called with grow_lock held.
+static int spawn_worker(struct worker_pool* pool) {
+	pthread_t thread;
+	atomic_fetch_add(&pool->workers, 1);
+	if (pthread_create(&thread, NULL, pool_worker, pool) != 0) {
+		atomic_fetch_sub(&pool->workers, 1);
+		return -1;
+	}
+	pthread_detach(thread);
+	return 0;
+}
+
+// Retires the workers that stayed idle at every sample over the last
+// POOL_IDLE_MS, down to min_workers
+static void* pool_monitor(void* arg) {
+	struct worker_pool* pool = (struct worker_pool*) arg;
+	struct timespec interval = {0, POOL_SAMPLE_MS * 1000000L};
+	size_t window = POOL_IDLE_MS / POOL_SAMPLE_MS;
+	size_t idle_low = SIZE_MAX;
+	size_t samples = 0;
+
+	while (!pool->stopping) {
+		nanosleep(&interval, NULL);
+		size_t idle = idle_workers(pool);
+		if (idle < idle_low) {
+			idle_low = idle;
+		}
+		if (++samples < window) {
+			continue;
+		}
+
+		pthread_mutex_lock(&pool->grow_lock);
+		size_t workers = pool->workers - pool->retiring;
+		size_t surplus =
+			workers > pool->min_workers ? workers - pool->min_workers : 0;
+		size_t retire = idle_low < surplus ? idle_low : surplus;
+		atomic_fetch_add(&pool->retiring, retire);
+		pthread_mutex_unlock(&pool->grow_lock);
+
+		for (size_t i = 0; i < retire; i++) {
+			pcq_enqueue(&pool->queue, NULL);
+		}
+		idle_low = SIZE_MAX;
+		samples = 0;
+	}
+	return NULL;
+}
+
+// pool_start: starts a pool with min_workers threads, each of which calls run
+// on the jobs it takes.
+// Returns 0 if successful, -1 otherwise.
+int pool_start(struct worker_pool* pool, size_t min_workers,
+			   size_t max_workers, void (*run)(void* job)) {
+	if (min_workers == 0 || max_workers < min_workers) {
+		return -1;
+	}
+
+	// a full queue only parks jobs, but leave room for a whole batch at least
+	size_t capacity = max_workers * 2;
+	if (capacity < POOL_SUBMIT_BATCH) {
+		capacity = POOL_SUBMIT_BATCH;
+	}
+	if (pcq_create(&pool->queue, capacity) != 0 ||
+		slab_init(&pool->job_slab, sizeof(struct pool_job)) != 0) {
+		return -1;
+	}
+	pthread_mutex_init(&pool->park_lock, NULL);
+	pool->parked_head = NULL;
+	pool->parked_tail = NULL;
+	pool->parked = 0;
+	pool->run = run;
+	pool->min_workers = min_workers;
+	pool->max_workers = max_workers;
+	pthread_mutex_init(&pool->grow_lock, NULL);
+	pool->workers = 0;
+	pool->busy = 0;
+	pool->queued = 0;
+	pool->retiring = 0;
+	pool->jobs = 0;
+	pool->wait_ns_total = 0;
+	pool->wait_ns_max = 0;
+	pool->stopping = false;
+
+	for (size_t i = 0; i < min_workers; i++) {
+		if (spawn_worker(pool) != 0) {
+			return -1;
+		}
+	}
+	if (pthread_create(&pool->monitor, NULL, pool_monitor, pool) != 0) {
+		return -1;
+	}
+	return 0;
+}
+
+// pool_submit: queues a job, adding a worker first if there are already as
+// many queued jobs as idle workers. The job belongs to the pool until run is
+// called on it, unless this fails.
+// Returns 0 if successful, -1 otherwise.
+int pool_submit(struct worker_pool* pool, void* job) {
+	return pool_submit_batch(pool, &job, 1) == 1 ? 0 : -1;
+}
+
+// pool_submit_batch: queues count jobs, in order, with one enqueue per
+// POOL_SUBMIT_BATCH of them, first adding as many workers as it takes for
+// there to be an idle worker per queued job (within max_workers). Never
+// blocks: what does not fit in the queue is parked. The jobs queued belong to
+// the pool until run is called on them.
+// Returns how many jobs were queued, the first ones: fewer than count only if
+// no memory is left or POOL_PARK_MAX jobs are already parked.
+size_t pool_submit_batch(struct worker_pool* pool, void** jobs, size_t count) {
+	struct pool_job* queued[POOL_SUBMIT_BATCH];
+	for (size_t done = 0; done < count;) {
+		size_t n = count - done;
+		if (n > POOL_SUBMIT_BATCH) {
+			n = POOL_SUBMIT_BATCH;
+		}
+		uint64_t queued_ns = now_ns();
+		for (size_t i = 0; i < n; i++) {
+			queued[i] = (struct pool_job*) slab_alloc(&pool->job_slab);
+			if (queued[i] == NULL) {
+				while (i-- > 0) {
+					slab_free(&pool->job_slab, queued[i]);
+				}
+				return done;
+			}
+			queued[i]->arg = jobs[done + i];
+			queued[i]->queued_ns = queued_ns;
+		}
+
+		pthread_mutex_lock(&pool->grow_lock);
+		size_t waiting = atomic_fetch_add(&pool->queued, n) + n;
+		for (size_t i = 0; i < n && waiting > idle_workers(pool) &&
+						   pool->workers - pool->retiring < pool->max_workers;
+			 i++) {
+			if (spawn_worker(pool) != 0) {
+				break; // the jobs wait for a worker
+			}
+		}
+		pthread_mutex_unlock(&pool->grow_lock);
+
+		size_t taken = pool_park(pool, queued, n);
+		done += taken;
+		if (taken < n) {
+			atomic_fetch_sub(&pool->queued, n - taken);
+			for (size_t i = taken; i < n; i++) {
+				slab_free(&pool->job_slab, queued[i]);
+			}
+			return done;
+		}
+	}
+	return count;
+}
+
+void pool_get_stats(struct worker_pool* pool, struct pool_stats* stats) {
+	stats->workers = pool->workers - pool->retiring;
+	stats->busy = pool->busy;
+	stats->queued = pool->queued;
+	stats->parked = pool->parked;
+	stats->max_workers = pool->max_workers;
+	stats->jobs = pool->jobs;
+	stats->wait_ns_total = pool->wait_ns_total;
+	stats->wait_ns_max = pool->wait_ns_max;
+}
+
+// pool_stop: stops resizing the pool, waits for every job submitted to it to
+// run, then retires its workers and releases its queue once the last one is
+// gone: a worker in a session is waited for until the session ends. No job
+// may be submitted once this is called. The job slab is left alone, as the
+// workers' caches of it are only freed as their threads exit.
+void pool_stop(struct worker_pool* pool) {
+	struct timespec interval = {0, POOL_SAMPLE_MS * 1000000L};
+	pool->stopping = true;
+	pthread_join(pool->monitor, NULL);
+
+	// parked jobs are counted as queued until a worker takes them
+	while (pool->queued > 0) {
+		nanosleep(&interval, NULL);
+	}
+
+	pthread_mutex_lock(&pool->grow_lock);
+	size_t retire = pool->workers - pool->retiring;
+	atomic_fetch_add(&pool->retiring, retire);
+	pthread_mutex_unlock(&pool->grow_lock);
+	for (size_t i = 0; i < retire; i++) {
+		pcq_enqueue(&pool->queue, NULL);
+	}
+	while (pool->workers > 0) {
+		nanosleep(&interval, NULL);
+	}
+
+	pcq_destroy(&pool->queue);
+	pthread_mutex_destroy(&pool->park_lock);
+	pthread_mutex_destroy(&pool->grow_lock);
+}
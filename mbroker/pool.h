@@ -0,0 +1,79 @@
+#ifndef __POOL_H__
+#define __POOL_H__
+
+#include "producer-consumer.h"
+#include "slab.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// How often the pool looks for idle workers, and for how long a worker has to
+// stay idle before it is retired
+#define POOL_SAMPLE_MS 100
+#define POOL_IDLE_MS 2000
+
+// Most jobs pool_submit_batch puts in the queue with a single enqueue
+#define POOL_SUBMIT_BATCH 64
+
+// Most jobs a pool keeps parked while its queue is full; past that, jobs
+// submitted to it are turned away
+#define POOL_PARK_MAX 65536
+
+struct pool_job;
+
+// Worker pool: runs the jobs submitted to it on between min_workers and
+// max_workers threads. A worker serving a publisher or subscriber stays busy
+// for the whole session, so when a job is submitted and no worker is free,
+// the pool grows instead of leaving it queued behind the sessions; workers
+// left idle for POOL_IDLE_MS are retired, down to min_workers.
+//
+// Submitting never blocks: jobs that do not fit in the queue are parked, in
+// order, and moved into it by the workers as they make room.
+struct worker_pool {
+	pc_queue_t queue;
+	slab_t job_slab; // the queue's entries
+	pthread_mutex_t park_lock;
+	struct pool_job* parked_head;
+	struct pool_job* parked_tail;
+	_Atomic size_t parked;
+	void (*run)(void* job);
+	size_t min_workers;
+	size_t max_workers;
+
+	pthread_mutex_t grow_lock;
+	_Atomic size_t workers;
+	_Atomic size_t busy;
+	_Atomic size_t queued;
+	_Atomic size_t retiring; // told to exit, but not yet gone
+
+	// Time jobs spent queued before a worker picked them up
+	_Atomic uint64_t jobs;
+	_Atomic uint64_t wait_ns_total;
+	_Atomic uint64_t wait_ns_max;
+
+	pthread_t monitor;
+	_Atomic bool stopping;
+};
+
+// Snapshot of a pool, to size it by
+struct pool_stats {
+	size_t workers;
+	size_t busy;
+	size_t queued;
+	size_t parked;
+	size_t max_workers;
+	uint64_t jobs;
+	uint64_t wait_ns_total;
+	uint64_t wait_ns_max;
+};
+
+int pool_start(struct worker_pool* pool, size_t min_workers,
+			   size_t max_workers, void (*run)(void* job));
+int pool_submit(struct worker_pool* pool, void* job);
+size_t pool_submit_batch(struct worker_pool* pool, void** jobs, size_t count);
+void pool_get_stats(struct worker_pool* pool, struct pool_stats* stats);
+void pool_stop(struct worker_pool* pool);
+
+#endif
@@ -0,0 +1,478 @@
+#include "session.h"
+#include "operations.h"
+#include "slab.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#define MAX_EVENTS 64
+
+struct event_loop {
+	int epoll_fd;
+	int wake_fd; // eventfd, registered with a NULL data pointer
+	pthread_mutex_t ready_lock;
+	struct session* ready; // subscriber sessions with new box data
+	// Publisher sessions that appended records during the current batch of
+	// events, which are committed together at its end. Only the loop thread
+	// touches it.
+	struct session* uncommitted;
+	pthread_t thread;
+};
+
+static struct event_loop* loops;
+static size_t loop_count;
+
+// Sessions are allocated from a slab, freed by the loop they belong to
+static slab_t session_slab;
+static _Atomic size_t next_loop;
+
+// Sessions are spread over the loops round-robin
+static struct event_loop* pick_loop(void) {
+	return &loops[atomic_fetch_add(&next_loop, 1) % loop_count];
+}
+
+// Queues a subscriber session to be flushed by its loop thread.
+// Called with the session's box_lock held.
+void session_wake(struct session* s) {
+	struct event_loop* loop = s->loop;
+
+	pthread_mutex_lock(&loop->ready_lock);
+	bool was_queued = s->queued;
+	if (!was_queued) {
+		s->queued = true;
+		s->ready_next = loop->ready;
+		loop->ready = s;
+	}
+	pthread_mutex_unlock(&loop->ready_lock);
+
+	if (!was_queued) {
+		uint64_t one = 1;
+		if (write(loop->wake_fd, &one, sizeof(one)) < 0) {
+			// the counter is already non-zero, so the loop will wake up anyway
+		}
+	}
+}
+
+static int session_watch(struct session* s, int op) {
+	struct epoll_event ev;
+	ev.data.ptr = s;
+	if (s->kind == SESSION_PUBLISHER) {
+		ev.events = EPOLLIN;
+	} else {
+		// EPOLLERR (reader went away) is always reported
+		ev.events = s->out_pending ? EPOLLOUT : 0;
+	}
+	return epoll_ctl(s->loop->epoll_fd, op, s->pipenum, &ev);
+}
+
+// Stops watching the session, unlinks it from its box and its loop, and drops
+// its reference to the box. It is only freed at the end of the current batch
+// of events, which may still refer to it.
+static void session_close(struct session* s, struct session** dead) {
+	if (s->closed) {
+		return;
+	}
+	s->closed = true;
+
+	epoll_ctl(s->loop->epoll_fd, EPOLL_CTL_DEL, s->pipenum, NULL);
+
+	struct box* box = s->box;
+	if (s->kind == SESSION_PUBLISHER) {
+		if (s->uncommitted) {
+			struct session** link = &s->loop->uncommitted;
+			while (*link != s) {
+				link = &(*link)->commit_next;
+			}
+			*link = s->commit_next;
+			s->uncommitted = false;
+			box_commit(box, s->commit_lsn); // the publisher is gone anyway
+		}
+		box_close_publisher(box);
+	} else {
+		lock_box(box);
+		struct session** link = &box->subscribers;
+		while (*link != s) {
+			link = &(*link)->box_next;
+		}
+		*link = s->box_next;
+		unlock_box(box);
+		box_cursor_remove(box, &s->cursor);
+	}
+
+	// A queued session may also be on the list the loop is walking, which it
+	// skips once closed
+	pthread_mutex_lock(&s->loop->ready_lock);
+	if (s->queued) {
+		struct session** link = &s->loop->ready;
+		while (*link != NULL && *link != s) {
+			link = &(*link)->ready_next;
+		}
+		if (*link != NULL) {
+			*link = s->ready_next;
+		}
+		s->queued = false;
+	}
+	pthread_mutex_unlock(&s->loop->ready_lock);
+
+	if (s->kind == SESSION_SUBSCRIBER && !s->mapped) {
+		tfs_close(s->box_fd);
+	}
+	close(s->pipenum);
+	box_put(box);
+
+	s->dead_next = *dead;
+	*dead = s;
+}
+
+// Reads whatever the publisher has sent and appends each complete message to
+// the box, to be committed at the end of the batch of events
+static void publisher_read(struct session* s, struct session** dead) {
+	while (true) {
+		ssize_t n = read(s->pipenum, s->in + s->in_len,
+						 sizeof(s->in) - s->in_len);
+		if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+			session_close(s, dead); // publisher is gone
+			return;
+		} else if (n < 0) {
+			return; // nothing more to read for now
+		}
+
+		s->in_len += (size_t) n;
+		if (!s->uncommitted) {
+			s->uncommitted = true;
+			s->commit_next = s->loop->uncommitted;
+			s->loop->uncommitted = s;
+		}
+		if (box_publish_frames(s->box, s->in, &s->in_len,
+							   &s->commit_lsn) < 0) {
+			session_close(s, dead);
+			return;
+		}
+	}
+}
+
+// Gathers the complete records in s->buffer into s->out, until either runs
+// out
+static void subscriber_gather(struct session* s) {
+	while (true) {
+		char* start = s->buffer + s->buffer_pos;
+		size_t avail = s->buffer_len - s->buffer_pos;
+		struct box_record record;
+		if (avail < sizeof(record)) {
+			return;
+		}
+		memcpy(&record, start, sizeof(record));
+		if (avail < sizeof(record) + record.length) {
+			return; // rest of the record not read yet
+		}
+
+		if (record.seq < s->min_seq) {
+			box_cursor_advance(&s->cursor, record.seq + 1);
+		} else if (!delivery_add(&s->out, start + sizeof(record),
+								 record.length, record.seq)) {
+			return; // delivery is full
+		}
+		s->buffer_pos += sizeof(record) + record.length;
+	}
+}
+
+// Sends the subscriber every complete record in its box that it has not seen
+// yet, as few writes as PIPE_BUF allows, until it is caught up or its fifo is
+// full. Once caught up with a removed box, the session ends.
+static void subscriber_flush(struct session* s, struct session** dead) {
+	bool was_pending = s->out_pending;
+	while (true) {
+		ssize_t sent = delivery_send(&s->out, s->pipenum);
+		if (sent < 0 && errno == EAGAIN) {
+			s->out_pending = true;
+			break; // fifo is full, wait for EPOLLOUT
+		} else if (sent < 0) {
+			session_close(s, dead); // subscriber is gone
+			return;
+		} else if (sent > 0) {
+			box_delivered(s->box, (uint64_t) sent);
+			box_cursor_advance(&s->cursor, s->out.next_seq);
+		}
+		s->out_pending = false;
+
+		subscriber_gather(s);
+		if (s->out.frames > 0) {
+			continue;
+		}
+
+		// Keep the incomplete record and read more of the box
+		char* start = s->buffer + s->buffer_pos;
+		size_t avail = s->buffer_len - s->buffer_pos;
+		memmove(s->buffer, start, avail);
+		s->buffer_len = avail;
+		s->buffer_pos = 0;
+		// Removal wakes the session up after marking the box, so a read
+		// that races with it is followed by another flush
+		bool removed = box_removed(s->box);
+		ssize_t n = box_read(s->box, s->box_fd, &s->box_offset,
+							 s->buffer + s->buffer_len,
+							 sizeof(s->buffer) - s->buffer_len);
+		if (n < 0 || (n == 0 && removed)) {
+			session_close(s, dead);
+			return;
+		} else if (n == 0) {
+			break; // caught up
+		}
+		s->buffer_len += (size_t) n;
+	}
+
+	if (s->out_pending != was_pending) {
+		session_watch(s, EPOLL_CTL_MOD);
+	}
+}
+
+// Tells a mapped subscriber how far into the box segment it can read, if that
+// has moved since the last update. Once it has been told all the segment will
+// ever hold, of a removed box or one whose segment stopped growing, the session
+// ends.
+static void subscriber_notify(struct session* s, struct session** dead) {
+	bool was_pending = s->out_pending;
+
+	lock_box(s->box);
+	uint64_t end = s->box->segment_end;
+	uint64_t end_seq = s->box->durable_seq;
+	bool done = box_mapped_done(s->box, s->sent_end);
+	unlock_box(s->box);
+
+	if (done) {
+		session_close(s, dead);
+		return;
+	}
+
+	if (end > s->sent_end) {
+		struct segment_update update = segment_update_init(end);
+		ssize_t n = write(s->pipenum, &update, sizeof(update));
+		if (n < 0 && errno == EAGAIN) {
+			s->out_pending = true; // fifo is full, wait for EPOLLOUT
+		} else if (n < 0) {
+			session_close(s, dead); // subscriber is gone
+			return;
+		} else {
+			s->sent_end = end;
+			s->out_pending = false;
+			// counts as sent once the subscriber is told it can read it
+			box_cursor_advance(&s->cursor, end_seq);
+		}
+	}
+
+	if (s->out_pending != was_pending) {
+		session_watch(s, EPOLL_CTL_MOD);
+	}
+}
+
+// Commits what the loop's publishers appended during a batch of events, so
+// that the loop thread waits for the journal once per batch rather than once
+// per read. The first commit writes out every record appended so far, which
+// leaves little or nothing for the rest to wait for. A publisher whose records
+// cannot be committed is closed.
+static void event_loop_commit(struct event_loop* loop, struct session** dead) {
+	while (loop->uncommitted != NULL) {
+		struct session* s = loop->uncommitted;
+		loop->uncommitted = s->commit_next;
+		s->uncommitted = false;
+		uint64_t lsn = s->commit_lsn;
+		s->commit_lsn = 0;
+		if (box_commit(s->box, lsn) != 0) {
+			session_close(s, dead);
+		}
+	}
+}
+
+static void *event_loop_run(void* arg) {
+	struct event_loop* loop = (struct event_loop*) arg;
+	struct epoll_event events[MAX_EVENTS];
+
+	while (true) {
+		int n = epoll_wait(loop->epoll_fd, events, MAX_EVENTS, -1);
+		if (n < 0) {
+			continue; // EINTR
+		}
+
+		struct session* dead = NULL;
+		for (int i = 0; i < n; i++) {
+			struct session* s = events[i].data.ptr;
+			if (s == NULL) {
+				uint64_t count;
+				if (read(loop->wake_fd, &count, sizeof(count)) < 0) {
+					continue;
+				}
+
+				pthread_mutex_lock(&loop->ready_lock);
+				struct session* ready = loop->ready;
+				loop->ready = NULL;
+				pthread_mutex_unlock(&loop->ready_lock);
+
+				// A session stays queued until it is taken off the list, so
+				// that waking it meanwhile neither links it twice nor cuts
+				// the rest of the list off; once off, a wake queues it again
+				while (ready != NULL) {
+					pthread_mutex_lock(&loop->ready_lock);
+					struct session* next = ready->ready_next;
+					ready->queued = false;
+					pthread_mutex_unlock(&loop->ready_lock);
+					if (ready->closed) {
+						// nothing left to send
+					} else if (ready->mapped) {
+						subscriber_notify(ready, &dead);
+					} else {
+						subscriber_flush(ready, &dead);
+					}
+					ready = next;
+				}
+			} else if (s->closed) {
+				continue;
+			} else if (s->kind == SESSION_PUBLISHER) {
+				publisher_read(s, &dead);
+			} else if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+				session_close(s, &dead);
+			} else if (s->mapped) {
+				subscriber_notify(s, &dead);
+			} else {
+				subscriber_flush(s, &dead);
+			}
+		}
+
+		event_loop_commit(loop, &dead);
+
+		while (dead != NULL) {
+			struct session* next = dead->dead_next;
+			slab_free(&session_slab, dead);
+			dead = next;
+		}
+	}
+	return NULL;
+}
+
+int event_loop_start(size_t threads) {
+	loops = calloc(threads, sizeof(struct event_loop));
+	if (loops == NULL ||
+		slab_init(&session_slab, sizeof(struct session)) != 0) {
+		return -1;
+	}
+	loop_count = threads;
+	atomic_init(&next_loop, 0);
+
+	for (size_t i = 0; i < threads; i++) {
+		struct event_loop* loop = &loops[i];
+		loop->epoll_fd = epoll_create1(0);
+		loop->wake_fd = eventfd(0, EFD_NONBLOCK);
+		if (loop->epoll_fd < 0 || loop->wake_fd < 0) {
+			return -1;
+		}
+		pthread_mutex_init(&loop->ready_lock, NULL);
+		loop->ready = NULL;
+		loop->uncommitted = NULL;
+
+		struct epoll_event ev;
+		ev.events = EPOLLIN;
+		ev.data.ptr = NULL;
+		if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->wake_fd, &ev) < 0) {
+			return -1;
+		}
+
+		if (pthread_create(&loop->thread, NULL, event_loop_run, loop) != 0) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static struct session* session_new(enum session_kind kind, struct box* box,
+								   int pipenum) {
+	struct session* s = slab_alloc(&session_slab);
+	if (s == NULL) {
+		return NULL;
+	}
+	memset(s, 0, sizeof(*s));
+	s->kind = kind;
+	s->pipenum = pipenum;
+	s->box = box;
+	s->loop = pick_loop();
+	s->box_fd = -1;
+	return s;
+}
+
+// Hands a publisher session over to an event loop. The caller has already
+// registered the publisher in the box.
+int session_start_publisher(struct box* box, int pipenum) {
+	struct session* s = session_new(SESSION_PUBLISHER, box, pipenum);
+	if (s == NULL) {
+		return -1;
+	}
+
+	if (fcntl(pipenum, F_SETFL, O_NONBLOCK) < 0 ||
+		session_watch(s, EPOLL_CTL_ADD) < 0) {
+		slab_free(&session_slab, s);
+		return -1;
+	}
+	return 0;
+}
+
+// Registers a subscriber session in its box, starts watching it and queues it
+// to catch up with the box. The loop can only close the session once it is
+// watched or woken, both of which happen last, with box_lock held: closing
+// takes box_lock, so it waits for the session to be fully registered.
+static int session_attach_subscriber(struct session* s) {
+	if (fcntl(s->pipenum, F_SETFL, O_NONBLOCK) < 0) {
+		slab_free(&session_slab, s);
+		return -1;
+	}
+
+	struct box* box = s->box;
+	box_cursor_add(box, &s->cursor, s->start_seq);
+	lock_box(box);
+	s->box_next = box->subscribers;
+	box->subscribers = s;
+	if (session_watch(s, EPOLL_CTL_ADD) < 0) {
+		box->subscribers = s->box_next;
+		unlock_box(box);
+		box_cursor_remove(box, &s->cursor);
+		slab_free(&session_slab, s);
+		return -1;
+	}
+	session_wake(s);
+	unlock_box(box);
+	return 0;
+}
+
+// Hands a subscriber session over to an event loop, which starts by sending
+// everything already in the box
+int session_start_subscriber(struct box* box, int pipenum, int box_fd,
+							 uint64_t box_offset, uint64_t start_seq,
+							 uint8_t version) {
+	struct session* s = session_new(SESSION_SUBSCRIBER, box, pipenum);
+	if (s == NULL) {
+		return -1;
+	}
+	s->box_fd = box_fd;
+	s->box_offset = box_offset;
+	s->start_seq = start_seq;
+	// a future start_seq is reached by skipping the records before it
+	s->min_seq = start_seq == START_LATEST ? 0 : start_seq;
+	delivery_init(&s->out, version, DELIVERY_MAX_FRAMES);
+	return session_attach_subscriber(s);
+}
+
+// Hands a mapped subscriber session over to an event loop. The caller has
+// already sent it the box segment's name.
+int session_start_mapped_subscriber(struct box* box, int pipenum,
+									uint64_t start_seq) {
+	struct session* s = session_new(SESSION_SUBSCRIBER, box, pipenum);
+	if (s == NULL) {
+		return -1;
+	}
+	s->mapped = true;
+	s->start_seq = start_seq;
+	return session_attach_subscriber(s);
+}
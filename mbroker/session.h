@@ -0,0 +1,68 @@
+#ifndef __SESSION_H__
+#define __SESSION_H__
+
+#include "box.h"
+#include "delivery.h"
+#include "protocol.h"
+#include <stdbool.h>
+#include <stddef.h>
+
+enum session_kind { SESSION_PUBLISHER, SESSION_SUBSCRIBER };
+
+struct event_loop;
+
+// A publisher or subscriber session, driven by an event loop instead of a
+// worker thread. Each session belongs to a single loop thread, which is the
+// only one to touch its buffers. It holds a reference to its box until it is
+// closed.
+struct session {
+	enum session_kind kind;
+	int pipenum;
+	struct box* box;
+	struct event_loop* loop;
+	bool closed;
+
+	// publisher: frames read from the session fifo, the last of which may be
+	// incomplete, and the records appended from them that its loop has yet to
+	// commit
+	char in[PUBLISHER_READ_SIZE];
+	size_t in_len;
+	uint64_t commit_lsn;
+	bool uncommitted; // in the loop's uncommitted list
+	struct session* commit_next;
+
+	// subscriber: box records read but not yet delivered, and the messages
+	// gathered from them for the next write to the session fifo, which point
+	// into buffer, so it is only refilled once they are sent
+	int box_fd;
+	uint64_t box_offset; // where box_fd is, for box_read
+	uint64_t start_seq; // as registered, where its cursor starts
+	uint64_t min_seq; // records numbered below this are skipped
+	char buffer[BOX_READ_SIZE];
+	size_t buffer_len;
+	size_t buffer_pos;
+	struct delivery out;
+	bool out_pending; // waiting for room in the session fifo
+	struct box_cursor cursor;
+
+	// mapped subscriber: reads the box segment itself, and is only told how
+	// far into it the published messages go
+	bool mapped;
+	uint64_t sent_end;
+
+	bool queued; // in the loop's ready list
+	struct session* ready_next;
+	struct session* box_next; // next subscriber session on the same box
+	struct session* dead_next;
+};
+
+int event_loop_start(size_t threads);
+int session_start_publisher(struct box* box, int pipenum);
+int session_start_subscriber(struct box* box, int pipenum, int box_fd,
+							 uint64_t box_offset, uint64_t start_seq,
+							 uint8_t version);
+int session_start_mapped_subscriber(struct box* box, int pipenum,
+									uint64_t start_seq);
+void session_wake(struct session* s);
+
+#endif
@@ -1,6 +1,10 @@
 #include "producer-consumer.h"
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 
+#ifdef PCQ_MUTEX
+
 // pcq_create: create a queue, with a given (fixed) capacity
 //
 // Memory: the queue pointer must be previously allocated
@@ -65,6 +69,36 @@ int pcq_enqueue(pc_queue_t *queue, void *elem) {
 	return 0;
 }
 
+// pcq_enqueue_batch: insert count elements at the front of the queue, in
+// order; this backend takes its locks once per element anyway
+//
+// If the queue is full, sleep until the queue has space for the rest
+int pcq_enqueue_batch(pc_queue_t *queue, void **elems, size_t count) {
+	for (size_t i = 0; i < count; i++) {
+		pcq_enqueue(queue, elems[i]);
+	}
+	return 0;
+}
+
+// pcq_offer_batch: insert as many of count elements at the front of the
+// queue as it has room for, in order; this backend checks for room once per
+// element, so it only sleeps if another pusher takes the room in between
+//
+// Returns how many elements were inserted, the first ones
+size_t pcq_offer_batch(pc_queue_t *queue, void **elems, size_t count) {
+	size_t done = 0;
+	while (done < count) {
+		pthread_mutex_lock(&queue->pcq_pusher_condvar_lock);
+		bool full = queue->pcq_current_size == queue->pcq_capacity;
+		pthread_mutex_unlock(&queue->pcq_pusher_condvar_lock);
+		if (full) {
+			break;
+		}
+		pcq_enqueue(queue, elems[done++]);
+	}
+	return done;
+}
+
 // pcq_dequeue: remove an element from the back of the queue
 //
 // If the queue is empty, sleep until the queue has an element
@@ -92,4 +126,257 @@ void *pcq_dequeue(pc_queue_t *queue) {
 	pthread_mutex_unlock(&queue->pcq_pusher_condvar_lock);
 
 	return elem;
-}
\ No newline at end of file
+}
+
+#else
+
+// pcq_create: create a queue, with a given (fixed) capacity
+//
+// Memory: the queue pointer must be previously allocated
+// (either on the stack or the heap)
+int pcq_create(pc_queue_t *queue, size_t capacity) {
+	size_t rounded = 2;
+	while (rounded < capacity) {
+		rounded <<= 1;
+	}
+
+	queue->pcq_buffer = (pcq_cell_t *)malloc(rounded * sizeof(pcq_cell_t));
+	if (queue->pcq_buffer == NULL) {
+		return -1;
+	}
+	queue->pcq_capacity = rounded;
+	for (size_t i = 0; i < rounded; i++) {
+		atomic_init(&queue->pcq_buffer[i].pcq_seq, i);
+	}
+	atomic_init(&queue->pcq_head, 0);
+	atomic_init(&queue->pcq_tail, 0);
+
+	pthread_mutex_init(&queue->pcq_park_lock, NULL);
+	pthread_cond_init(&queue->pcq_pusher_condvar, NULL);
+	pthread_cond_init(&queue->pcq_popper_condvar, NULL);
+	atomic_init(&queue->pcq_parked_pushers, 0);
+	atomic_init(&queue->pcq_parked_poppers, 0);
+	return 0;
+}
+
+// pcq_destroy: releases the internal resources of the queue
+//
+// Memory: does not free the queue pointer itself
+int pcq_destroy(pc_queue_t *queue) {
+	free(queue->pcq_buffer);
+	pthread_mutex_destroy(&queue->pcq_park_lock);
+	pthread_cond_destroy(&queue->pcq_pusher_condvar);
+	pthread_cond_destroy(&queue->pcq_popper_condvar);
+	return 0;
+}
+
+// pcq_try_enqueue: claim the cell at the head, if it is free on this lap
+//
+// Returns false if the queue is full
+static bool pcq_try_enqueue(pc_queue_t *queue, void *elem) {
+	size_t mask = queue->pcq_capacity - 1;
+	size_t pos = atomic_load_explicit(&queue->pcq_head, memory_order_relaxed);
+	pcq_cell_t *cell;
+	while (true) {
+		cell = &queue->pcq_buffer[pos & mask];
+		size_t seq =
+			atomic_load_explicit(&cell->pcq_seq, memory_order_acquire);
+		intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+		if (diff == 0) {
+			if (atomic_compare_exchange_weak_explicit(
+					&queue->pcq_head, &pos, pos + 1, memory_order_relaxed,
+					memory_order_relaxed)) {
+				break;
+			}
+		} else if (diff < 0) {
+			return false; // cell still holds an element from the last lap
+		} else {
+			pos = atomic_load_explicit(&queue->pcq_head, memory_order_relaxed);
+		}
+	}
+
+	cell->pcq_elem = elem;
+	atomic_store_explicit(&cell->pcq_seq, pos + 1, memory_order_release);
+	return true;
+}
+
+// pcq_try_enqueue_batch: claim the free cells at the head, up to count of
+// them, with a single move of the head
+//
+// Returns how many elements were inserted, 0 if the queue is full
+static size_t pcq_try_enqueue_batch(pc_queue_t *queue, void **elems,
+									size_t count) {
+	size_t mask = queue->pcq_capacity - 1;
+	size_t pos = atomic_load_explicit(&queue->pcq_head, memory_order_relaxed);
+	size_t claimed;
+	while (true) {
+		// cells are free on this lap when their sequence is their position
+		claimed = 0;
+		while (claimed < count && claimed <= mask) {
+			pcq_cell_t *cell = &queue->pcq_buffer[(pos + claimed) & mask];
+			size_t seq =
+				atomic_load_explicit(&cell->pcq_seq, memory_order_acquire);
+			if (seq != pos + claimed) {
+				if (claimed == 0 && (intptr_t)seq - (intptr_t)pos < 0) {
+					return 0; // cell still holds an element from the last lap
+				}
+				break;
+			}
+			claimed++;
+		}
+
+		if (claimed == 0) {
+			pos = atomic_load_explicit(&queue->pcq_head, memory_order_relaxed);
+		} else if (atomic_compare_exchange_weak_explicit(
+					   &queue->pcq_head, &pos, pos + claimed,
+					   memory_order_relaxed, memory_order_relaxed)) {
+			break;
+		}
+	}
+
+	for (size_t i = 0; i < claimed; i++) {
+		pcq_cell_t *cell = &queue->pcq_buffer[(pos + i) & mask];
+		cell->pcq_elem = elems[i];
+		atomic_store_explicit(&cell->pcq_seq, pos + i + 1,
+							  memory_order_release);
+	}
+	return claimed;
+}
+
+// pcq_try_dequeue: claim the cell at the tail, if it has been filled
+//
+// Returns false if the queue is empty
+static bool pcq_try_dequeue(pc_queue_t *queue, void **elem) {
+	size_t mask = queue->pcq_capacity - 1;
+	size_t pos = atomic_load_explicit(&queue->pcq_tail, memory_order_relaxed);
+	pcq_cell_t *cell;
+	while (true) {
+		cell = &queue->pcq_buffer[pos & mask];
+		size_t seq =
+			atomic_load_explicit(&cell->pcq_seq, memory_order_acquire);
+		intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+		if (diff == 0) {
+			if (atomic_compare_exchange_weak_explicit(
+					&queue->pcq_tail, &pos, pos + 1, memory_order_relaxed,
+					memory_order_relaxed)) {
+				break;
+			}
+		} else if (diff < 0) {
+			return false; // cell not filled yet
+		} else {
+			pos = atomic_load_explicit(&queue->pcq_tail, memory_order_relaxed);
+		}
+	}
+
+	*elem = cell->pcq_elem;
+	atomic_store_explicit(&cell->pcq_seq, pos + mask + 1,
+						  memory_order_release);
+	return true;
+}
+
+// pcq_wake: wake a parked thread, or all of them, if there is any
+//
+// The fence pairs with the one in pcq_enqueue/pcq_dequeue: either the parked
+// thread sees the change to the ring, or we see it parked.
+static void pcq_wake(pc_queue_t *queue, _Atomic size_t *parked,
+					 pthread_cond_t *condvar, bool all) {
+	atomic_thread_fence(memory_order_seq_cst);
+	if (atomic_load_explicit(parked, memory_order_relaxed) > 0) {
+		pthread_mutex_lock(&queue->pcq_park_lock);
+		if (all) {
+			pthread_cond_broadcast(condvar);
+		} else {
+			pthread_cond_signal(condvar);
+		}
+		pthread_mutex_unlock(&queue->pcq_park_lock);
+	}
+}
+
+// pcq_enqueue: insert a new element at the front of the queue
+//
+// If the queue is full, sleep until the queue has space
+int pcq_enqueue(pc_queue_t *queue, void *elem) {
+	if (!pcq_try_enqueue(queue, elem)) {
+		pthread_mutex_lock(&queue->pcq_park_lock);
+		atomic_fetch_add(&queue->pcq_parked_pushers, 1);
+		atomic_thread_fence(memory_order_seq_cst);
+		while (!pcq_try_enqueue(queue, elem)) {
+			pthread_cond_wait(&queue->pcq_pusher_condvar,
+							  &queue->pcq_park_lock);
+		}
+		atomic_fetch_sub(&queue->pcq_parked_pushers, 1);
+		pthread_mutex_unlock(&queue->pcq_park_lock);
+	}
+
+	pcq_wake(queue, &queue->pcq_parked_poppers, &queue->pcq_popper_condvar,
+			 false);
+	return 0;
+}
+
+// pcq_enqueue_batch: insert count elements at the front of the queue, in
+// order, claiming every free cell needed with each move of the head
+//
+// If the queue is full, sleep until the queue has space for the rest
+int pcq_enqueue_batch(pc_queue_t *queue, void **elems, size_t count) {
+	size_t done = 0;
+	while (done < count) {
+		size_t n = pcq_try_enqueue_batch(queue, elems + done, count - done);
+		if (n == 0) {
+			pthread_mutex_lock(&queue->pcq_park_lock);
+			atomic_fetch_add(&queue->pcq_parked_pushers, 1);
+			atomic_thread_fence(memory_order_seq_cst);
+			while ((n = pcq_try_enqueue_batch(queue, elems + done,
+											  count - done)) == 0) {
+				pthread_cond_wait(&queue->pcq_pusher_condvar,
+								  &queue->pcq_park_lock);
+			}
+			atomic_fetch_sub(&queue->pcq_parked_pushers, 1);
+			pthread_mutex_unlock(&queue->pcq_park_lock);
+		}
+
+		done += n;
+		pcq_wake(queue, &queue->pcq_parked_poppers,
+				 &queue->pcq_popper_condvar, n > 1);
+	}
+	return 0;
+}
+
+// pcq_offer_batch: insert as many of count elements at the front of the
+// queue as it has room for, in order
+//
+// Never sleeps: returns how many elements were inserted, the first ones
+size_t pcq_offer_batch(pc_queue_t *queue, void **elems, size_t count) {
+	size_t done = 0;
+	size_t n;
+	while (done < count &&
+		   (n = pcq_try_enqueue_batch(queue, elems + done, count - done)) > 0) {
+		done += n;
+		pcq_wake(queue, &queue->pcq_parked_poppers,
+				 &queue->pcq_popper_condvar, n > 1);
+	}
+	return done;
+}
+
+// pcq_dequeue: remove an element from the back of the queue
+//
+// If the queue is empty, sleep until the queue has an element
+void *pcq_dequeue(pc_queue_t *queue) {
+	void *elem;
+	if (!pcq_try_dequeue(queue, &elem)) {
+		pthread_mutex_lock(&queue->pcq_park_lock);
+		atomic_fetch_add(&queue->pcq_parked_poppers, 1);
+		atomic_thread_fence(memory_order_seq_cst);
+		while (!pcq_try_dequeue(queue, &elem)) {
+			pthread_cond_wait(&queue->pcq_popper_condvar,
+							  &queue->pcq_park_lock);
+		}
+		atomic_fetch_sub(&queue->pcq_parked_poppers, 1);
+		pthread_mutex_unlock(&queue->pcq_park_lock);
+	}
+
+	pcq_wake(queue, &queue->pcq_parked_pushers, &queue->pcq_pusher_condvar,
+			 false);
+	return elem;
+}
+
+#endif // PCQ_MUTEX
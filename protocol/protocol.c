@@ -1,5 +1,6 @@
 #include "protocol.h"
 #include <string.h>
+#include <unistd.h>
 
 struct basic_request basic_request_init(uint8_t code, char const *pipe_path,
 										char const *box_name) {
@@ -49,4 +50,509 @@ struct box_list_entry box_list_entry_init(uint8_t code, uint8_t last,
 	entry.n_publishers = n_publishers;
 	entry.n_subscribers = n_subscribers;
 	return entry;
-}
\ No newline at end of file
+}
+
+struct segment_info segment_info_init(char const *segment_name,
+									  uint64_t segment_size, uint64_t start) {
+	struct segment_info info;
+	info.code = SEGMENT_INFO_CODE;
+	memset(info.segment_name, 0, sizeof(info.segment_name));
+	strncpy(info.segment_name, segment_name, sizeof(info.segment_name) - 1);
+	info.segment_size = segment_size;
+	info.start = start;
+	return info;
+}
+
+struct segment_update segment_update_init(uint64_t end) {
+	struct segment_update update;
+	update.code = SEGMENT_UPDATE_CODE;
+	update.end = end;
+	return update;
+}
+
+// batch_init: start an empty batch
+void batch_init(char *batch, size_t *batch_len) {
+	struct batch_header header = {PUBLISHER_BATCH_CODE, 0};
+	memcpy(batch, &header, sizeof(header));
+	*batch_len = sizeof(header);
+}
+
+// batch_append: add a message to the batch
+//
+// Returns 0 if successful, -1 if the message does not fit
+int batch_append(char *batch, size_t *batch_len, char const *message,
+				 size_t len) {
+	uint16_t record_len = (uint16_t)len;
+	if (*batch_len + sizeof(record_len) + len > BATCH_MAX_SIZE) {
+		return -1;
+	}
+	memcpy(batch + *batch_len, &record_len, sizeof(record_len));
+	memcpy(batch + *batch_len + sizeof(record_len), message, len);
+	*batch_len += sizeof(record_len) + len;
+	return 0;
+}
+
+// batch_finish: fill in the header, once all messages have been added
+void batch_finish(char *batch, size_t batch_len) {
+	struct batch_header header = {
+		PUBLISHER_BATCH_CODE,
+		(uint16_t)(batch_len - sizeof(struct batch_header))};
+	memcpy(batch, &header, sizeof(header));
+}
+
+// record_append: append a message to out as a box record, to be numbered
+// when it is published
+static void record_append(char *out, size_t *out_len, char const *message,
+						  size_t len) {
+	if (len == 0) {
+		return; // empty messages are never delivered
+	}
+	if (len > MESSAGE_MAX_LENGTH) {
+		len = MESSAGE_MAX_LENGTH;
+	}
+	struct box_record record = {0, (uint16_t)len};
+	memcpy(out + *out_len, &record, sizeof(record));
+	memcpy(out + *out_len + sizeof(record), message, len);
+	*out_len += sizeof(record) + len;
+}
+
+// publisher_frame_decode: decode the frame (a struct message or a batch) at
+// the start of a buffer, appending its messages to out as box records
+//
+// out must have room for 4 * len more bytes.
+// Returns the size of the frame, 0 if the buffer does not hold the whole
+// frame yet, or -1 if the frame is invalid
+ssize_t publisher_frame_decode(char const *frame, size_t len, char *out,
+							   size_t *out_len) {
+	if (len == 0) {
+		return 0;
+	}
+
+	if ((uint8_t)frame[0] == PUBLISHER_MESSAGE_CODE) {
+		if (len < sizeof(struct message)) {
+			return 0;
+		}
+		char const *message = frame + offsetof(struct message, message);
+		record_append(out, out_len, message,
+					  strnlen(message, sizeof(((struct message *)0)->message)));
+		return (ssize_t)sizeof(struct message);
+	}
+
+	if ((uint8_t)frame[0] != PUBLISHER_BATCH_CODE) {
+		return -1;
+	}
+
+	struct batch_header header;
+	if (len < sizeof(header)) {
+		return 0;
+	}
+	memcpy(&header, frame, sizeof(header));
+	size_t frame_len = sizeof(header) + header.length;
+	if (len < frame_len) {
+		return 0;
+	}
+
+	size_t pos = sizeof(header);
+	while (pos + sizeof(uint16_t) <= frame_len) {
+		uint16_t record_len;
+		memcpy(&record_len, frame + pos, sizeof(record_len));
+		pos += sizeof(record_len);
+		if (pos + record_len > frame_len) {
+			return -1;
+		}
+		record_append(out, out_len, frame + pos, record_len);
+		pos += record_len;
+	}
+	return (ssize_t)frame_len;
+}
+
+// varint_size: number of bytes of the varint encoding of v
+static size_t varint_size(uint64_t v) {
+	size_t size = 1;
+	while (v >= 0x80) {
+		v >>= 7;
+		size++;
+	}
+	return size;
+}
+
+static size_t string_size(char const *s) {
+	size_t len = s != NULL ? strlen(s) : 0;
+	return varint_size(len) + len;
+}
+
+static uint64_t zigzag(int32_t v) {
+	return (uint64_t)(((int64_t)v << 1) ^ ((int64_t)v >> 63));
+}
+
+// Frames are written by a wire_writer, with the room for them checked up front
+struct wire_writer {
+	char *pos;
+};
+
+static void put_varint(struct wire_writer *w, uint64_t v) {
+	while (v >= 0x80) {
+		*w->pos++ = (char)(v | 0x80);
+		v >>= 7;
+	}
+	*w->pos++ = (char)v;
+}
+
+static void put_string(struct wire_writer *w, char const *s) {
+	size_t len = s != NULL ? strlen(s) : 0;
+	put_varint(w, len);
+	memcpy(w->pos, s, len);
+	w->pos += len;
+}
+
+// frame_begin: start a frame whose fields take fields_size bytes
+//
+// Returns false if the frame does not fit in size bytes
+static bool frame_begin(struct wire_writer *w, char *buf, size_t size,
+						uint8_t code, size_t fields_size) {
+	size_t payload = 1 + fields_size;
+	if (1 + varint_size(payload) + payload > size) {
+		return false;
+	}
+	w->pos = buf;
+	*w->pos++ = (char)PROTOCOL_VERSION;
+	put_varint(w, payload);
+	*w->pos++ = (char)code;
+	return true;
+}
+
+// request_encode: write a registration or manager request frame into buf
+//
+// Returns the size of the frame, or -1 if it does not fit in size bytes
+ssize_t request_encode(char *buf, size_t size, uint8_t code,
+					   char const *pipe_path, char const *box_name,
+					   uint64_t start_seq) {
+	struct wire_writer w;
+	if (!frame_begin(&w, buf, size, code,
+					 string_size(pipe_path) + string_size(box_name) +
+						 varint_size(start_seq))) {
+		return -1;
+	}
+	put_string(&w, pipe_path);
+	put_string(&w, box_name);
+	put_varint(&w, start_seq);
+	return w.pos - buf;
+}
+
+// message_encode: write a message frame into buf
+//
+// Returns the size of the frame, or -1 if it does not fit in size bytes
+ssize_t message_encode(char *buf, size_t size, uint8_t code,
+					   char const *message, size_t len) {
+	struct wire_writer w;
+	if (!frame_begin(&w, buf, size, code, varint_size(len) + len)) {
+		return -1;
+	}
+	put_varint(&w, len);
+	memcpy(w.pos, message, len);
+	w.pos += len;
+	return w.pos - buf;
+}
+
+// message_header_encode: write into buf the start of a frame for a message of
+// len bytes, up to the message itself, which the caller sends right after it
+// (with writev, say)
+//
+// Returns the size of the header, or -1 if it does not fit in size bytes
+ssize_t message_header_encode(char *buf, size_t size, uint8_t code,
+							  size_t len) {
+	size_t payload = 1 + varint_size(len) + len;
+	if (1 + varint_size(payload) + 1 + varint_size(len) > size) {
+		return -1;
+	}
+	struct wire_writer w = {buf};
+	*w.pos++ = (char)PROTOCOL_VERSION;
+	put_varint(&w, payload);
+	*w.pos++ = (char)code;
+	put_varint(&w, len);
+	return w.pos - buf;
+}
+
+// answer_encode: write an answer frame into buf
+//
+// Returns the size of the frame, or -1 if it does not fit in size bytes
+ssize_t answer_encode(char *buf, size_t size, uint8_t code,
+					  int32_t return_code, char const *error_message) {
+	struct wire_writer w;
+	if (!frame_begin(&w, buf, size, code,
+					 varint_size(zigzag(return_code)) +
+						 string_size(error_message))) {
+		return -1;
+	}
+	put_varint(&w, zigzag(return_code));
+	put_string(&w, error_message);
+	return w.pos - buf;
+}
+
+// list_entry_encode: write a box list entry frame into buf, followed by the
+// box's stats unless stats is NULL
+//
+// Returns the size of the frame, or -1 if it does not fit in size bytes
+ssize_t list_entry_encode(char *buf, size_t size, uint8_t code, uint8_t last,
+						  char const *box_name, uint64_t box_size,
+						  uint64_t n_publishers, uint64_t n_subscribers,
+						  struct box_list_stats const *stats) {
+	size_t stats_size = 0;
+	if (stats != NULL) {
+		stats_size = varint_size(stats->messages) +
+					 varint_size(stats->bytes_per_sec_10s) +
+					 varint_size(stats->bytes_per_sec_60s) +
+					 varint_size(stats->max_lag);
+	}
+	struct wire_writer w;
+	if (!frame_begin(&w, buf, size, code,
+					 1 + string_size(box_name) + varint_size(box_size) +
+						 varint_size(n_publishers) +
+						 varint_size(n_subscribers) + stats_size)) {
+		return -1;
+	}
+	*w.pos++ = (char)last;
+	put_string(&w, box_name);
+	put_varint(&w, box_size);
+	put_varint(&w, n_publishers);
+	put_varint(&w, n_subscribers);
+	if (stats != NULL) {
+		put_varint(&w, stats->messages);
+		put_varint(&w, stats->bytes_per_sec_10s);
+		put_varint(&w, stats->bytes_per_sec_60s);
+		put_varint(&w, stats->max_lag);
+	}
+	return w.pos - buf;
+}
+
+// Fields are read by a wire_reader, which stops at the end of the frame
+struct wire_reader {
+	unsigned char const *pos;
+	unsigned char const *end;
+	bool ok;
+};
+
+// get_varint: read a varint, or mark the reader as failed
+static uint64_t get_varint(struct wire_reader *r) {
+	uint64_t v = 0;
+	for (unsigned shift = 0; r->ok && shift < 64; shift += 7) {
+		if (r->pos == r->end) {
+			break;
+		}
+		unsigned char byte = *r->pos++;
+		v |= (uint64_t)(byte & 0x7f) << shift;
+		if ((byte & 0x80) == 0) {
+			return v;
+		}
+	}
+	r->ok = false;
+	return 0;
+}
+
+static uint8_t get_byte(struct wire_reader *r) {
+	if (!r->ok || r->pos == r->end) {
+		r->ok = false;
+		return 0;
+	}
+	return *r->pos++;
+}
+
+static struct wire_string get_string(struct wire_reader *r) {
+	struct wire_string s = {NULL, 0};
+	uint64_t len = get_varint(r);
+	if (!r->ok || len > (uint64_t)(r->end - r->pos)) {
+		r->ok = false;
+		return s;
+	}
+	s.data = (char const *)r->pos;
+	s.length = (size_t)len;
+	r->pos += len;
+	return s;
+}
+
+// varint_peek: read a varint from the start of a buffer, without failing on
+// a truncated one
+//
+// Returns its size, 0 if the buffer ends first, or -1 if it is too long
+static ssize_t varint_peek(char const *buf, size_t len, uint64_t *v) {
+	*v = 0;
+	for (size_t i = 0; i < VARINT_MAX_SIZE; i++) {
+		if (i == len) {
+			return 0;
+		}
+		unsigned char byte = (unsigned char)buf[i];
+		*v |= (uint64_t)(byte & 0x7f) << (7 * i);
+		if ((byte & 0x80) == 0) {
+			return (ssize_t)i + 1;
+		}
+	}
+	return -1;
+}
+
+// frame_size: size of the frame at the start of buf, which only needs to hold
+// the version byte and the length
+//
+// Returns the size of the frame, 0 if the buffer does not hold the length
+// yet, or -1 if it is not a frame of this protocol version
+ssize_t frame_size(char const *buf, size_t len) {
+	if (len == 0) {
+		return 0;
+	}
+	if ((uint8_t)buf[0] != PROTOCOL_VERSION) {
+		return -1;
+	}
+
+	uint64_t payload;
+	ssize_t n = varint_peek(buf + 1, len - 1, &payload);
+	if (n <= 0) {
+		return n;
+	}
+	size_t frame_len = 1 + (size_t)n + (size_t)payload;
+	if (payload == 0 || frame_len > FRAME_MAX_SIZE) {
+		return -1;
+	}
+	return (ssize_t)frame_len;
+}
+
+// frame_length: size of the frame at the start of buf
+//
+// Returns the size of the frame, 0 if the buffer does not hold the whole
+// frame yet, or -1 if it is not a frame of this protocol version
+ssize_t frame_length(char const *buf, size_t len) {
+	ssize_t frame_len = frame_size(buf, len);
+	if (frame_len > 0 && len < (size_t)frame_len) {
+		return 0;
+	}
+	return frame_len;
+}
+
+// frame_open: start reading the fields of the frame at the start of buf
+//
+// Returns the size of the frame, 0 if the buffer does not hold the whole
+// frame yet, or -1 if it is invalid
+static ssize_t frame_open(char const *buf, size_t len, struct wire_reader *r,
+						  uint8_t *code) {
+	ssize_t frame_len = frame_length(buf, len);
+	if (frame_len <= 0) {
+		return frame_len;
+	}
+
+	uint64_t payload;
+	ssize_t n = varint_peek(buf + 1, len - 1, &payload);
+	r->pos = (unsigned char const *)buf + 1 + n;
+	r->end = (unsigned char const *)buf + frame_len;
+	r->ok = true;
+	*code = get_byte(r);
+	return frame_len;
+}
+
+// request_decode: decode the request frame at the start of buf
+//
+// Returns the size of the frame, 0 if the buffer does not hold the whole
+// frame yet, or -1 if it is invalid
+ssize_t request_decode(char const *buf, size_t len,
+					   struct wire_request *request) {
+	struct wire_reader r;
+	ssize_t frame_len = frame_open(buf, len, &r, &request->code);
+	if (frame_len <= 0) {
+		return frame_len;
+	}
+	request->client_named_pipe_path = get_string(&r);
+	request->box_name = get_string(&r);
+	request->start_seq = get_varint(&r);
+	return r.ok ? frame_len : -1;
+}
+
+// message_decode: decode the message frame at the start of buf
+//
+// Returns the size of the frame, 0 if the buffer does not hold the whole
+// frame yet, or -1 if it is invalid
+ssize_t message_decode(char const *buf, size_t len,
+					   struct wire_message *message) {
+	struct wire_reader r;
+	ssize_t frame_len = frame_open(buf, len, &r, &message->code);
+	if (frame_len <= 0) {
+		return frame_len;
+	}
+	message->message = get_string(&r);
+	return r.ok ? frame_len : -1;
+}
+
+// answer_decode: decode the answer frame at the start of buf
+//
+// Returns the size of the frame, 0 if the buffer does not hold the whole
+// frame yet, or -1 if it is invalid
+ssize_t answer_decode(char const *buf, size_t len, struct wire_answer *answer) {
+	struct wire_reader r;
+	ssize_t frame_len = frame_open(buf, len, &r, &answer->code);
+	if (frame_len <= 0) {
+		return frame_len;
+	}
+	uint64_t zz = get_varint(&r);
+	answer->return_code = (int32_t)((zz >> 1) ^ (~(zz & 1) + 1));
+	answer->error_message = get_string(&r);
+	return r.ok ? frame_len : -1;
+}
+
+// list_entry_decode: decode the box list entry frame at the start of buf
+//
+// Returns the size of the frame, 0 if the buffer does not hold the whole
+// frame yet, or -1 if it is invalid
+ssize_t list_entry_decode(char const *buf, size_t len,
+						  struct wire_list_entry *entry) {
+	struct wire_reader r;
+	ssize_t frame_len = frame_open(buf, len, &r, &entry->code);
+	if (frame_len <= 0) {
+		return frame_len;
+	}
+	entry->last = get_byte(&r);
+	entry->box_name = get_string(&r);
+	entry->box_size = get_varint(&r);
+	entry->n_publishers = get_varint(&r);
+	entry->n_subscribers = get_varint(&r);
+	memset(&entry->stats, 0, sizeof(entry->stats));
+	if (r.ok && r.pos != r.end) {
+		entry->stats.messages = get_varint(&r);
+		entry->stats.bytes_per_sec_10s = get_varint(&r);
+		entry->stats.bytes_per_sec_60s = get_varint(&r);
+		entry->stats.max_lag = get_varint(&r);
+	}
+	return r.ok ? frame_len : -1;
+}
+
+void frame_reader_init(struct frame_reader *reader, int fd) {
+	reader->fd = fd;
+	reader->len = 0;
+	reader->pos = 0;
+}
+
+// frame_reader_next: wait for the next frame from the fifo
+//
+// The frame stays valid until the next call.
+// Returns the size of the frame, 0 at end of file, or -1 on error or on an
+// invalid frame
+ssize_t frame_reader_next(struct frame_reader *reader, char const **frame) {
+	while (true) {
+		ssize_t frame_len = frame_length(reader->buffer + reader->pos,
+										 reader->len - reader->pos);
+		if (frame_len < 0) {
+			return -1;
+		} else if (frame_len > 0) {
+			*frame = reader->buffer + reader->pos;
+			reader->pos += (size_t)frame_len;
+			return frame_len;
+		}
+
+		// Keep the incomplete frame and read the rest of it
+		memmove(reader->buffer, reader->buffer + reader->pos,
+				reader->len - reader->pos);
+		reader->len -= reader->pos;
+		reader->pos = 0;
+		ssize_t n = read(reader->fd, reader->buffer + reader->len,
+						 sizeof(reader->buffer) - reader->len);
+		if (n <= 0) {
+			return n;
+		}
+		reader->len += (size_t)n;
+	}
+}
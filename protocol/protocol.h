@@ -1,7 +1,63 @@
 #ifndef __PROTOCOL_H__
 #define __PROTOCOL_H__
 
+#include <limits.h>
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
+#include <sys/types.h>
+
+#define PUBLISHER_MESSAGE_CODE 9
+#define SUBSCRIBER_MESSAGE_CODE 10
+#define PUBLISHER_BATCH_CODE 11
+
+// Mapped fan-out: instead of copies of its messages, the subscriber gets the
+// name of a shared-memory segment mirroring the box, followed by updates with
+// the offset up to which the segment holds published messages
+#define SUBSCRIBER_MAPPED_REGISTER_CODE 12
+#define SEGMENT_INFO_CODE 13
+#define SEGMENT_UPDATE_CODE 14
+
+// Stats: the broker answers with one JSON object per message frame, and
+// closes the fifo after the last one
+#define STATS_REQUEST_CODE 15
+#define STATS_ANSWER_CODE 16
+
+// Longest message a box holds; longer lines are split by the publisher
+#define MESSAGE_MAX_LENGTH 1023
+
+// Where a subscriber starts reading its box: start_seq in its request is the
+// sequence number of the first message it wants, with these two special values
+#define START_EARLIEST 0
+#define START_LATEST UINT64_MAX
+
+// Batches are sent with a single write, so they must fit in PIPE_BUF to stay
+// atomic
+#define BATCH_MAX_SIZE PIPE_BUF
+
+// Compact wire format. A frame is PROTOCOL_VERSION, the length of the rest of
+// the frame as a varint, the code and then the fields, with no padding:
+// integers are varints (LEB128, zigzag-encoded if signed) and strings are a
+// varint length followed by the bytes, without terminator.
+//
+// The fixed-size packed structs below are the version 1 format, which the
+// broker still accepts from old clients: their frames start with their code,
+// which is always below PROTOCOL_VERSION, and are answered in kind. Their
+// layout is fixed, so anything new (such as a subscriber's start_seq) is only
+// carried by version 2 frames, and version 1 subscribers start at the
+// earliest message.
+#define PROTOCOL_VERSION 0x82
+#define VARINT_MAX_SIZE 10
+
+// Largest frame: a message (or error message) of MESSAGE_MAX_LENGTH bytes.
+// Frames are written whole, so they must fit in PIPE_BUF to stay atomic.
+#define FRAME_MAX_SIZE (3 + 2 * VARINT_MAX_SIZE + MESSAGE_MAX_LENGTH + 1)
+
+// Largest message frame header: everything but the message bytes
+#define MESSAGE_HEADER_MAX_SIZE (3 + 2 * VARINT_MAX_SIZE)
+
+// How much of a fifo a frame_reader reads at once
+#define FRAME_READ_SIZE (4 * PIPE_BUF)
 
 struct __attribute__((__packed__)) basic_request {
 	uint8_t code;
@@ -14,12 +70,48 @@ struct __attribute__((__packed__)) message {
 	char message[1024];
 };
 
+_Static_assert(FRAME_MAX_SIZE >= sizeof(struct message),
+			   "a frame buffer must also hold a version 1 message");
+
 struct __attribute__((__packed__)) box_answer {
 	uint8_t code;
 	int32_t return_code;
 	char error_message[1024];
 };
 
+_Static_assert(sizeof(struct basic_request) == 289,
+			   "version 1 requests are 289 bytes");
+_Static_assert(sizeof(struct message) == 1025,
+			   "version 1 messages are 1025 bytes");
+_Static_assert(sizeof(struct box_answer) == 1029,
+			   "version 1 answers are 1029 bytes");
+
+// Publisher batch: a header followed by `length` bytes of records, each one a
+// uint16_t message length followed by the message (without terminator)
+struct __attribute__((__packed__)) batch_header {
+	uint8_t code;
+	uint16_t length;
+};
+
+// Boxes are logs of records, each one this header followed by the message
+// (without terminator). Sequence numbers start at 0 and have no gaps.
+struct __attribute__((__packed__)) box_record {
+	uint64_t seq;
+	uint16_t length;
+};
+
+struct __attribute__((__packed__)) segment_info {
+	uint8_t code;
+	char segment_name[64];
+	uint64_t segment_size;
+	uint64_t start; // offset of the subscriber's first record
+};
+
+struct __attribute__((__packed__)) segment_update {
+	uint8_t code;
+	uint64_t end;
+};
+
 struct __attribute__((__packed__)) box_list_entry {
 	uint8_t code;
 	uint8_t last;
@@ -29,6 +121,61 @@ struct __attribute__((__packed__)) box_list_entry {
 	uint64_t n_subscribers;
 };
 
+_Static_assert(sizeof(struct box_list_entry) == 58,
+			   "version 1 list entries are 58 bytes");
+
+// Throughput and backlog of a box, sent after the other list entry fields in
+// version 2 frames only. Rates are averages over the last 10 and 60 seconds;
+// lag is how many messages the slowest subscriber has yet to be sent.
+struct box_list_stats {
+	uint64_t messages;
+	uint64_t bytes_per_sec_10s;
+	uint64_t bytes_per_sec_60s;
+	uint64_t max_lag;
+};
+
+// Decoded frames point into the buffer they were decoded from
+struct wire_string {
+	char const *data;
+	size_t length;
+};
+
+struct wire_request {
+	uint8_t code;
+	struct wire_string client_named_pipe_path;
+	struct wire_string box_name;
+	uint64_t start_seq;
+};
+
+struct wire_message {
+	uint8_t code;
+	struct wire_string message;
+};
+
+struct wire_answer {
+	uint8_t code;
+	int32_t return_code;
+	struct wire_string error_message;
+};
+
+struct wire_list_entry {
+	uint8_t code;
+	uint8_t last;
+	struct wire_string box_name;
+	uint64_t box_size;
+	uint64_t n_publishers;
+	uint64_t n_subscribers;
+	struct box_list_stats stats; // all 0 if the broker sent none
+};
+
+// Buffered reader of the frames coming through a fifo
+struct frame_reader {
+	int fd;
+	size_t len;
+	size_t pos;
+	char buffer[FRAME_READ_SIZE];
+};
+
 struct basic_request basic_request_init(uint8_t code, char const *pipe_path,
 										char const *box_name);
 struct message message_init(uint8_t code, char const *message);
@@ -39,5 +186,42 @@ struct box_list_entry box_list_entry_init(uint8_t code, uint8_t last,
 										  uint64_t box_size,
 										  uint64_t n_publishers,
 										  uint64_t n_subscribers);
+struct segment_info segment_info_init(char const *segment_name,
+									  uint64_t segment_size, uint64_t start);
+struct segment_update segment_update_init(uint64_t end);
+
+ssize_t request_encode(char *buf, size_t size, uint8_t code,
+					   char const *pipe_path, char const *box_name,
+					   uint64_t start_seq);
+ssize_t message_encode(char *buf, size_t size, uint8_t code,
+					   char const *message, size_t len);
+ssize_t message_header_encode(char *buf, size_t size, uint8_t code,
+							  size_t len);
+ssize_t answer_encode(char *buf, size_t size, uint8_t code,
+					  int32_t return_code, char const *error_message);
+ssize_t list_entry_encode(char *buf, size_t size, uint8_t code, uint8_t last,
+						  char const *box_name, uint64_t box_size,
+						  uint64_t n_publishers, uint64_t n_subscribers,
+						  struct box_list_stats const *stats);
+
+ssize_t frame_size(char const *buf, size_t len);
+ssize_t frame_length(char const *buf, size_t len);
+ssize_t request_decode(char const *buf, size_t len,
+					   struct wire_request *request);
+ssize_t message_decode(char const *buf, size_t len,
+					   struct wire_message *message);
+ssize_t answer_decode(char const *buf, size_t len, struct wire_answer *answer);
+ssize_t list_entry_decode(char const *buf, size_t len,
+						  struct wire_list_entry *entry);
+
+void frame_reader_init(struct frame_reader *reader, int fd);
+ssize_t frame_reader_next(struct frame_reader *reader, char const **frame);
+
+void batch_init(char *batch, size_t *batch_len);
+int batch_append(char *batch, size_t *batch_len, char const *message,
+				 size_t len);
+void batch_finish(char *batch, size_t batch_len);
+ssize_t publisher_frame_decode(char const *frame, size_t len, char *out,
+							   size_t *out_len);
 
 #endif
\ No newline at end of file
@@ -2,17 +2,20 @@
 #include "protocol.h"
 #include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <signal.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
 #define BUFFER_SIZE 1024
 #define PUBLISHER_REGISTER_CODE 1
-#define PUBLISHER_MESSAGE_CODE 9
+// How long a message may wait in a batch before it is sent anyway
+#define BATCH_FLUSH_MS 5
 
 int pipenum = -1;
 
@@ -44,8 +47,15 @@ int send_request(const char *server_pipe, struct basic_request request) {
 		return -1; // failed to open pipe
 	}
 
-	ssize_t ret = write(server, &request, sizeof(request));
+	char frame[FRAME_MAX_SIZE];
+	ssize_t ret = request_encode(frame, sizeof(frame), request.code,
+								 request.client_named_pipe_path,
+								 request.box_name, START_EARLIEST);
+	if (ret > 0) {
+		ret = write(server, frame, (size_t)ret);
+	}
 	if (ret < 0) {
+		close(server);
 		return -1;
 	}
 
@@ -54,6 +64,45 @@ int send_request(const char *server_pipe, struct basic_request request) {
 	return 0;
 }
 
+long ms_since(struct timespec const *start) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1000 +
+		   (now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+int flush_batch(char *batch, size_t *batch_len) {
+	if (*batch_len == sizeof(struct batch_header)) {
+		return 0; // nothing to send
+	}
+
+	batch_finish(batch, *batch_len);
+	ssize_t n = write(pipenum, batch, *batch_len);
+	batch_init(batch, batch_len);
+	return n < 0 ? -1 : 0;
+}
+
+int queue_message(char *batch, size_t *batch_len, struct timespec *queued_at,
+				  char const *message, size_t len) {
+	if (len == 0) {
+		return 0; // empty lines are never delivered
+	}
+
+	if (*batch_len == sizeof(struct batch_header)) {
+		clock_gettime(CLOCK_MONOTONIC, queued_at);
+	}
+	if (batch_append(batch, batch_len, message, len) == 0) {
+		return 0;
+	}
+
+	// batch is full, send it and start a new one with this message
+	if (flush_batch(batch, batch_len) == -1) {
+		return -1;
+	}
+	clock_gettime(CLOCK_MONOTONIC, queued_at);
+	return batch_append(batch, batch_len, message, len);
+}
+
 int publish_message(const char *server_pipe, const char *pipe_name,
 					const char *box_name) {
 	struct basic_request request =
@@ -62,11 +111,13 @@ int publish_message(const char *server_pipe, const char *pipe_name,
 	signal(SIGPIPE, handle);
 	signal(SIGINT, handle);
 
-	if (send_request(server_pipe, request) == -1) {
+	// the session fifo must exist before the broker gets the request
+	if (new_pipe(pipe_name) == -1) {
 		return -1;
 	}
 
-	if (new_pipe(pipe_name) == -1) {
+	if (send_request(server_pipe, request) == -1) {
+		unlink(pipe_name);
 		return -1;
 	}
 
@@ -76,26 +127,75 @@ int publish_message(const char *server_pipe, const char *pipe_name,
 		return -1; // failed to open pipe
 	}
 
+	// Messages are gathered into batches that go out with a single write,
+	// either when full or once the oldest message has waited BATCH_FLUSH_MS
+	char batch[BATCH_MAX_SIZE];
+	size_t batch_len;
+	batch_init(batch, &batch_len);
+	struct timespec queued_at = {0, 0};
+
+	char line[BUFFER_SIZE];
+	size_t line_len = 0;
 	while (true) {
-		char buffer[BUFFER_SIZE];
-		memset(buffer, 0, BUFFER_SIZE);
-
-		while (fgets(buffer, BUFFER_SIZE - 1, stdin) != NULL) {
-			buffer[BUFFER_SIZE - 1] = '\0'; // FIXME: buffer sizes
-			struct message msg = message_init(PUBLISHER_MESSAGE_CODE, buffer);
-			ssize_t n = write(pipenum, &msg, sizeof(msg));
-			if (n < 0) {
-				close(pipenum);
-				unlink(pipe_name);
-				return -1;
+		int timeout = -1;
+		if (batch_len > sizeof(struct batch_header)) {
+			long waited = ms_since(&queued_at);
+			timeout = waited >= BATCH_FLUSH_MS
+						  ? 0
+						  : (int)(BATCH_FLUSH_MS - waited);
+		}
+
+		struct pollfd in = {.fd = STDIN_FILENO, .events = POLLIN};
+		int ready = poll(&in, 1, timeout);
+		if (ready == -1 && errno == EINTR) {
+			continue;
+		} else if (ready == -1) {
+			break;
+		} else if (ready == 0) {
+			if (flush_batch(batch, &batch_len) == -1) {
+				break;
+			}
+			continue;
+		}
+
+		char chunk[BUFFER_SIZE];
+		ssize_t n = read(STDIN_FILENO, chunk, sizeof(chunk));
+		if (n == -1 && errno == EINTR) {
+			continue;
+		} else if (n == -1) {
+			break;
+		} else if (n == 0) {
+			// end of input: send the last line, even without a newline
+			if (queue_message(batch, &batch_len, &queued_at, line,
+							  line_len) == -1 ||
+				flush_batch(batch, &batch_len) == -1) {
+				break;
+			}
+			close(pipenum);
+			unlink(pipe_name);
+			return 0;
+		}
+
+		for (size_t i = 0; i < (size_t)n; i++) {
+			if (chunk[i] != '\n') {
+				line[line_len++] = chunk[i];
+			}
+			// longer lines are split into several messages
+			if (chunk[i] == '\n' || line_len == BUFFER_SIZE - 1) {
+				if (queue_message(batch, &batch_len, &queued_at, line,
+								  line_len) == -1) {
+					close(pipenum);
+					unlink(pipe_name);
+					return -1;
+				}
+				line_len = 0;
 			}
 		}
 	}
 
-	// desnecessario?
 	close(pipenum);
 	unlink(pipe_name);
-	return 0;
+	return -1;
 }
 
 int main(int argc, char **argv) {
@@ -5,13 +5,18 @@
 #include <signal.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 
 #define BUFFER_SIZE 128
 
+// Most segment updates a mapped subscriber reads at once
+#define UPDATES_PER_READ 64
+
 #define SUBSCRIBER_REGISTER_CODE 2
 
 int count = 0;
@@ -40,14 +45,22 @@ int new_pipe(const char *pipe_name) {
 	return 0;
 }
 
-int send_request(const char *server_pipe, struct basic_request request) {
+int send_request(const char *server_pipe, struct basic_request request,
+				 uint64_t start_seq) {
 	int server = open(server_pipe, O_WRONLY);
 	if (server == -1) {
 		return -1; // failed to open pipe
 	}
 
-	ssize_t ret = write(server, &request, sizeof(request));
+	char frame[FRAME_MAX_SIZE];
+	ssize_t ret = request_encode(frame, sizeof(frame), request.code,
+								 request.client_named_pipe_path,
+								 request.box_name, start_seq);
+	if (ret > 0) {
+		ret = write(server, frame, (size_t)ret);
+	}
 	if (ret < 0) {
+		close(server);
 		return -1;
 	}
 
@@ -56,17 +69,93 @@ int send_request(const char *server_pipe, struct basic_request request) {
 	return 0;
 }
 
-int subscribe_box(const char *server_pipe, const char *pipe_name,
-				  const char *box_name) {
-	struct basic_request request = basic_request_init(SUBSCRIBER_REGISTER_CODE, pipe_name, box_name);
+// Mapped fan-out: prints the messages straight from the box segment, up to
+// the offset given by each update
+int read_mapped_box(uint64_t min_seq) {
+	struct segment_info info;
+	ssize_t n = read(pipenum, &info, sizeof(info));
+	if (n != sizeof(info) || info.code != SEGMENT_INFO_CODE) {
+		return -1; // no segment for this box
+	}
+
+	int fd = shm_open(info.segment_name, O_RDONLY, 0);
+	if (fd == -1) {
+		return -1; // failed to open segment
+	}
+	char const *segment =
+		mmap(NULL, info.segment_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (segment == MAP_FAILED) {
+		return -1; // failed to map segment
+	}
 
-	signal(SIGINT, handle);
+	// Updates pile up while messages are printed: every one read at once is
+	// handled by printing up to the last
+	struct segment_update updates[UPDATES_PER_READ];
+	size_t len = 0;
+	uint64_t pos = info.start; // first record not printed yet
+	while (true) {
+		n = read(pipenum, (char *)updates + len, sizeof(updates) - len);
+		if (n <= 0) {
+			break; // broker is gone
+		}
+		len += (size_t)n;
+		size_t read_updates = len / sizeof(struct segment_update);
+		if (read_updates == 0) {
+			continue; // rest of the update not read yet
+		}
+
+		uint64_t end = pos;
+		bool valid = true;
+		for (size_t i = 0; i < read_updates; i++) {
+			if (updates[i].code != SEGMENT_UPDATE_CODE ||
+				updates[i].end > info.segment_size) {
+				valid = false;
+			} else if (updates[i].end > end) {
+				end = updates[i].end;
+			}
+		}
+		if (!valid) {
+			break;
+		}
+		len -= read_updates * sizeof(struct segment_update);
+		memmove(updates, updates + read_updates, len);
+
+		while (pos + sizeof(struct box_record) <= end) {
+			struct box_record record;
+			memcpy(&record, segment + pos, sizeof(record));
+			pos += sizeof(record);
+			if (record.seq >= min_seq) {
+				count++;
+				fwrite(segment + pos, 1, record.length, stdout);
+				fputc('\n', stdout);
+			}
+			pos += record.length;
+		}
+	}
+
+	munmap((void *)segment, info.segment_size);
+	return -1;
+}
+
+int subscribe_box(const char *server_pipe, const char *pipe_name,
+				  const char *box_name, bool mapped, uint64_t start_seq) {
+	struct basic_request request = basic_request_init(
+		mapped ? SUBSCRIBER_MAPPED_REGISTER_CODE : SUBSCRIBER_REGISTER_CODE,
+		pipe_name, box_name);
+
+	// not signal(), which under strict C17 resets the handler when it runs, so
+	// a second SIGINT while the count is printed would kill the subscriber
+	struct sigaction action;
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = handle;
+	sigaction(SIGINT, &action, NULL);
 
 	if (new_pipe(pipe_name) == -1) {
 		return -1;
 	}
 
-	if (send_request(server_pipe, request) == -1) {
+	if (send_request(server_pipe, request, start_seq) == -1) {
 		return -1;
 	}
 
@@ -76,27 +165,68 @@ int subscribe_box(const char *server_pipe, const char *pipe_name,
 		return -1; // failed to open pipe
 	}
 
+	if (mapped) {
+		// a future start_seq is reached by skipping the records before it
+		int ret = read_mapped_box(start_seq == START_LATEST ? 0 : start_seq);
+		close(pipenum);
+		unlink(pipe_name);
+		return ret;
+	}
+
+	struct frame_reader *reader = malloc(sizeof(struct frame_reader));
+	frame_reader_init(reader, pipenum);
 	while (true) {
-		struct message buffer;
-		ssize_t n = read(pipenum, &buffer, sizeof(buffer));
-		if (n == -1) {
+		char const *frame;
+		struct wire_message msg;
+		ssize_t n = frame_reader_next(reader, &frame);
+		if (n == -1 || (n > 0 && message_decode(frame, (size_t)n, &msg) < 0)) {
 			// n == -1 indicates error
+			free(reader);
 			return -1;
-		} else if (n != 0) {
-			count++;
-			fprintf(stdout, "%s\n", buffer.message);
+		} else if (n == 0) {
+			break; // box removed, or broker gone
 		}
+		count++;
+		fprintf(stdout, "%.*s\n", (int)msg.message.length, msg.message.data);
 	}
 
+	free(reader);
 	close(pipenum);
 	unlink(pipe_name);
 	return 0;
 }
 
 int main(int argc, char **argv) {
+	bool mapped = false;
+	uint64_t start_seq = START_EARLIEST;
+	int opt;
+	while ((opt = getopt(argc, argv, "ms:")) != -1) {
+		switch (opt) {
+			case 'm':
+				// read the box from shared memory instead of message copies
+				mapped = true;
+				break;
+			case 's':
+				// first message wanted: earliest, latest or a sequence number
+				if (strcmp(optarg, "earliest") == 0) {
+					start_seq = START_EARLIEST;
+				} else if (strcmp(optarg, "latest") == 0) {
+					start_seq = START_LATEST;
+				} else {
+					start_seq = strtoull(optarg, NULL, 10);
+				}
+				break;
+			default:
+				break;
+		}
+	}
+	argc -= optind - 1;
+	argv += optind - 1;
+
 	if (argc == 4)
-		return subscribe_box(argv[1], argv[2], argv[3]);
-	fprintf(stderr, "usage: sub <register_pipe_name> <pipe_name> <box_name>\n");
+		return subscribe_box(argv[1], argv[2], argv[3], mapped, start_seq);
+	fprintf(stderr, "usage: sub [-m] [-s earliest|latest|<seq>] "
+					"<register_pipe_name> <pipe_name> <box_name>\n");
 
 	return -1;
 }
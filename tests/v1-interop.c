@@ -0,0 +1,274 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+// Version 1 interop check: starts mbroker/mbroker and talks to it the way the
+// original clients did, with the fixed-size structs below (their own copy, so
+// that a change to protocol.h cannot move them along with the broker). Every
+// request is a 289-byte struct, and every answer must come back whole in the
+// original shapes: 1029-byte box answers, 58-byte list entries and 1025-byte
+// messages.
+//
+// usage: v1-interop [-- mbroker options]
+//
+// Must be run from the root of the project. Prints one line per check, and
+// exits with a failure status at the first one that fails.
+
+#define BROKER_PATH "mbroker/mbroker"
+
+// Give up on the broker after this long
+#define TIMEOUT_S 10
+
+struct __attribute__((__packed__)) v1_request {
+	uint8_t code;
+	char client_named_pipe_path[256];
+	char box_name[32];
+};
+
+struct __attribute__((__packed__)) v1_message {
+	uint8_t code;
+	char message[1024];
+};
+
+struct __attribute__((__packed__)) v1_answer {
+	uint8_t code;
+	int32_t return_code;
+	char error_message[1024];
+};
+
+struct __attribute__((__packed__)) v1_list_entry {
+	uint8_t code;
+	uint8_t last;
+	char box_name[32];
+	uint64_t box_size;
+	uint64_t n_publishers;
+	uint64_t n_subscribers;
+};
+
+_Static_assert(sizeof(struct v1_request) == 289, "");
+_Static_assert(sizeof(struct v1_message) == 1025, "");
+_Static_assert(sizeof(struct v1_answer) == 1029, "");
+_Static_assert(sizeof(struct v1_list_entry) == 58, "");
+
+#define MESSAGES 3
+
+static char dir[64];
+static char server_pipe[128];
+static int server_fd = -1;
+static pid_t broker_pid = -1;
+
+static void fail(char const *what) {
+	fprintf(stderr, "v1-interop: %s\n", what);
+	if (broker_pid > 0) {
+		kill(broker_pid, SIGKILL);
+	}
+	exit(EXIT_FAILURE);
+}
+
+static void on_alarm(int sig) {
+	(void)sig;
+	fail("timed out waiting for the broker");
+}
+
+// Sends a request to the broker, after creating the client's fifo
+static void send_request(uint8_t code, char const *fifo,
+						 char const *box_name) {
+	struct v1_request request;
+	memset(&request, 0, sizeof(request));
+	request.code = code;
+	snprintf(request.client_named_pipe_path,
+			 sizeof(request.client_named_pipe_path), "%s/%s", dir, fifo);
+	strncpy(request.box_name, box_name, sizeof(request.box_name) - 1);
+
+	unlink(request.client_named_pipe_path);
+	if (mkfifo(request.client_named_pipe_path, 0640) != 0) {
+		fail("failed to create a client fifo");
+	}
+	if (write(server_fd, &request, sizeof(request)) != sizeof(request)) {
+		fail("failed to send a request");
+	}
+}
+
+static int open_fifo(char const *fifo, int flags) {
+	char path[128];
+	snprintf(path, sizeof(path), "%s/%s", dir, fifo);
+	int fd = open(path, flags);
+	if (fd == -1) {
+		fail("failed to open a client fifo");
+	}
+	return fd;
+}
+
+// Reads everything the broker writes to the fifo until it closes it.
+// Returns the number of bytes read.
+static size_t read_all(int fd, void *buf, size_t size) {
+	size_t len = 0;
+	ssize_t n;
+	while ((n = read(fd, (char *)buf + len, size - len)) != 0) {
+		if (n < 0 && errno != EINTR) {
+			fail("failed to read a client fifo");
+		} else if (n > 0) {
+			len += (size_t)n;
+		}
+		if (len == size) {
+			char extra;
+			if (read(fd, &extra, 1) > 0) {
+				fail("the broker sent more than a version 1 answer");
+			}
+			break;
+		}
+	}
+	return len;
+}
+
+// Sends a box request and checks its answer is a whole version 1 answer.
+// Returns the answer's return code.
+static int32_t box_request(uint8_t code, char const *box_name,
+						   char const *what) {
+	send_request(code, "manager", box_name);
+	int fd = open_fifo("manager", O_RDONLY);
+	struct v1_answer answer;
+	size_t len = read_all(fd, &answer, sizeof(answer));
+	close(fd);
+	if (len != sizeof(answer) || answer.code != code + 1) {
+		fprintf(stderr, "v1-interop: %s: got %zu bytes, code %d\n", what,
+				len, len > 0 ? answer.code : -1);
+		fail("not a version 1 box answer");
+	}
+	printf("ok %s: %zu-byte answer, return code %d\n", what, len,
+		   answer.return_code);
+	return answer.return_code;
+}
+
+static void check_list(void) {
+	send_request(7, "manager", "");
+	int fd = open_fifo("manager", O_RDONLY);
+	struct v1_list_entry entry;
+	size_t len = read_all(fd, &entry, sizeof(entry));
+	close(fd);
+	if (len != sizeof(entry) || entry.code != 8 || entry.last != 1 ||
+		strcmp(entry.box_name, "interop") != 0) {
+		fail("list: not a single version 1 list entry for the box");
+	}
+	printf("ok list: %zu-byte entry for %s\n", len, entry.box_name);
+}
+
+static void check_publish(void) {
+	send_request(1, "publisher", "interop");
+	int fd = open_fifo("publisher", O_WRONLY);
+	for (int i = 0; i < MESSAGES; i++) {
+		struct v1_message message;
+		memset(&message, 0, sizeof(message));
+		message.code = 9;
+		snprintf(message.message, sizeof(message.message), "message %d", i);
+		if (write(fd, &message, sizeof(message)) != sizeof(message)) {
+			fail("publish: failed to write a message");
+		}
+	}
+	close(fd);
+	printf("ok publish: %d %zu-byte messages\n", MESSAGES,
+		   sizeof(struct v1_message));
+}
+
+static void check_subscribe(void) {
+	send_request(2, "subscriber", "interop");
+	int fd = open_fifo("subscriber", O_RDONLY);
+	for (int i = 0; i < MESSAGES; i++) {
+		struct v1_message message;
+		size_t len = 0;
+		while (len < sizeof(message)) {
+			ssize_t n = read(fd, (char *)&message + len, sizeof(message) - len);
+			if (n <= 0) {
+				fail("subscribe: the broker closed the fifo");
+			}
+			len += (size_t)n;
+		}
+		char want[32];
+		snprintf(want, sizeof(want), "message %d", i);
+		if (message.code != 10 || strcmp(message.message, want) != 0) {
+			fail("subscribe: not the version 1 message published");
+		}
+	}
+	close(fd);
+	printf("ok subscribe: %d %zu-byte messages, in order\n", MESSAGES,
+		   sizeof(struct v1_message));
+}
+
+static void start_broker(char **options, int option_count) {
+	char *args[option_count + 4];
+	args[0] = BROKER_PATH;
+	for (int i = 0; i < option_count; i++) {
+		args[i + 1] = options[i];
+	}
+	args[option_count + 1] = server_pipe;
+	args[option_count + 2] = "4";
+	args[option_count + 3] = NULL;
+
+	broker_pid = fork();
+	if (broker_pid == -1) {
+		fail("failed to start the broker");
+	} else if (broker_pid == 0) {
+		execv(BROKER_PATH, args);
+		_exit(EXIT_FAILURE);
+	}
+
+	for (int tries = 0; tries < 200; tries++) {
+		server_fd = open(server_pipe, O_WRONLY | O_NONBLOCK);
+		if (server_fd != -1) {
+			break;
+		}
+		struct timespec ts = {0, 10000000};
+		nanosleep(&ts, NULL);
+	}
+	if (server_fd == -1) {
+		fail("the broker did not start");
+	}
+	fcntl(server_fd, F_SETFL, fcntl(server_fd, F_GETFL) & ~O_NONBLOCK);
+}
+
+int main(int argc, char **argv) {
+	int first_option = argc > 1 && strcmp(argv[1], "--") == 0 ? 2 : 1;
+
+	snprintf(dir, sizeof(dir), "/tmp/v1-interop-%d", (int)getpid());
+	snprintf(server_pipe, sizeof(server_pipe), "%s/server", dir);
+	if (mkdir(dir, 0750) != 0) {
+		fail("failed to create the fifo directory");
+	}
+	signal(SIGPIPE, SIG_IGN);
+	signal(SIGALRM, on_alarm);
+	alarm(TIMEOUT_S);
+	start_broker(argv + first_option, argc - first_option);
+
+	if (box_request(3, "interop", "create") != 0) {
+		fail("create: the box was not created");
+	}
+	if (box_request(3, "interop", "create again") != -1) {
+		fail("create again: a duplicate box was created");
+	}
+	check_list();
+	check_publish();
+	check_subscribe();
+	if (box_request(5, "interop", "remove") != 0) {
+		fail("remove: the box was not removed");
+	}
+
+	kill(broker_pid, SIGKILL);
+	waitpid(broker_pid, NULL, 0);
+	char const *fifos[] = {"server", "manager", "publisher", "subscriber"};
+	for (size_t i = 0; i < sizeof(fifos) / sizeof(fifos[0]); i++) {
+		char path[128];
+		snprintf(path, sizeof(path), "%s/%s", dir, fifos[i]);
+		unlink(path);
+	}
+	rmdir(dir);
+	return EXIT_SUCCESS;
+}
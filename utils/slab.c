@@ -0,0 +1,181 @@
+#include "slab.h"
+#include <stdalign.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+// A thread's cache of free objects
+typedef struct {
+	slab_t *c_slab;
+	size_t c_count;
+	void *c_objects[SLAB_CACHE_SIZE];
+} slab_cache_t;
+
+// Chunks start with this, followed by their objects
+typedef struct chunk {
+	struct chunk *next;
+	alignas(max_align_t) char objects[];
+} chunk_t;
+
+// Free objects are linked through their first bytes
+typedef struct free_object {
+	struct free_object *next;
+} free_object_t;
+
+// Moves count objects from the cache to the shared free list. Called with
+// s_lock held.
+static void cache_spill(slab_cache_t *cache, size_t count) {
+	slab_t *slab = cache->c_slab;
+	for (size_t i = 0; i < count; i++) {
+		free_object_t *object = cache->c_objects[--cache->c_count];
+		object->next = slab->s_free;
+		slab->s_free = object;
+	}
+}
+
+// Gives a thread's cache back to the shared free list when the thread exits
+static void cache_release(void *arg) {
+	slab_cache_t *cache = arg;
+	pthread_mutex_lock(&cache->c_slab->s_lock);
+	cache_spill(cache, cache->c_count);
+	pthread_mutex_unlock(&cache->c_slab->s_lock);
+	free(cache);
+}
+
+static slab_cache_t *cache_get(slab_t *slab) {
+	slab_cache_t *cache = pthread_getspecific(slab->s_cache_key);
+	if (cache != NULL) {
+		return cache;
+	}
+
+	cache = malloc(sizeof(slab_cache_t));
+	if (cache == NULL) {
+		return NULL;
+	}
+	cache->c_slab = slab;
+	cache->c_count = 0;
+	if (pthread_setspecific(slab->s_cache_key, cache) != 0) {
+		free(cache);
+		return NULL;
+	}
+	return cache;
+}
+
+// Fills half the cache from the shared free list, carving a new chunk if it
+// runs out. Called with s_lock held.
+// Returns 0 if successful, -1 if no memory is left.
+static int cache_refill(slab_cache_t *cache) {
+	slab_t *slab = cache->c_slab;
+	while (cache->c_count < SLAB_CACHE_SIZE / 2) {
+		if (slab->s_free == NULL) {
+			size_t objects_size = slab->s_chunk_objects * slab->s_object_size;
+			chunk_t *chunk = malloc(sizeof(chunk_t) + objects_size);
+			if (chunk == NULL) {
+				return cache->c_count > 0 ? 0 : -1;
+			}
+			chunk->next = slab->s_chunks;
+			slab->s_chunks = chunk;
+			for (size_t i = slab->s_chunk_objects; i-- > 0;) {
+				char *start = chunk->objects + i * slab->s_object_size;
+				free_object_t *object = (free_object_t *)start;
+				object->next = slab->s_free;
+				slab->s_free = object;
+			}
+		}
+
+		free_object_t *object = slab->s_free;
+		slab->s_free = object->next;
+		cache->c_objects[cache->c_count++] = object;
+	}
+	return 0;
+}
+
+/**
+ * Initialize a slab of objects of object_size bytes.
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+int slab_init(slab_t *slab, size_t object_size) {
+	size_t align = alignof(max_align_t);
+	if (object_size < sizeof(free_object_t)) {
+		object_size = sizeof(free_object_t);
+	}
+	slab->s_object_size = (object_size + align - 1) / align * align;
+	slab->s_chunk_objects =
+		(SLAB_CHUNK_SIZE - sizeof(chunk_t)) / slab->s_object_size;
+	if (slab->s_chunk_objects == 0) {
+		slab->s_chunk_objects = 1;
+	}
+	slab->s_free = NULL;
+	slab->s_chunks = NULL;
+
+	if (pthread_key_create(&slab->s_cache_key, cache_release) != 0) {
+		return -1;
+	}
+	if (pthread_mutex_init(&slab->s_lock, NULL) != 0) {
+		pthread_key_delete(slab->s_cache_key);
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * Free every chunk of the slab. Only the calling thread's cache is freed:
+ * no other thread may use the slab anymore.
+ */
+void slab_destroy(slab_t *slab) {
+	free(pthread_getspecific(slab->s_cache_key));
+	pthread_key_delete(slab->s_cache_key);
+
+	chunk_t *chunk = slab->s_chunks;
+	while (chunk != NULL) {
+		chunk_t *next = chunk->next;
+		free(chunk);
+		chunk = next;
+	}
+	pthread_mutex_destroy(&slab->s_lock);
+}
+
+/**
+ * Allocate an object, uninitialized.
+ *
+ * Returns NULL if no memory is left.
+ */
+void *slab_alloc(slab_t *slab) {
+	slab_cache_t *cache = cache_get(slab);
+	if (cache == NULL) {
+		return NULL;
+	}
+
+	if (cache->c_count == 0) {
+		pthread_mutex_lock(&slab->s_lock);
+		int ret = cache_refill(cache);
+		pthread_mutex_unlock(&slab->s_lock);
+		if (ret != 0) {
+			return NULL;
+		}
+	}
+	return cache->c_objects[--cache->c_count];
+}
+
+/**
+ * Give an object back to the slab. Any thread may free an object, wherever
+ * it was allocated.
+ */
+void slab_free(slab_t *slab, void *object) {
+	slab_cache_t *cache = cache_get(slab);
+	if (cache == NULL) {
+		// no cache to keep it in: straight to the shared free list
+		pthread_mutex_lock(&slab->s_lock);
+		((free_object_t *)object)->next = slab->s_free;
+		slab->s_free = object;
+		pthread_mutex_unlock(&slab->s_lock);
+		return;
+	}
+
+	if (cache->c_count == SLAB_CACHE_SIZE) {
+		pthread_mutex_lock(&slab->s_lock);
+		cache_spill(cache, SLAB_CACHE_SIZE / 2);
+		pthread_mutex_unlock(&slab->s_lock);
+	}
+	cache->c_objects[cache->c_count++] = object;
+}
@@ -0,0 +1,28 @@
+#ifndef __UTILS_SLAB_H__
+#define __UTILS_SLAB_H__
+
+#include <pthread.h>
+#include <stddef.h>
+
+// Fixed-size object allocator. Objects are carved out of SLAB_CHUNK_SIZE
+// chunks, which are only given back by slab_destroy; freed objects go to the
+// freeing thread's cache, and move to and from the shared free list
+// SLAB_CACHE_SIZE / 2 at a time, so most allocations and frees take no lock.
+#define SLAB_CHUNK_SIZE (64 * 1024)
+#define SLAB_CACHE_SIZE 32
+
+typedef struct {
+	size_t s_object_size;
+	size_t s_chunk_objects;
+	pthread_key_t s_cache_key; // the calling thread's slab_cache_t
+	pthread_mutex_t s_lock;
+	void *s_free;	// shared free list, linked through each object
+	void *s_chunks; // every chunk allocated
+} slab_t;
+
+int slab_init(slab_t *slab, size_t object_size);
+void slab_destroy(slab_t *slab);
+void *slab_alloc(slab_t *slab);
+void slab_free(slab_t *slab, void *object);
+
+#endif // __UTILS_SLAB_H__
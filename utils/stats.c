@@ -0,0 +1,195 @@
+#include "stats.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+// A thread's counters and histograms. Only the owning thread writes them, with
+// plain relaxed loads and stores (no locked instructions); stats_snapshot
+// reads them from other threads at any time.
+typedef struct shard {
+	_Atomic uint64_t counters[STATS_COUNTERS];
+	struct {
+		_Atomic uint64_t counts[HIST_SIZE];
+		_Atomic uint64_t sum;
+		_Atomic uint64_t max;
+	} histograms[STATS_HISTOGRAMS];
+	_Atomic bool in_use; // owned by a live thread
+	struct shard *next;
+} shard_t;
+
+// Every shard ever created. Shards outlive their threads, so nothing counted
+// is lost, and are handed to new threads.
+static shard_t *shards;
+static pthread_mutex_t shards_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t shard_key;
+static pthread_once_t shard_key_once = PTHREAD_ONCE_INIT;
+static _Thread_local shard_t *my_shard;
+
+static char const *const counter_names[STATS_COUNTERS] = {
+	[STATS_REQUESTS] = "requests",
+	[STATS_REQUESTS_DROPPED] = "requests_dropped",
+	[STATS_MESSAGES_IN] = "messages_in",
+	[STATS_BYTES_IN] = "bytes_in",
+	[STATS_MESSAGES_OUT] = "messages_out",
+};
+
+static char const *const histogram_names[STATS_HISTOGRAMS] = {
+	[STATS_TFS_WRITE_NS] = "tfs_write_ns",
+	[STATS_TFS_READ_NS] = "tfs_read_ns",
+	[STATS_BOX_LOCK_WAIT_NS] = "box_lock_wait_ns",
+	[STATS_TABLE_LOCK_WAIT_NS] = "table_lock_wait_ns",
+	[STATS_QUEUE_WAIT_NS] = "queue_wait_ns",
+};
+
+static void shard_release(void *shard) {
+	((shard_t *)shard)->in_use = false;
+}
+
+static void shard_key_create(void) {
+	pthread_key_create(&shard_key, shard_release);
+}
+
+static shard_t *shard_get(void) {
+	if (my_shard != NULL) {
+		return my_shard;
+	}
+
+	pthread_once(&shard_key_once, shard_key_create);
+	pthread_mutex_lock(&shards_lock);
+	shard_t *shard = shards;
+	while (shard != NULL && shard->in_use) {
+		shard = shard->next;
+	}
+	if (shard == NULL) {
+		shard = calloc(1, sizeof(shard_t));
+		if (shard == NULL) {
+			pthread_mutex_unlock(&shards_lock);
+			return NULL; // this thread goes uncounted
+		}
+		shard->next = shards;
+		shards = shard;
+	}
+	shard->in_use = true;
+	pthread_mutex_unlock(&shards_lock);
+
+	pthread_setspecific(shard_key, shard);
+	my_shard = shard;
+	return shard;
+}
+
+static inline void add(_Atomic uint64_t *value, uint64_t n) {
+	atomic_store_explicit(
+		value, atomic_load_explicit(value, memory_order_relaxed) + n,
+		memory_order_relaxed);
+}
+
+static size_t histogram_index(uint64_t value) {
+	if (value < HIST_SUB) {
+		return (size_t)value;
+	}
+	unsigned msb = 63u - (unsigned)__builtin_clzll(value);
+	if (msb >= HIST_MAX_BITS) {
+		return HIST_SIZE - 1;
+	}
+	unsigned shift = msb - HIST_SUB_BITS;
+	return (shift + 1) * HIST_SUB + ((value >> shift) & (HIST_SUB - 1));
+}
+
+// Lowest value in a bucket
+static uint64_t histogram_value(size_t index) {
+	if (index < HIST_SUB) {
+		return index;
+	}
+	size_t shift = index / HIST_SUB - 1;
+	return (uint64_t)(HIST_SUB + index % HIST_SUB) << shift;
+}
+
+/**
+ * Add to one of the calling thread's counters.
+ */
+void stats_count(stats_counter_t counter, uint64_t n) {
+	shard_t *shard = shard_get();
+	if (shard != NULL) {
+		add(&shard->counters[counter], n);
+	}
+}
+
+/**
+ * Record a value in one of the calling thread's histograms.
+ */
+void stats_record(stats_histogram_t histogram, uint64_t value) {
+	shard_t *shard = shard_get();
+	if (shard == NULL) {
+		return;
+	}
+	add(&shard->histograms[histogram].counts[histogram_index(value)], 1);
+	add(&shard->histograms[histogram].sum, value);
+	if (value > atomic_load_explicit(&shard->histograms[histogram].max,
+									 memory_order_relaxed)) {
+		atomic_store_explicit(&shard->histograms[histogram].max, value,
+							  memory_order_relaxed);
+	}
+}
+
+/**
+ * Add up every thread's counters and histograms.
+ *
+ * Threads keep counting meanwhile, so a histogram's count may be slightly off
+ * its sum.
+ */
+void stats_snapshot(stats_snapshot_t *snapshot) {
+	memset(snapshot, 0, sizeof(*snapshot));
+
+	pthread_mutex_lock(&shards_lock);
+	for (shard_t *shard = shards; shard != NULL; shard = shard->next) {
+		for (size_t c = 0; c < STATS_COUNTERS; c++) {
+			snapshot->s_counters[c] += shard->counters[c];
+		}
+		for (size_t h = 0; h < STATS_HISTOGRAMS; h++) {
+			histogram_t *out = &snapshot->s_histograms[h];
+			for (size_t i = 0; i < HIST_SIZE; i++) {
+				uint64_t count = shard->histograms[h].counts[i];
+				out->h_counts[i] += count;
+				out->h_count += count;
+			}
+			out->h_sum += shard->histograms[h].sum;
+			if (shard->histograms[h].max > out->h_max) {
+				out->h_max = shard->histograms[h].max;
+			}
+		}
+	}
+	pthread_mutex_unlock(&shards_lock);
+}
+
+/**
+ * Value below which a fraction p of a histogram's values fall, to within the
+ * histogram's precision.
+ */
+uint64_t histogram_percentile(histogram_t const *histogram, double p) {
+	if (histogram->h_count == 0) {
+		return 0;
+	}
+	uint64_t rank = (uint64_t)(p * (double)histogram->h_count);
+	if (rank >= histogram->h_count) {
+		rank = histogram->h_count - 1;
+	}
+
+	uint64_t seen = 0;
+	for (size_t i = 0; i < HIST_SIZE; i++) {
+		seen += histogram->h_counts[i];
+		if (seen > rank) {
+			uint64_t value = histogram_value(i);
+			return value < histogram->h_max ? value : histogram->h_max;
+		}
+	}
+	return histogram->h_max;
+}
+
+char const *stats_counter_name(stats_counter_t counter) {
+	return counter_names[counter];
+}
+
+char const *stats_histogram_name(stats_histogram_t histogram) {
+	return histogram_names[histogram];
+}
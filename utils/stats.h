@@ -0,0 +1,65 @@
+#ifndef __UTILS_STATS_H__
+#define __UTILS_STATS_H__
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+// Hot-path instrumentation: counters and latency histograms, kept per thread
+// so that recording never touches a shared cache line, and merged on demand.
+
+typedef enum {
+	STATS_REQUESTS,			// requests taken off the server fifo
+	STATS_REQUESTS_DROPPED, // requests no pool had room for
+	STATS_MESSAGES_IN,		// messages published into boxes
+	STATS_BYTES_IN,			// bytes of those messages
+	STATS_MESSAGES_OUT,		// messages delivered to subscribers
+	STATS_COUNTERS,
+} stats_counter_t;
+
+typedef enum {
+	STATS_TFS_WRITE_NS,		  // tfs_write calls
+	STATS_TFS_READ_NS,		  // tfs_read calls
+	STATS_BOX_LOCK_WAIT_NS,	  // waiting for a box_lock
+	STATS_TABLE_LOCK_WAIT_NS, // waiting for a box table stripe
+	STATS_QUEUE_WAIT_NS,	  // requests waiting for a worker
+	STATS_HISTOGRAMS,
+} stats_histogram_t;
+
+// HDR-style histogram: values below 2^HIST_SUB_BITS have their own bucket;
+// above that, every power of two is split into 2^HIST_SUB_BITS buckets, so a
+// value is known to within 1/2^HIST_SUB_BITS. Values from 2^HIST_MAX_BITS
+// (about 18 minutes, in ns) on all land in the last bucket.
+#define HIST_SUB_BITS 4
+#define HIST_SUB (1u << HIST_SUB_BITS)
+#define HIST_MAX_BITS 40
+#define HIST_SIZE ((HIST_MAX_BITS - HIST_SUB_BITS + 1) * HIST_SUB)
+
+typedef struct {
+	uint64_t h_counts[HIST_SIZE];
+	uint64_t h_count;
+	uint64_t h_sum;
+	uint64_t h_max;
+} histogram_t;
+
+// Every thread's counters and histograms, added up
+typedef struct {
+	uint64_t s_counters[STATS_COUNTERS];
+	histogram_t s_histograms[STATS_HISTOGRAMS];
+} stats_snapshot_t;
+
+static inline uint64_t stats_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+void stats_count(stats_counter_t counter, uint64_t n);
+void stats_record(stats_histogram_t histogram, uint64_t value);
+void stats_snapshot(stats_snapshot_t *snapshot);
+uint64_t histogram_percentile(histogram_t const *histogram, double p);
+char const *stats_counter_name(stats_counter_t counter);
+char const *stats_histogram_name(stats_histogram_t histogram);
+
+#endif // __UTILS_STATS_H__